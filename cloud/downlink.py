@@ -0,0 +1,124 @@
+"""Weather downlinks encoded with the generated codec.
+
+The bridge remembers the state each device has acknowledged, and sends
+only the fields that changed since. IoT Core completes a command only once
+the device has acked it at QoS 1, so a successful send is what the device
+now holds. Devices also report their state's sequence number with every
+location, and a device that lost or never got that state gets a full
+update again.
+"""
+import threading
+from typing import Callable, Optional
+
+import downlink_codec as codec
+
+
+def deci(value: str) -> int:
+        return round(float(value) * 10)
+
+
+def fields_from_text(weather: str) -> dict:
+        """Fields from the cached "status;icon;temperature;location;condition;
+        hours;days" text. Entries cached before the condition or the
+        forecast were added lack them.
+
+        hours are comma separated "hour/night/condition/temperature", days
+        "weekday/condition/min/max".
+        """
+        status, icon, temperature, location, *extra = weather.split(";")
+        fields = {
+                "status": status,
+                "icon": icon,
+                "temperature": deci(temperature),
+                "location": location,
+        }
+        if len(extra) > 0:
+                fields["condition"] = int(extra[0])
+        if len(extra) > 1:
+                fields["hours"] = []
+                for entry in filter(None, extra[1].split(",")):
+                        hour, night, condition, temp = entry.split("/")
+                        fields["hours"].append({"hour": int(hour), "night": int(night),
+                                                "condition": int(condition), "temperature": deci(temp)})
+        if len(extra) > 2:
+                fields["days"] = []
+                for entry in filter(None, extra[2].split(",")):
+                        weekday, condition, temp_min, temp_max = entry.split("/")
+                        fields["days"].append({"weekday": int(weekday), "condition": int(condition),
+                                               "temp_min": deci(temp_min), "temp_max": deci(temp_max)})
+        return fields
+
+
+class Baselines():
+        def __init__(self, send: Callable[[str, bytes], None]) -> None:
+                # send(deviceName, payload) delivers a command to a device
+                self.send_raw = send
+                self.lock = threading.Lock()
+                self.devices = {}
+                self.device_locks = {}
+
+                self.full = 0
+                self.full_bytes = 0
+                self.delta = 0
+                self.delta_bytes = 0
+                self.text_bytes = 0
+
+        def _device_lock(self, device: str) -> threading.Lock:
+                with self.lock:
+                        return self.device_locks.setdefault(device, threading.Lock())
+
+        def reported(self, device: str, seq: Optional[int]) -> None:
+                """A device said which state it holds."""
+                with self.lock:
+                        base = self.devices.get(device)
+                        if base and base[0] != seq:
+                                del self.devices[device]
+
+        def send(self, device: str, request_id: int, weather: str) -> None:
+                fields = fields_from_text(weather)
+
+                # One downlink per device at a time so both sides agree
+                # on the state each delta applies to
+                with self._device_lock(device):
+                        with self.lock:
+                                base = self.devices.get(device)
+
+                        if base:
+                                base_seq, base_fields = base
+                                changed = {k: v for k, v in fields.items() if base_fields.get(k) != v}
+                                seq = base_seq % 255 + 1 if changed else base_seq
+                                payload = codec.encode(request_id, seq, base_seq, changed, delta=True)
+                        else:
+                                seq = 1
+                                payload = codec.encode(request_id, seq, 0, fields)
+
+                        try:
+                                self.send_raw(device, payload)
+                        except Exception:
+                                # The device may or may not have it now
+                                with self.lock:
+                                        self.devices.pop(device, None)
+                                raise
+
+                        with self.lock:
+                                self.devices[device] = (seq, fields)
+                                if base:
+                                        self.delta += 1
+                                        self.delta_bytes += len(payload)
+                                else:
+                                        self.full += 1
+                                        self.full_bytes += len(payload)
+                                self.text_bytes += len(f"{request_id};{weather}")
+
+        def stats(self) -> dict:
+                with self.lock:
+                        sent = self.full + self.delta
+                        total = self.full_bytes + self.delta_bytes
+                        return {
+                                "full": self.full,
+                                "delta": self.delta,
+                                "avg_full_bytes": round(self.full_bytes / self.full, 1) if self.full else 0,
+                                "avg_delta_bytes": round(self.delta_bytes / self.delta, 1) if self.delta else 0,
+                                "avg_text_bytes": round(self.text_bytes / sent, 1) if sent else 0,
+                                "saved": round(1 - total / self.text_bytes, 3) if self.text_bytes else 0.0,
+                        }
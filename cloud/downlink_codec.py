@@ -0,0 +1,76 @@
+"""Generated from schema/downlink.json by scripts/downlink_gen.py, do not edit"""
+import struct
+
+VERSION = 1
+HDR_SIZE = 7
+FLAG_DELTA = 0x01
+
+# (name, type, max length, size or items)
+FIELDS = [
+        ('status', 'str', 31),
+        ('icon', 'str', 3),
+        ('temperature', 'i16', 2),
+        ('location', 'str', 31),
+        ('condition', 'u16', 2),
+        ('hours', 'list', 4),
+        ('days', 'list', 4),
+]
+
+# Record format and item names of lists
+LISTS = {
+        'hours': (">BBHh", ['hour', 'night', 'condition', 'temperature']),
+        'days': (">BHhh", ['weekday', 'condition', 'temp_min', 'temp_max']),
+}
+
+INT_FORMATS = {"u8": ">B", "u16": ">H", "i16": ">h", "u32": ">I"}
+
+
+def encode(msg_id: int, seq: int, base: int, fields: dict, delta: bool = False) -> bytes:
+        """Encodes the given fields, all of them unless delta is set."""
+        mask = 0
+        body = bytearray()
+        for i, (name, kind, size) in enumerate(FIELDS):
+                if name not in fields:
+                        continue
+                if kind == "str":
+                        value = str(fields[name]).encode("utf8")[:size]
+                        # Do not cut a multibyte character in half
+                        value = value.decode("utf8", "ignore").encode("utf8")
+                elif kind == "list":
+                        fmt, keys = LISTS[name]
+                        value = b"".join(struct.pack(fmt, *(item[k] for k in keys)) for item in fields[name][:size])
+                else:
+                        value = struct.pack(INT_FORMATS[kind], fields[name])
+                mask |= 1 << i
+                body.append(len(value))
+                body.extend(value)
+        flags = FLAG_DELTA if delta else 0
+        return struct.pack(">BHBBH", VERSION << 4 | flags, msg_id, seq, base, mask) + bytes(body)
+
+
+def decode(data: bytes) -> dict:
+        head, msg_id, seq, base, mask = struct.unpack(">BHBBH", data[:HDR_SIZE])
+        if head >> 4 != VERSION:
+                raise ValueError(f"schema version {head >> 4}")
+        fields = {}
+        pos = HDR_SIZE
+        for i in range(16):
+                if not mask & (1 << i):
+                        continue
+                n = data[pos]
+                value = data[pos + 1:pos + 1 + n]
+                if len(value) != n:
+                        raise ValueError("truncated")
+                pos += 1 + n
+                if i >= len(FIELDS):
+                        continue
+                name, kind, _ = FIELDS[i]
+                if kind == "str":
+                        fields[name] = value.decode("utf8")
+                elif kind == "list":
+                        fmt, keys = LISTS[name]
+                        step = struct.calcsize(fmt)
+                        fields[name] = [dict(zip(keys, struct.unpack_from(fmt, value, k))) for k in range(0, n, step)]
+                else:
+                        fields[name] = struct.unpack(INT_FORMATS[kind], value)[0]
+        return {"msg_id": msg_id, "seq": seq, "base": base, "delta": bool(head & FLAG_DELTA), "fields": fields}
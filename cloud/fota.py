@@ -0,0 +1,155 @@
+"""Delta firmware updates for the TTK8 devices over the MQTT bridge.
+
+The delta format and chunk framing match include/fota_delta.h in the
+firmware. Usage:
+
+        python fota.py make <running.bin> <new.bin> deltas/<name>.delta
+        python fota.py start <deviceId> deltas/<name>.delta
+
+"make" diffs two signed MCUboot images (app_update.bin). "start" pushes
+the first chunk to a device; after that the device pulls the rest by
+publishing "image_id;offset" to the fota subfolder, which main.py routes
+to FotaServer.on_request. The bridge serves every delta in FOTA_DIR.
+"""
+import os
+import struct
+import sys
+import time
+import zlib
+
+DELTA_MAGIC = 0x54444c54
+CHUNK_VERSION = 1
+CHUNK_SIZE = 512
+
+OP_COPY = 0x01
+OP_INSERT = 0x02
+
+# Shortest match worth a copy op (9 bytes) over inserting the bytes
+MIN_MATCH = 16
+MAX_CANDIDATES = 32
+
+FOTA_DIR = os.environ.get("FOTA_DIR", "deltas")
+
+
+def make_delta(source: bytes, target: bytes) -> bytes:
+        """Greedy copy/insert diff of target against source."""
+        index = {}
+        for i in range(0, len(source) - MIN_MATCH + 1):
+                key = source[i:i + MIN_MATCH]
+                offsets = index.setdefault(key, [])
+                if len(offsets) < MAX_CANDIDATES:
+                        offsets.append(i)
+
+        out = bytearray(struct.pack(">IIIII",
+                DELTA_MAGIC,
+                len(source), zlib.crc32(source) & 0xffffffff,
+                len(target), zlib.crc32(target) & 0xffffffff))
+        literal = bytearray()
+
+        def flush_literal():
+                if literal:
+                        out.extend(struct.pack(">BI", OP_INSERT, len(literal)))
+                        out.extend(literal)
+                        literal.clear()
+
+        pos = 0
+        while pos < len(target):
+                best_off, best_len = 0, 0
+                for off in index.get(target[pos:pos + MIN_MATCH], ()):
+                        length = MIN_MATCH
+                        while (pos + length < len(target) and off + length < len(source)
+                               and target[pos + length] == source[off + length]):
+                                length += 1
+                        if length > best_len:
+                                best_off, best_len = off, length
+
+                if best_len >= MIN_MATCH:
+                        flush_literal()
+                        out.extend(struct.pack(">BII", OP_COPY, best_off, best_len))
+                        pos += best_len
+                else:
+                        literal.append(target[pos])
+                        pos += 1
+
+        flush_literal()
+        return bytes(out)
+
+
+def image_id(delta: bytes) -> int:
+        return zlib.crc32(delta) & 0xffffffff
+
+
+def chunk(delta: bytes, offset: int, size: int = CHUNK_SIZE) -> bytes:
+        data = delta[offset:offset + size]
+        return struct.pack(">BBHIII", CHUNK_VERSION, 0, len(data),
+                image_id(delta), offset, len(delta)) + data
+
+
+class FotaServer():
+        """Answers chunk requests for the deltas in FOTA_DIR."""
+
+        def __init__(self, send, directory: str = FOTA_DIR) -> None:
+                # send(deviceName, payload) delivers a command to a device
+                self.send = send
+                self.directory = directory
+                self.deltas = {}
+                self.started = {}
+
+        def load(self) -> None:
+                if not os.path.isdir(self.directory):
+                        return
+                for name in os.listdir(self.directory):
+                        if name.endswith(".delta"):
+                                delta = open(os.path.join(self.directory, name), "rb").read()
+                                self.deltas[image_id(delta)] = delta
+
+        def start(self, device_name: str, delta: bytes) -> None:
+                self.send(device_name, chunk(delta, 0))
+
+        def on_request(self, device_name: str, data: str) -> None:
+                try:
+                        iid, offset = (int(v) for v in data.split(";"))
+                except ValueError:
+                        print("bad fota request", data)
+                        return
+
+                if iid not in self.deltas:
+                        self.load()
+                delta = self.deltas.get(iid)
+                if delta is None or offset >= len(delta):
+                        print("unknown fota request", data)
+                        return
+
+                if offset == CHUNK_SIZE:
+                        # First request follows the pushed first chunk
+                        self.started[(device_name, iid)] = time.monotonic()
+
+                self.send(device_name, chunk(delta, offset))
+                if offset + CHUNK_SIZE >= len(delta):
+                        began = self.started.pop((device_name, iid), None)
+                        took = f" in {time.monotonic() - began:.0f} s" if began else ""
+                        print(f"Sent last chunk of {iid} ({len(delta)} bytes) to {device_name}{took}")
+
+
+def main(argv) -> None:
+        if len(argv) == 5 and argv[1] == "make":
+                source = open(argv[2], "rb").read()
+                target = open(argv[3], "rb").read()
+                delta = make_delta(source, target)
+                open(argv[4], "wb").write(delta)
+                print(f"delta {len(delta)} bytes for {len(target)} byte image "
+                      f"({100 * len(delta) / len(target):.1f}%), image id {image_id(delta)}")
+                chunks = (len(delta) + CHUNK_SIZE - 1) // CHUNK_SIZE
+                full = (len(target) + CHUNK_SIZE - 1) // CHUNK_SIZE
+                print(f"{chunks} chunks vs {full} for the full image")
+        elif len(argv) == 4 and argv[1] == "start":
+                from main import device_name, send_command
+                delta = open(argv[3], "rb").read()
+                FotaServer(send_command).start(device_name(argv[2]), delta)
+        else:
+                print(__doc__)
+                sys.exit(1)
+
+
+if __name__ == "__main__":
+        main(sys.argv)
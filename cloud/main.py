@@ -1,13 +1,46 @@
-from os import stat
+import os
+import sys
+import threading
+from concurrent.futures import ThreadPoolExecutor
 from google.api_core import future
 from google.cloud import pubsub, iot
+from google.cloud.pubsub_v1.subscriber.scheduler import ThreadScheduler
 from google.cloud.iot_v1.types.resources import Device
 import pyowm
 from pyowm.utils import timestamps
 import time
+from datetime import datetime
+from zoneinfo import ZoneInfo
+
+from downlink import Baselines
+from fota import FotaServer
+from pipeline import DownlinkBatcher, StageStats
+from push import PushScheduler
+from sharding import Deduplicator, Owners, Router, StaleGuard
+from telemetry import FleetTelemetry
+from weather_cache import PlaceCache, WeatherCache
 
 NAME = "ttk8-weather"
 PROJECT = "wearebrews"
+REGION = "europe-west1"
+REGISTRY = "brews-iot"
+
+# Flow control: messages handled at once, and the most held unacked
+WORKERS = int(os.environ.get("BRIDGE_WORKERS", "16"))
+MAX_MESSAGES = int(os.environ.get("BRIDGE_MAX_MESSAGES", "100"))
+MAX_BYTES = int(os.environ.get("BRIDGE_MAX_BYTES", str(1024 * 1024)))
+DOWNLINK_WORKERS = int(os.environ.get("BRIDGE_DOWNLINK_WORKERS", "8"))
+
+# Device events as published by IoT Core, and republished by the router
+# with the deviceId as ordering key for the shards
+EVENTS_SUBSCRIPTION = f"events-iot-{NAME}"
+ORDERED_TOPIC = f"events-iot-{NAME}-ordered"
+ORDERED_SUBSCRIPTION = f"events-iot-{NAME}-ordered"
+
+# Subfolders of the location requests and weather answers, one letter
+# as they go with every round trip
+LOCATION_SUBFOLDER = "l"
+WEATHER_SUBFOLDER = "w"
 
 owm = pyowm.OWM("8da2a4a8aedc13702034b4ed7a5dbe6c")
 
@@ -23,44 +56,221 @@ class Weather():
                 mgr = owm.weather_manager()
                 resp = mgr.one_call(lat, long)
                 self.current = resp.current
-                
+                self.hourly = resp.forecast_hourly or []
+                self.daily = resp.forecast_daily or []
+                self.zone = ZoneInfo(resp.timezone) if resp.timezone else None
+                self.location = place_cache.get(lat, long)
+
         def format_embedded(self) -> str:
-                return f"{self.current.status};{self.current.temperature('celsius').get('temp')}"
+                # The fields of schema/downlink.json, as cached
+                location = self.location.replace(";", ",")
+                return (f"{self.current.status};{self.current.weather_icon_name};"
+                        f"{self.current.temperature('celsius').get('temp')};{location};"
+                        f"{self.current.weather_code};{self.format_hours()};{self.format_days()}")
 
-def get_weather_for_loc(lat: float, lon: float) -> str:
+        def local_time(self, w) -> datetime:
+                return datetime.fromtimestamp(w.reference_time(), self.zone)
+
+        def format_hours(self) -> str:
+                # Every third hour from the next one, "hour/night/code/temp"
+                hours = self.hourly[1::3][:4]
+                return ",".join(f"{self.local_time(w).hour}/{int(w.weather_icon_name.endswith('n'))}/"
+                                f"{w.weather_code}/{w.temperature('celsius').get('temp')}" for w in hours)
+
+        def format_days(self) -> str:
+                # From tomorrow, "weekday/code/min/max" with Monday as 0
+                days = self.daily[1:5]
+                return ",".join(f"{self.local_time(w).weekday()}/{w.weather_code}/"
+                                f"{w.temperature('celsius').get('min')}/{w.temperature('celsius').get('max')}"
+                                for w in days)
+
+def reverse_geocode(lat: float, lon: float) -> str:
+        places = owm.geocoding_manager().reverse_geocode(lat, lon, limit=1)
+        return places[0].name if places else ""
+
+
+def fetch_weather(lat: float, lon: float) -> str:
         return Weather(lat, lon).format_embedded()
 
 
+place_cache = PlaceCache(reverse_geocode)
+weather_cache = WeatherCache(fetch_weather)
+stage_stats = StageStats()
+STATS_INTERVAL_S = 60
+last_stats = time.monotonic()
+stats_lock = threading.Lock()
+
+
+def print_stats() -> None:
+        global last_stats
+        with stats_lock:
+                due = time.monotonic() - last_stats >= STATS_INTERVAL_S
+                if due:
+                        last_stats = time.monotonic()
+        if due:
+                print("weather cache", weather_cache.stats())
+                print("place names", place_cache.stats())
+                print("stages", stage_stats.report())
+                print("duplicates", dedup.duplicates, "stale", stale_guard.stale, "owner changes", owners.taken)
+                print("push", push.stats())
+                print("downlink", baselines.stats())
+                print("telemetry", telemetry.stats())
+
+
+def get_weather_for_loc(lat: float, lon: float) -> str:
+        return weather_cache.get(lat, lon)
+
+
+
+def device_name(deviceId: str, projectId: str = PROJECT, deviceRegistryLocation: str = REGION, deviceRegistryId: str = REGISTRY, **kwargs) -> str:
+        return f"projects/{projectId}/locations/{deviceRegistryLocation}/registries/{deviceRegistryId}/devices/{deviceId}"
+
+
+def send_command(name: str, payload: bytes, subfolder: str = "fota") -> None:
+        iot_client.send_command_to_device(name=name, binary_data=payload, subfolder=subfolder)
+
+
+fota = FotaServer(send_command)
+
+
+def send_weather_command(deviceName: str, payload: bytes) -> None:
+        # A command is delivered once, unlike config which the broker
+        # resends on every reconnect and keeps as a new version
+        send_command(deviceName, payload, subfolder=WEATHER_SUBFOLDER)
+
+
+baselines = Baselines(send_weather_command)
 
-def set_device_config(payload: str, projectId: str, deviceRegistryLocation: str, deviceRegistryId: str, deviceId: str, **kwargs) -> Device:
-        deviceName = f"projects/{projectId}/locations/{deviceRegistryLocation}/registries/{deviceRegistryId}/devices/{deviceId}"
-        iot_client.modify_cloud_to_device_config(name=deviceName, binary_data=bytes(payload, encoding="utf8"))
+
+def send_weather(deviceName: str, request_id: int, weather: str) -> None:
+        baselines.send(deviceName, request_id, weather)
+
+
+downlink = DownlinkBatcher(lambda name, p: send_weather(name, *p), DOWNLINK_WORKERS, stage_stats)
+dedup = Deduplicator()
+stale_guard = StaleGuard()
+owners = Owners()
+push = PushScheduler(get_weather_for_loc, send_weather, owns=owners.owns)
+telemetry = FleetTelemetry()
 
 
 def on_message(message):
-        print(message)
-        message.ack()
+        received = time.monotonic()
+        stage_stats.record("pubsub", time.time() - message.publish_time.timestamp())
+
+        owners.claim(device_name(**message.attributes))
+
+        if message.attributes["subFolder"] == "telemetry":
+                # Binary, see telemetry.py
+                telemetry.on_summary(device_name(**message.attributes), message.data)
+                message.ack()
+                return
+
         data = str(message.data, encoding="utf8")
 
-        if message.attributes["subFolder"] != "weather/location":
+        if message.attributes["subFolder"] == "fota":
+                fota.on_request(device_name(**message.attributes), data)
+                message.ack()
+                return
+
+        if message.attributes["subFolder"] == "psm":
+                push.on_psm(device_name(**message.attributes), data)
+                message.ack()
+                return
+
+        if message.attributes["subFolder"] != LOCATION_SUBFOLDER:
+                message.ack()
                 return
 
         try:
-                lat, lon = data.split(";")
-                lat, lon = float(lat), float(lon)
+                # "lat;lon;request_id;seq", the id is echoed in the response
+                # and seq is the forecast state the device holds
+                fields = data.split(";")
+                lat, lon, request_id = float(fields[0]), float(fields[1]), int(fields[2])
+                seq = int(fields[3]) if len(fields) > 3 else None
         except Exception as e:
                 # Wrong format, ignore!
                 print("error", e)
+                message.ack()
+                return
+
+        device = message.attributes["deviceId"]
+        event_id = message.attributes.get("eventId", message.message_id)
+        published = float(message.attributes.get("eventTime", message.publish_time.timestamp()))
+
+        if not dedup.first_time(event_id) or stale_guard.is_stale(device, published):
+                message.ack()
                 return
-        
-        payload = get_weather_for_loc(lat, lon)
-        print("Sending", payload, "to", message.attributes["deviceId"])
-        set_device_config(payload, **message.attributes)
-
-with pubsub.SubscriberClient() as subscriber:
-        name=f"projects/{PROJECT}/subscriptions/events-iot-{NAME}"
-        sub = subscriber.subscribe(name, on_message)
+
+        name = device_name(**message.attributes)
+        push.seen(name, lat, lon)
+        baselines.reported(name, seq)
+
+        start = time.monotonic()
         try:
-                sub.result()
-        except KeyboardInterrupt:
-                sub.cancel()
+                weather = get_weather_for_loc(lat, lon)
+        except Exception as e:
+                # Redelivered by Pub/Sub once the weather API recovers
+                print("weather lookup failed", e)
+                dedup.forget(event_id)
+                message.nack()
+                return
+        stage_stats.record("weather", time.monotonic() - start)
+
+        def delivered(ok: bool) -> None:
+                # Only ack once the device has been given its weather
+                if ok:
+                        stale_guard.delivered(device, published)
+                        push.sent(name, weather)
+                        message.ack()
+                else:
+                        dedup.forget(event_id)
+                        message.nack()
+                stage_stats.record("total", time.monotonic() - received)
+                print_stats()
+
+        print("Sending", request_id, weather, "to", message.attributes["deviceId"])
+        downlink.submit(name, (request_id, weather), delivered)
+
+
+if __name__ == "__main__":
+        # "router" runs only the republisher, "shard" only a bridge shard.
+        # Without an argument both run in this process. "setup" creates
+        # the ordered topic and subscription the shards share.
+        mode = sys.argv[1] if len(sys.argv) > 1 else "all"
+        subs = []
+
+        if mode == "setup":
+                topic = f"projects/{PROJECT}/topics/{ORDERED_TOPIC}"
+                publisher.create_topic(name=topic)
+                with pubsub.SubscriberClient() as subscriber:
+                        subscriber.create_subscription(request={
+                                "name": f"projects/{PROJECT}/subscriptions/{ORDERED_SUBSCRIPTION}",
+                                "topic": topic,
+                                "enable_message_ordering": True,
+                        })
+                sys.exit(0)
+
+        with pubsub.SubscriberClient() as subscriber:
+                if mode in ("router", "all"):
+                        router = Router(PROJECT, ORDERED_TOPIC)
+                        # One thread, so events are republished in the order they came
+                        scheduler = ThreadScheduler(ThreadPoolExecutor(max_workers=1, thread_name_prefix="router"))
+                        name = f"projects/{PROJECT}/subscriptions/{EVENTS_SUBSCRIPTION}"
+                        subs.append(subscriber.subscribe(name, router.on_message,
+                                flow_control=pubsub.types.FlowControl(max_messages=MAX_MESSAGES), scheduler=scheduler))
+
+                if mode in ("shard", "all"):
+                        # Each shard pushes to the devices it has the events of
+                        push.start()
+                        flow_control = pubsub.types.FlowControl(max_messages=MAX_MESSAGES, max_bytes=MAX_BYTES)
+                        scheduler = ThreadScheduler(ThreadPoolExecutor(max_workers=WORKERS, thread_name_prefix="bridge"))
+                        name = f"projects/{PROJECT}/subscriptions/{ORDERED_SUBSCRIPTION}"
+                        subs.append(subscriber.subscribe(name, on_message, flow_control=flow_control, scheduler=scheduler))
+
+                try:
+                        for sub in subs:
+                                sub.result()
+                except KeyboardInterrupt:
+                        for sub in subs:
+                                sub.cancel()
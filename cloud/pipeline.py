@@ -0,0 +1,98 @@
+"""Pipeline stages for the bridge: per-stage latency and downlink batching."""
+import threading
+import time
+from collections import OrderedDict
+from concurrent.futures import ThreadPoolExecutor
+from typing import Callable, Dict, List
+
+
+class StageStats():
+        """Latency samples per pipeline stage, reported as percentiles."""
+
+        def __init__(self, window: int = 1000) -> None:
+                self.window = window
+                self.lock = threading.Lock()
+                self.samples: Dict[str, List[float]] = {}
+                self.counts: Dict[str, int] = {}
+
+        def record(self, stage: str, seconds: float) -> None:
+                with self.lock:
+                        samples = self.samples.setdefault(stage, [])
+                        samples.append(seconds)
+                        if len(samples) > self.window:
+                                del samples[0]
+                        self.counts[stage] = self.counts.get(stage, 0) + 1
+
+        def report(self) -> Dict[str, dict]:
+                out = {}
+                with self.lock:
+                        for stage, samples in self.samples.items():
+                                ordered = sorted(samples)
+                                pick = lambda q: ordered[min(int(q * len(ordered)), len(ordered) - 1)]
+                                out[stage] = {
+                                        "count": self.counts[stage],
+                                        "p50_ms": round(pick(0.50) * 1000, 1),
+                                        "p95_ms": round(pick(0.95) * 1000, 1),
+                                        "max_ms": round(ordered[-1] * 1000, 1),
+                                }
+                return out
+
+
+class DownlinkBatcher():
+        """Sends downlinks from a fixed pool of workers sharing one client.
+
+        Downlinks queued for a device that already has one waiting are
+        merged, so only the newest payload is sent and every message that
+        asked for it is completed by the one call. A device has at most
+        one send running, the worker doing it sends whatever was queued
+        for the device meanwhile before it lets go, so sends to a device
+        go out in order.
+        """
+
+        def __init__(self, send: Callable[[str, object], None], workers: int, stats: StageStats) -> None:
+                self.send = send
+                self.stats = stats
+                self.lock = threading.Lock()
+                self.pending: "OrderedDict[str, tuple]" = OrderedDict()
+                # Devices a worker is sending to
+                self.inflight = set()
+                self.executor = ThreadPoolExecutor(max_workers=workers, thread_name_prefix="downlink")
+                self.merged = 0
+
+        def submit(self, device: str, payload: object, done: Callable[[bool], None]) -> None:
+                with self.lock:
+                        if device in self.pending:
+                                _, callbacks, queued = self.pending[device]
+                                callbacks.append(done)
+                                self.pending[device] = (payload, callbacks, queued)
+                                self.merged += 1
+                                return
+                        self.pending[device] = (payload, [done], time.monotonic())
+                        if device in self.inflight:
+                                return
+                        self.inflight.add(device)
+                self.executor.submit(self._run, device)
+
+        def _run(self, device: str) -> None:
+                while True:
+                        with self.lock:
+                                if device not in self.pending:
+                                        self.inflight.discard(device)
+                                        return
+                                payload, callbacks, queued = self.pending.pop(device)
+                        self._send(device, payload, callbacks, queued)
+
+        def _send(self, device: str, payload: object, callbacks: list, queued: float) -> None:
+                self.stats.record("downlink_queue", time.monotonic() - queued)
+
+                start = time.monotonic()
+                try:
+                        self.send(device, payload)
+                        ok = True
+                except Exception as e:
+                        print("downlink to", device, "failed:", e)
+                        ok = False
+                self.stats.record("downlink", time.monotonic() - start)
+
+                for done in callbacks:
+                        done(ok)
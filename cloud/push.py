@@ -0,0 +1,172 @@
+"""Server-pushed forecast updates.
+
+The bridge remembers where each device last asked for weather and what it
+was last sent. While the forecast for that place stays the same nothing is
+sent; once it changes noticeably the new forecast is pushed with request
+id 0, which the firmware keeps so the next button press can draw it
+without a round trip.
+
+A device in PSM (power saving mode) can only be reached for its active
+time after it last talked to the network, which happens at the latest
+every TAU (periodic tracking area update). Devices report the timers the
+network granted them on the psm subfolder, and pushes wait for the next
+such window instead of sitting in the broker while the modem sleeps.
+
+With several bridge shards, owns(deviceName) tells whether this shard
+is the one to push to a device, see sharding.Owners.
+"""
+import os
+import sqlite3
+import threading
+import time
+from typing import Callable, Optional
+
+CHECK_S = float(os.environ.get("PUSH_CHECK_S", "30"))
+# Devices not heard from for this long are no longer pushed to
+MAX_IDLE_S = float(os.environ.get("PUSH_MAX_IDLE_S", str(24 * 3600)))
+# Smallest change in a numeric field (the temperature) worth a push
+MIN_DELTA = float(os.environ.get("PUSH_MIN_DELTA", "1.0"))
+DB_PATH = os.environ.get("PUSH_DB", "push.sqlite")
+
+
+# The current weather fields, the hourly and daily forecast after them
+# shift with the clock and alone are not worth waking the device for
+PUSH_FIELDS = 5
+
+
+def changed(old: Optional[str], new: str, min_delta: float = MIN_DELTA) -> bool:
+        if old is None:
+                return True
+        old_fields, new_fields = old.split(";")[:PUSH_FIELDS], new.split(";")[:PUSH_FIELDS]
+        if len(old_fields) != len(new_fields):
+                return True
+        for a, b in zip(old_fields, new_fields):
+                try:
+                        if abs(float(a) - float(b)) >= min_delta:
+                                return True
+                except ValueError:
+                        if a != b:
+                                return True
+        return False
+
+
+def reachable(now: float, last_contact: float, tau: float, active: float) -> bool:
+        """Whether a device is in an active time window right now."""
+        if tau <= 0 or active <= 0:
+                # No PSM granted, the modem stays reachable
+                return True
+        since = now - last_contact
+        return since < active or since % tau < active
+
+
+class PushScheduler():
+        def __init__(self, get_weather: Callable[[float, float], str],
+                     send: Callable[[str, int, str], None], db_path: str = DB_PATH,
+                     owns: Callable[[str], bool] = lambda name: True) -> None:
+                # get_weather(lat, lon) returns the current payload for a
+                # location, send(deviceName, request_id, payload) delivers it
+                self.get_weather = get_weather
+                self.send = send
+                self.owns = owns
+                self.lock = threading.Lock()
+                self.devices = {}
+
+                self.pushes = 0
+                self.unchanged = 0
+                self.waiting = 0
+                self.not_owned = 0
+
+                self.db = sqlite3.connect(db_path, check_same_thread=False)
+                self.db.execute("CREATE TABLE IF NOT EXISTS devices "
+                                "(name TEXT PRIMARY KEY, lat REAL, lon REAL, payload TEXT, "
+                                "contact REAL, tau REAL, active REAL)")
+                for name, lat, lon, payload, contact, tau, active in self.db.execute(
+                                "SELECT name, lat, lon, payload, contact, tau, active FROM devices"):
+                        self.devices[name] = {"lat": lat, "lon": lon, "payload": payload,
+                                              "contact": contact, "tau": tau, "active": active}
+
+        def _store(self, name: str) -> None:
+                d = self.devices[name]
+                self.db.execute("INSERT OR REPLACE INTO devices VALUES (?, ?, ?, ?, ?, ?, ?)",
+                                (name, d["lat"], d["lon"], d["payload"], d["contact"], d["tau"], d["active"]))
+                self.db.commit()
+
+        def _device(self, name: str) -> dict:
+                return self.devices.setdefault(name, {"lat": None, "lon": None, "payload": None,
+                                                      "contact": 0.0, "tau": 0.0, "active": 0.0})
+
+        def seen(self, name: str, lat: float, lon: float) -> None:
+                """A device asked for weather at a location."""
+                with self.lock:
+                        d = self._device(name)
+                        d["lat"], d["lon"], d["contact"] = lat, lon, time.time()
+                        self._store(name)
+
+        def sent(self, name: str, payload: str) -> None:
+                """A device was given weather, as response or push."""
+                with self.lock:
+                        d = self._device(name)
+                        d["payload"], d["contact"] = payload, time.time()
+                        self._store(name)
+
+        def on_psm(self, name: str, data: str) -> None:
+                """A device reported "tau;active_time" in seconds."""
+                try:
+                        tau, active = (float(v) for v in data.split(";"))
+                except ValueError:
+                        print("bad psm report", data)
+                        return
+                with self.lock:
+                        d = self._device(name)
+                        d["tau"], d["active"], d["contact"] = tau, active, time.time()
+                        self._store(name)
+
+        def check(self) -> None:
+                now = time.time()
+                with self.lock:
+                        due = [(name, dict(d)) for name, d in self.devices.items()
+                               if d["lat"] is not None and now - d["contact"] < MAX_IDLE_S]
+
+                for name, d in due:
+                        # Another shard has the device's events now
+                        if not self.owns(name):
+                                self.not_owned += 1
+                                continue
+                        try:
+                                payload = self.get_weather(d["lat"], d["lon"])
+                        except Exception as e:
+                                print("push lookup failed", e)
+                                continue
+
+                        if not changed(d["payload"], payload):
+                                self.unchanged += 1
+                                continue
+                        if not reachable(now, d["contact"], d["tau"], d["active"]):
+                                self.waiting += 1
+                                continue
+
+                        try:
+                                self.send(name, 0, payload)
+                        except Exception as e:
+                                print("push to", name, "failed:", e)
+                                continue
+                        self.pushes += 1
+                        self.sent(name, payload)
+
+        def run(self) -> None:
+                while True:
+                        time.sleep(CHECK_S)
+                        self.check()
+
+        def start(self) -> None:
+                threading.Thread(target=self.run, name="push", daemon=True).start()
+
+        def stats(self) -> dict:
+                with self.lock:
+                        return {
+                                "devices": len(self.devices),
+                                "pushes": self.pushes,
+                                "unchanged": self.unchanged,
+                                "waiting_for_wake": self.waiting,
+                                "other_shard": self.not_owned,
+                        }
@@ -0,0 +1,155 @@
+"""Scale-out support for the bridge.
+
+IoT Core publishes device events without ordering keys, so a router
+republishes them to ORDERED_TOPIC with the deviceId as ordering key.
+A router runs its callbacks on a single thread, and the publisher sends
+a key's messages in the order publish() was called, so it passes each
+device's events on in the order it got them. A callback only queues a
+publish, and routers keep no state, so as many can run as the event
+rate needs.
+
+Any number of bridge shards consume ORDERED_SUBSCRIPTION, which has
+message ordering enabled. Pub/Sub keeps each ordering key on one
+subscriber client at a time and moves keys when shards join or leave.
+The client only hands out a device's next message after the previous
+one has been acked.
+
+Neither IoT Core nor the routers put a device's events in order, they
+only keep the order they got them in. Order is restored by event time:
+a message older than one already answered for the same device is
+dropped, and so are redeliveries, by event id. That state is kept in
+Redis 6.2 or later at SHARD_STATE_URL, Memorystore in the cloud, which
+all shards share wherever they run. A device that moves to another
+shard on a rebalance is still checked against what the last one
+answered.
+
+The shard a device's events last went to owns it, and only the owner
+pushes to it. Otherwise every shard that ever answered a device would
+keep pushing to it after a rebalance. A shard only writes its claim
+when it takes a device over, or every CLAIM_REFRESH_S after, so a
+device that comes back to a shard it left is reclaimed by then.
+"""
+import os
+import socket
+import threading
+import time
+
+import redis
+from google.cloud import pubsub
+
+STATE_URL = os.environ.get("SHARD_STATE_URL", "redis://localhost:6379/0")
+SHARD_ID = os.environ.get("SHARD_ID", f"{socket.gethostname()}-{os.getpid()}")
+CLAIM_REFRESH_S = 60
+
+
+def connect(url: str) -> redis.Redis:
+        # Thread safe, connects on first use
+        return redis.Redis.from_url(url)
+
+
+class Deduplicator():
+        """Remembers recently seen event ids for a while."""
+
+        def __init__(self, ttl_s: float = 600, url: str = STATE_URL) -> None:
+                self.ttl_s = ttl_s
+                self.lock = threading.Lock()
+                self.db = connect(url)
+                self.duplicates = 0
+
+        def first_time(self, event_id: str) -> bool:
+                # Atomic across shards, only one of them sets it
+                if self.db.set(f"seen:{event_id}", 1, nx=True, px=int(self.ttl_s * 1000)):
+                        return True
+                with self.lock:
+                        self.duplicates += 1
+                return False
+
+        def forget(self, event_id: str) -> None:
+                # Let a failed message be handled again when it is redelivered
+                self.db.delete(f"seen:{event_id}")
+
+
+class StaleGuard():
+        """Tracks the newest event answered per device."""
+
+        def __init__(self, url: str = STATE_URL) -> None:
+                self.lock = threading.Lock()
+                self.db = connect(url)
+                self.stale = 0
+
+        def is_stale(self, device: str, published: float) -> bool:
+                newest = self.db.zscore("newest", device)
+                if newest is not None and published < newest:
+                        with self.lock:
+                                self.stale += 1
+                        return True
+                return False
+
+        def delivered(self, device: str, published: float) -> None:
+                # Only ever moves forward
+                self.db.zadd("newest", {device: published}, gt=True)
+
+
+class Owners():
+        """Which shard each device belongs to."""
+
+        def __init__(self, shard: str = SHARD_ID, url: str = STATE_URL) -> None:
+                self.shard = shard
+                self.lock = threading.Lock()
+                self.db = connect(url)
+                # Devices claimed by this shard, and when
+                self.claimed = {}
+                self.taken = 0
+
+        def claim(self, device: str) -> None:
+                # Pub/Sub gave this shard the device's ordering key
+                now = time.monotonic()
+                with self.lock:
+                        if now - self.claimed.get(device, -CLAIM_REFRESH_S) < CLAIM_REFRESH_S:
+                                return
+                        self.claimed[device] = now
+
+                previous = self.db.set(f"owner:{device}", self.shard, get=True)
+                if previous is None or previous.decode() != self.shard:
+                        with self.lock:
+                                self.taken += 1
+
+        def owns(self, device: str) -> bool:
+                owner = self.db.get(f"owner:{device}")
+                if owner is not None and owner.decode() == self.shard:
+                        return True
+                # Taken over, claim it again when it comes back
+                with self.lock:
+                        self.claimed.pop(device, None)
+                return False
+
+
+class Router():
+        """Republishes device events with the deviceId as ordering key.
+
+        Has to be subscribed with a single-threaded scheduler."""
+
+        def __init__(self, project: str, topic: str) -> None:
+                self.publisher = pubsub.PublisherClient(
+                        publisher_options=pubsub.types.PublisherOptions(enable_message_ordering=True))
+                self.topic = f"projects/{project}/topics/{topic}"
+
+        def on_message(self, message) -> None:
+                attributes = dict(message.attributes)
+                attributes["eventId"] = message.message_id
+                attributes["eventTime"] = str(message.publish_time.timestamp())
+                key = attributes.get("deviceId", "")
+
+                future = self.publisher.publish(self.topic, message.data, ordering_key=key, **attributes)
+
+                def published(f) -> None:
+                        try:
+                                f.result()
+                                message.ack()
+                        except Exception as e:
+                                print("republish failed", e)
+                                # Publishing for this key is paused after an error
+                                self.publisher.resume_publish(self.topic, key)
+                                message.nack()
+
+                future.add_done_callback(published)
@@ -0,0 +1,91 @@
+"""GNSS and link telemetry from the devices.
+
+The firmware sends one summary per period on the telemetry subfolder,
+along with a location the user asked for. The format matches
+include/telemetry.h. The bridge keeps fleet totals to tune acquisition
+and uplink settings against.
+"""
+import struct
+import threading
+
+VERSION = 1
+TTFF_BOUNDS_S = (5, 10, 20, 40, 80)
+CN0_BOUNDS_DB = (15, 20, 25, 30, 35, 40, 45)
+MSG = struct.Struct("<BIHHHHH6H8HBBBHbbbH")
+
+
+def decode(payload: bytes) -> dict:
+        if len(payload) < MSG.size or payload[0] != VERSION:
+                raise ValueError(f"not a version {VERSION} telemetry summary")
+        v = MSG.unpack_from(payload)
+        return {
+                "period_s": v[1],
+                "sessions": v[2],
+                "fixes": v[3],
+                "ttff_min_s": v[4] / 10,
+                "ttff_max_s": v[5] / 10,
+                "ttff_mean_s": v[6] / 10,
+                "ttff_hist": list(v[7:13]),
+                "cn0_hist": list(v[13:21]),
+                "in_fix_min": v[21],
+                "in_fix_max": v[22],
+                "in_fix_mean": v[23],
+                "rsrp_samples": v[24],
+                "rsrp_min": v[25],
+                "rsrp_max": v[26],
+                "rsrp_mean": v[27],
+                "reconnects": v[28],
+        }
+
+
+class FleetTelemetry():
+        def __init__(self) -> None:
+                self.lock = threading.Lock()
+                self.summaries = 0
+                self.errors = 0
+                self.sessions = 0
+                self.fixes = 0
+                self.reconnects = 0
+                self.ttff_hist = [0] * (len(TTFF_BOUNDS_S) + 1)
+                self.cn0_hist = [0] * (len(CN0_BOUNDS_DB) + 1)
+                self.ttff_total_s = 0.0
+                self.rsrp_samples = 0
+                self.rsrp_total = 0
+                self.rsrp_min = None
+
+        def on_summary(self, device: str, payload: bytes) -> None:
+                try:
+                        t = decode(payload)
+                except (ValueError, struct.error) as e:
+                        print("telemetry", device, e)
+                        with self.lock:
+                                self.errors += 1
+                        return
+
+                with self.lock:
+                        self.summaries += 1
+                        self.sessions += t["sessions"]
+                        self.fixes += t["fixes"]
+                        self.reconnects += t["reconnects"]
+                        self.ttff_total_s += t["ttff_mean_s"] * t["fixes"]
+                        self.ttff_hist = [a + b for a, b in zip(self.ttff_hist, t["ttff_hist"])]
+                        self.cn0_hist = [a + b for a, b in zip(self.cn0_hist, t["cn0_hist"])]
+                        if t["rsrp_samples"]:
+                                self.rsrp_samples += t["rsrp_samples"]
+                                self.rsrp_total += t["rsrp_mean"] * t["rsrp_samples"]
+                                if self.rsrp_min is None or t["rsrp_min"] < self.rsrp_min:
+                                        self.rsrp_min = t["rsrp_min"]
+
+        def stats(self) -> dict:
+                with self.lock:
+                        return {
+                                "summaries": self.summaries,
+                                "errors": self.errors,
+                                "fix_rate": round(self.fixes / self.sessions, 3) if self.sessions else 0.0,
+                                "ttff_mean_s": round(self.ttff_total_s / self.fixes, 1) if self.fixes else 0.0,
+                                "ttff_hist": self.ttff_hist,
+                                "cn0_hist": self.cn0_hist,
+                                "rsrp_mean": round(self.rsrp_total / self.rsrp_samples, 1) if self.rsrp_samples else None,
+                                "rsrp_min": self.rsrp_min,
+                                "reconnects": self.reconnects,
+                        }
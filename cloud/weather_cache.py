@@ -0,0 +1,191 @@
+"""Fleet-wide weather cache for the bridge.
+
+Weather is cached per geohash cell for a TTL, so devices in the same area
+share one upstream call. Concurrent misses for a cell wait on a single
+in-flight fetch instead of each calling the weather API, and entries are
+kept in SQLite so a restarted bridge starts warm. Expired cells are
+dropped from both once per TTL.
+
+Place names do not change with the weather, so PlaceCache keeps them per
+cell for good and a weather refresh does not look the name up again.
+"""
+import os
+import sqlite3
+import threading
+import time
+from concurrent.futures import Future
+from typing import Callable, Tuple
+
+BASE32 = "0123456789bcdefghjkmnpqrstuvwxyz"
+
+PRECISION = int(os.environ.get("WEATHER_CACHE_PRECISION", "5"))
+TTL_S = float(os.environ.get("WEATHER_CACHE_TTL_S", "600"))
+DB_PATH = os.environ.get("WEATHER_CACHE_DB", "weather_cache.sqlite")
+
+
+def geohash(lat: float, lon: float, precision: int = PRECISION) -> str:
+        lat_range, lon_range = [-90.0, 90.0], [-180.0, 180.0]
+        cell, bits, ch, even = [], 0, 0, True
+        while len(cell) < precision:
+                rng, val = (lon_range, lon) if even else (lat_range, lat)
+                mid = (rng[0] + rng[1]) / 2
+                ch <<= 1
+                if val >= mid:
+                        ch |= 1
+                        rng[0] = mid
+                else:
+                        rng[1] = mid
+                even = not even
+                bits += 1
+                if bits == 5:
+                        cell.append(BASE32[ch])
+                        bits, ch = 0, 0
+        return "".join(cell)
+
+
+def cell_center(cell: str) -> Tuple[float, float]:
+        lat_range, lon_range = [-90.0, 90.0], [-180.0, 180.0]
+        even = True
+        for c in cell:
+                ch = BASE32.index(c)
+                for bit in (16, 8, 4, 2, 1):
+                        rng = lon_range if even else lat_range
+                        mid = (rng[0] + rng[1]) / 2
+                        if ch & bit:
+                                rng[0] = mid
+                        else:
+                                rng[1] = mid
+                        even = not even
+        return (lat_range[0] + lat_range[1]) / 2, (lon_range[0] + lon_range[1]) / 2
+
+
+class WeatherCache():
+        def __init__(self, fetch: Callable[[float, float], str], ttl_s: float = TTL_S,
+                     precision: int = PRECISION, db_path: str = DB_PATH) -> None:
+                # fetch(lat, lon) returns the payload for a location
+                self.fetch = fetch
+                self.ttl_s = ttl_s
+                self.precision = precision
+                self.lock = threading.Lock()
+                self.entries = {}
+                self.inflight = {}
+
+                self.hits = 0
+                self.misses = 0
+                self.coalesced = 0
+                self.upstream_calls = 0
+                self.evicted = 0
+                self.started = time.time()
+                self.last_purge = self.started
+
+                self.db = sqlite3.connect(db_path, check_same_thread=False)
+                self.db.execute("CREATE TABLE IF NOT EXISTS weather "
+                                "(cell TEXT PRIMARY KEY, fetched REAL, payload TEXT)")
+                now = time.time()
+                self.db.execute("DELETE FROM weather WHERE fetched < ?", (now - ttl_s,))
+                self.db.commit()
+                for cell, fetched, payload in self.db.execute("SELECT cell, fetched, payload FROM weather"):
+                        self.entries[cell] = (fetched, payload)
+
+        def _purge(self, now: float) -> None:
+                # Called with the lock held
+                expired = [cell for cell, (fetched, _) in self.entries.items() if now - fetched >= self.ttl_s]
+                for cell in expired:
+                        del self.entries[cell]
+                self.evicted += len(expired)
+                self.db.execute("DELETE FROM weather WHERE fetched < ?", (now - self.ttl_s,))
+                self.db.commit()
+                self.last_purge = now
+
+        def get(self, lat: float, lon: float) -> str:
+                cell = geohash(lat, lon, self.precision)
+
+                with self.lock:
+                        now = time.time()
+                        if now - self.last_purge >= self.ttl_s:
+                                self._purge(now)
+
+                        entry = self.entries.get(cell)
+                        if entry and now - entry[0] < self.ttl_s:
+                                self.hits += 1
+                                return entry[1]
+
+                        future = self.inflight.get(cell)
+                        if future is not None:
+                                self.coalesced += 1
+                                owner = False
+                        else:
+                                self.misses += 1
+                                self.upstream_calls += 1
+                                future = self.inflight[cell] = Future()
+                                owner = True
+
+                if not owner:
+                        return future.result()
+
+                try:
+                        payload = self.fetch(*cell_center(cell))
+                        fetched = time.time()
+                        with self.lock:
+                                self.entries[cell] = (fetched, payload)
+                                self.db.execute("INSERT OR REPLACE INTO weather VALUES (?, ?, ?)",
+                                                (cell, fetched, payload))
+                                self.db.commit()
+                        future.set_result(payload)
+                        return payload
+                except Exception as e:
+                        future.set_exception(e)
+                        raise
+                finally:
+                        with self.lock:
+                                del self.inflight[cell]
+
+        def stats(self) -> dict:
+                with self.lock:
+                        lookups = self.hits + self.misses + self.coalesced
+                        minutes = max((time.time() - self.started) / 60, 1 / 60)
+                        return {
+                                "lookups": lookups,
+                                "hits": self.hits,
+                                "coalesced": self.coalesced,
+                                "hit_ratio": (self.hits + self.coalesced) / lookups if lookups else 0.0,
+                                "upstream_calls": self.upstream_calls,
+                                "upstream_per_min": self.upstream_calls / minutes,
+                                "cells": len(self.entries),
+                                "evicted": self.evicted,
+                        }
+
+
+class PlaceCache():
+        def __init__(self, lookup: Callable[[float, float], str],
+                     precision: int = PRECISION, db_path: str = DB_PATH) -> None:
+                # lookup(lat, lon) returns the name of the place there
+                self.lookup = lookup
+                self.precision = precision
+                self.lock = threading.Lock()
+                self.upstream_calls = 0
+
+                self.db = sqlite3.connect(db_path, check_same_thread=False)
+                self.db.execute("CREATE TABLE IF NOT EXISTS places (cell TEXT PRIMARY KEY, name TEXT)")
+                self.db.commit()
+                self.names = dict(self.db.execute("SELECT cell, name FROM places"))
+
+        def get(self, lat: float, lon: float) -> str:
+                # Only called from a weather fetch, which is one per cell at a time
+                cell = geohash(lat, lon, self.precision)
+                with self.lock:
+                        name = self.names.get(cell)
+                        if name is not None:
+                                return name
+                        self.upstream_calls += 1
+
+                name = self.lookup(lat, lon)
+                with self.lock:
+                        self.names[cell] = name
+                        self.db.execute("INSERT OR REPLACE INTO places VALUES (?, ?)", (cell, name))
+                        self.db.commit()
+                return name
+
+        def stats(self) -> dict:
+                with self.lock:
+                        return {"places": len(self.names), "upstream_calls": self.upstream_calls}
@@ -0,0 +1,183 @@
+#include <zephyr.h>
+#include <stdlib.h>
+#include <drivers/gpio.h>
+#include <drivers/gpio/gpio_emul.h>
+
+#include "posix_board_if.h"
+#include "events.h"
+#include "mqtt_service.h"
+#include "time_service.h"
+#include "mem_stats.h"
+#include "mock.h"
+
+
+/* Presses the emulated button and times each stage up to the redraw:
+   debounce, GNSS fix, MQTT publish, weather response and render. The
+   first press includes LTE attach, time sync and the TLS handshake, so
+   it is reported on its own and left out of the percentiles. */
+
+enum stage {
+    STAGE_BUTTON,
+    STAGE_FIX,
+    STAGE_PUBLISH,
+    STAGE_RESPONSE,
+    STAGE_RENDER,
+    STAGE_TOTAL,
+    STAGE_COUNT,
+};
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "press -> button event",
+    "button -> fix",
+    "fix -> publish",
+    "publish -> response",
+    "response -> render",
+    "press -> render",
+};
+
+static int32_t samples[STAGE_COUNT][CONFIG_BENCH_ITERATIONS];
+
+static const struct gpio_dt_spec button = GPIO_DT_SPEC_GET(DT_ALIAS(sw0), gpios);
+
+BUS_SUBSCRIBER_DEFINE(bench_sub, 8);
+
+
+/* Uptime of the next message on chan, or -1 at the deadline */
+static int64_t wait_for(const struct bus_channel *chan, int64_t deadline) {
+    const struct bus_channel *got;
+
+    while (k_uptime_get() < deadline) {
+        const void *msg = bus_receive(&bench_sub, &got,
+            K_MSEC(MAX(deadline - k_uptime_get(), 0)));
+        if (!msg) {
+            break;
+        }
+
+        int64_t t = k_uptime_get();
+        if (got == &button_chan) {
+            t = ((const struct button_evt *)msg)->timestamp;
+        }
+        bus_release(msg);
+
+        if (got == chan) {
+            return t;
+        }
+    }
+
+    return -1;
+}
+
+
+static int64_t wait_for_render(int64_t after, int64_t deadline) {
+    while (k_uptime_get() < deadline) {
+        if (mock_display_last_write() >= after) {
+            return mock_display_last_write();
+        }
+        k_msleep(5);
+    }
+
+    return -1;
+}
+
+
+static int press() {
+    int64_t deadline;
+    int64_t t[STAGE_COUNT];
+    struct mqtt_service_stats mqtt;
+    static int n;
+
+    int64_t pressed = k_uptime_get();
+    deadline = pressed + CONFIG_BENCH_TIMEOUT_S * 1000LL;
+
+    /* Active low */
+    gpio_emul_input_set(button.port, button.pin, 0);
+    k_msleep(50);
+    gpio_emul_input_set(button.port, button.pin, 1);
+
+    t[STAGE_BUTTON] = wait_for(&button_chan, deadline);
+    t[STAGE_FIX] = wait_for(&location_chan, deadline);
+    t[STAGE_RESPONSE] = wait_for(&forecast_chan, deadline);
+    if (t[STAGE_BUTTON] < 0 || t[STAGE_FIX] < 0 || t[STAGE_RESPONSE] < 0) {
+        printk("Bench: press %d timed out\n", n);
+        return -ETIMEDOUT;
+    }
+
+    t[STAGE_RENDER] = wait_for_render(t[STAGE_RESPONSE], deadline);
+    if (t[STAGE_RENDER] < 0) {
+        printk("Bench: press %d never rendered\n", n);
+        return -ETIMEDOUT;
+    }
+
+    mqtt_service_stats_get(&mqtt);
+    t[STAGE_PUBLISH] = mqtt.last_publish_time;
+
+    int64_t prev = pressed;
+    for (int s = STAGE_BUTTON; s <= STAGE_RENDER; s++) {
+        samples[s][n] = (int32_t)(t[s] - prev);
+        prev = t[s];
+    }
+    samples[STAGE_TOTAL][n] = (int32_t)(t[STAGE_RENDER] - pressed);
+    n++;
+
+    return 0;
+}
+
+
+static int cmp_int32(const void *a, const void *b) {
+    int32_t x = *(const int32_t *)a;
+    int32_t y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+static void report(int count) {
+    printk("Bench: cold start press -> render %d ms\n", samples[STAGE_TOTAL][0]);
+
+    if (count > 1) {
+        printk("Bench: %d warm presses, ms   p50    p90    p99    max\n", count - 1);
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            int32_t *v = &samples[s][1];
+            int m = count - 1;
+
+            qsort(v, m, sizeof(*v), cmp_int32);
+            printk("  %-22s %6d %6d %6d %6d\n", stage_names[s],
+                v[(m - 1) * 50 / 100], v[(m - 1) * 90 / 100],
+                v[(m - 1) * 99 / 100], v[m - 1]);
+        }
+    }
+
+    mem_stats_print();
+    events_print_stats();
+    mqtt_service_print_stats();
+    time_service_print_stats();
+}
+
+
+static void bench_thread(void) {
+    int count = 0;
+
+    bus_subscribe(&button_chan, &bench_sub);
+    bus_subscribe(&location_chan, &bench_sub);
+    bus_subscribe(&forecast_chan, &bench_sub);
+
+    /* Wait for the boot screen and the placeholder */
+    while (mock_display_writes() < 2) {
+        k_msleep(100);
+    }
+
+    gpio_emul_input_set(button.port, button.pin, 1);
+
+    for (int i = 0; i < CONFIG_BENCH_ITERATIONS; i++) {
+        if (press() == 0) {
+            count++;
+        }
+        k_msleep(CONFIG_BENCH_INTERVAL_MS);
+    }
+
+    if (count > 0) {
+        report(count);
+    }
+    posix_exit(count == CONFIG_BENCH_ITERATIONS ? 0 : 1);
+}
+
+K_THREAD_DEFINE(bench_tid, 2048, bench_thread, NULL, NULL, NULL, 14, 0, 0);
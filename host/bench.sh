@@ -0,0 +1,28 @@
+#!/bin/sh
+# Builds the firmware for native_posix and runs the press to render
+# benchmark against a local broker and responder.
+#
+# Needs mosquitto, paho-mqtt and the zeth TAP interface from Zephyr's
+# net-tools, set up once with: sudo net-tools/net-setup.sh
+#
+# The app and the stand-ins build with -Werror. The report goes to
+# bench_report.txt next to this script, check it in together with the
+# commit it was measured at. None is checked in yet.
+set -e
+cd "$(dirname "$0")"
+
+[ -f certs/ca.crt ] || ./make_certs.sh
+west build -b native_posix -d build_host .. -- -DLOCAL_BROKER_CA="$PWD/certs/ca.crt"
+
+mosquitto -c mosquitto.conf &
+broker=$!
+sleep 1
+python3 responder.py &
+responder=$!
+trap 'kill $responder $broker' EXIT
+
+# Exits non-zero if presses timed out
+status=0
+./build_host/zephyr/zephyr.exe > bench_report.txt || status=$?
+cat bench_report.txt
+exit $status
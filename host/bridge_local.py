@@ -0,0 +1,252 @@
+"""Runs the cloud bridge against the local broker, for load tests.
+
+cloud/main.py's on_message is fed from the local broker through a
+stand-in for the Pub/Sub subscription, and its IoT Core commands are
+published back to the devices' command topics. Weather comes from a
+script with a configurable lookup latency instead of OpenWeatherMap, so
+the weather cache, dedup, batching and delta baselines all run as they
+do in the cloud.
+
+The stand-in behaves like the ordered subscription the shards read:
+- A device's next event is only handed out once the previous one has
+  been acked.
+- Nacked events come back after NACK_DELAY_S.
+- At most BRIDGE_MAX_MESSAGES events are outstanding at once.
+
+        pip install paho-mqtt redis fakeredis
+        python bridge_local.py
+        python loadgen.py --devices 1000 --phase burst:120
+"""
+import collections
+import datetime
+import itertools
+import os
+import random
+import sys
+import threading
+import time
+import types
+from concurrent.futures import ThreadPoolExecutor
+
+BROKER = os.environ.get("BRIDGE_BROKER", "127.0.0.1")
+PORT = int(os.environ.get("BRIDGE_PORT", "1883"))
+# Simulated weather API round trip
+WEATHER_LATENCY_MS = float(os.environ.get("LOCAL_WEATHER_LATENCY_MS", "300"))
+NACK_DELAY_S = 1.0
+REPORT_S = 10
+
+# Connected in main(), shard_scaling.py runs without a broker
+client = None
+
+
+class DeviceManagerClient():
+        """IoT Core commands, published to the device's command topic."""
+
+        def send_command_to_device(self, name: str, binary_data: bytes, subfolder: str = "") -> None:
+                device = name.rsplit("/", 1)[1]
+                info = client.publish(f"/devices/{device}/commands/{subfolder}", binary_data, qos=1)
+                if info.rc != 0:
+                        raise RuntimeError(f"publish failed: {info.rc}")
+
+
+def install_stubs() -> None:
+        """Google Cloud and pyowm modules main.py imports, without
+        credentials or network access."""
+        class Any():
+                def __init__(self, *args, **kwargs) -> None:
+                        pass
+
+                def __getattr__(self, name):
+                        return Any()
+
+                def __call__(self, *args, **kwargs):
+                        return Any()
+
+        modules = {
+                "google": {},
+                "google.api_core": {},
+                "google.api_core.future": {},
+                "google.cloud": {},
+                "google.cloud.pubsub": {"PublisherClient": Any, "SubscriberClient": Any, "types": Any()},
+                "google.cloud.iot": {"DeviceManagerClient": DeviceManagerClient},
+                "google.cloud.pubsub_v1": {},
+                "google.cloud.pubsub_v1.subscriber": {},
+                "google.cloud.pubsub_v1.subscriber.scheduler": {"ThreadScheduler": Any},
+                "google.cloud.iot_v1": {},
+                "google.cloud.iot_v1.types": {},
+                "google.cloud.iot_v1.types.resources": {"Device": Any},
+                "pyowm": {"OWM": Any},
+                "pyowm.utils": {},
+                "pyowm.utils.timestamps": {},
+        }
+        for name, attrs in modules.items():
+                module = types.ModuleType(name)
+                module.__dict__.update(attrs)
+                sys.modules[name] = module
+                parent, _, child = name.rpartition(".")
+                if parent:
+                        setattr(sys.modules[parent], child, module)
+
+
+def scripted_weather(lat: float, lon: float) -> str:
+        time.sleep(WEATHER_LATENCY_MS / 1000)
+        temperature = round(8 + random.random() * 6, 1)
+        hours = f"15/0/803/{temperature},18/0/500/{temperature - 1},21/1/800/9.5,0/1/800/8"
+        days = "1/500/6/13.5,2/803/7/14,3/800/8/16.5,4/600/-1.5/3"
+        return f"Clouds;04d;{temperature};{lat:.2f},{lon:.2f};803;{hours};{days}"
+
+
+class Message():
+        """The parts of a Pub/Sub message on_message uses."""
+        ids = itertools.count(1)
+
+        def __init__(self, sub, device: str, subfolder: str, data: bytes) -> None:
+                self.sub = sub
+                self.device = device
+                self.data = data
+                self.message_id = str(next(self.ids))
+                self.publish_time = datetime.datetime.now(datetime.timezone.utc)
+                self.attributes = {
+                        "deviceId": device,
+                        "subFolder": subfolder,
+                        "projectId": "wearebrews",
+                        "deviceRegistryLocation": "europe-west1",
+                        "deviceRegistryId": "brews-iot",
+                }
+
+        def ack(self) -> None:
+                self.sub.done(self, True)
+
+        def nack(self) -> None:
+                self.sub.done(self, False)
+
+
+class OrderedSubscription():
+        def __init__(self, callback, workers: int, max_messages: int) -> None:
+                self.callback = callback
+                self.executor = ThreadPoolExecutor(max_workers=workers, thread_name_prefix="bridge")
+                self.max_messages = max_messages
+                self.lock = threading.Lock()
+                self.queues = collections.defaultdict(collections.deque)
+                # Devices with an event out, or waiting to redeliver one
+                self.busy = set()
+                # Devices waiting for flow control to let an event out
+                self.waiting = collections.OrderedDict()
+                self.outstanding = 0
+
+                self.received = 0
+                self.acked = 0
+                self.nacked = 0
+                self.max_outstanding = 0
+
+        def publish(self, message: Message) -> None:
+                with self.lock:
+                        self.received += 1
+                        self.queues[message.device].append(message)
+                        if message.device not in self.busy and message.device not in self.waiting:
+                                self._ready(message.device)
+
+        def _ready(self, device: str) -> None:
+                # Called with the lock held
+                if self.outstanding >= self.max_messages:
+                        self.waiting[device] = True
+                        return
+                self.outstanding += 1
+                self.max_outstanding = max(self.max_outstanding, self.outstanding)
+                self.busy.add(device)
+                self.executor.submit(self.callback, self.queues[device][0])
+
+        def _redeliver(self, device: str) -> None:
+                with self.lock:
+                        self.busy.discard(device)
+                        self._ready(device)
+
+        def done(self, message: Message, ok: bool) -> None:
+                device = message.device
+                with self.lock:
+                        self.outstanding -= 1
+                        self.busy.discard(device)
+                        if ok:
+                                self.acked += 1
+                                self.queues[device].popleft()
+                        else:
+                                self.nacked += 1
+
+                        if not self.queues[device]:
+                                del self.queues[device]
+                        elif ok:
+                                self._ready(device)
+                        else:
+                                self.busy.add(device)
+                                threading.Timer(NACK_DELAY_S, self._redeliver, (device,)).start()
+
+                        while self.waiting and self.outstanding < self.max_messages:
+                                self._ready(self.waiting.popitem(last=False)[0])
+
+        def stats(self) -> dict:
+                with self.lock:
+                        return {
+                                "received": self.received,
+                                "acked": self.acked,
+                                "nacked": self.nacked,
+                                "queued": sum(len(q) for q in self.queues.values()),
+                                "outstanding": self.outstanding,
+                                "max_outstanding": self.max_outstanding,
+                        }
+
+
+def load_bridge():
+        """cloud/main.py with scripted weather, keeping its state in memory.
+        The shard state goes to SHARD_STATE_URL if that is set."""
+        install_stubs()
+        for name in ("PUSH_DB", "WEATHER_CACHE_DB"):
+                os.environ.setdefault(name, ":memory:")
+        sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "cloud"))
+        if "SHARD_STATE_URL" not in os.environ:
+                import fakeredis
+                import sharding
+                server = fakeredis.FakeServer()
+                sharding.connect = lambda url: fakeredis.FakeRedis(server=server)
+        import main as bridge
+        from weather_cache import WeatherCache
+
+        bridge.weather_cache = WeatherCache(scripted_weather, db_path=":memory:")
+        # Report every interval rather than once a minute
+        bridge.STATS_INTERVAL_S = REPORT_S
+        return bridge
+
+
+def main() -> None:
+        global client
+        import paho.mqtt.client as mqtt
+
+        client = mqtt.Client()
+        bridge = load_bridge()
+        sub = OrderedSubscription(bridge.on_message, bridge.WORKERS, bridge.MAX_MESSAGES)
+
+        def on_connect(client, userdata, flags, rc) -> None:
+                client.subscribe("/devices/+/events/#", qos=1)
+
+        def on_message(client, userdata, message) -> None:
+                parts = message.topic.split("/")
+                sub.publish(Message(sub, parts[2], "/".join(parts[4:]), message.payload))
+
+        client.on_connect = on_connect
+        client.on_message = on_message
+        client.max_inflight_messages_set(1000)
+        client.max_queued_messages_set(0)
+        client.connect(BROKER, PORT)
+        client.loop_start()
+
+        last_acked, last = 0, time.monotonic()
+        while True:
+                time.sleep(REPORT_S)
+                s = sub.stats()
+                now = time.monotonic()
+                s["acked_per_s"] = round((s["acked"] - last_acked) / (now - last), 1)
+                last_acked, last = s["acked"], now
+                print("subscription", s, flush=True)
+
+
+if __name__ == "__main__":
+        main()
@@ -0,0 +1,413 @@
+"""Simulates a fleet of devices against the local broker and bridge.
+
+Every virtual device speaks the firmware's protocol: it subscribes to
+its config and command topics at QoS 1, publishes "lat;lon;msg_id;seq"
+on its location topic at QoS 1, and decodes the weather
+downlinks with the same baseline and msg_id rules as mqtt_service.c.
+Clients are multiplexed over a few threads with paho's external loop.
+
+Button presses follow scripted phases, run one after the other:
+- burst:SECONDS[:SHARE]  a morning burst, SHARE of the devices (1.0)
+                         press once, most of them mid-window
+- steady:SECONDS[:RATE]  presses at random, RATE per device and hour (2)
+- ramp:SECONDS[:RATE]    steady, rising from 0 to RATE per device and
+                         hour (4)
+
+The report gives the end-to-end latency from publish to the answering
+downlink, and the rate answers come back at, which is the bridge's
+throughput.
+
+        pip install paho-mqtt
+        python bridge_local.py
+        python loadgen.py --devices 2000 --phase burst:300 --phase steady:600:4
+"""
+import argparse
+import heapq
+import itertools
+import math
+import os
+import random
+import selectors
+import sys
+import threading
+import time
+
+import paho.mqtt.client as mqtt
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "cloud"))
+from downlink_codec import decode  # noqa: E402
+
+CLIENT_ID = "projects/wearebrews/locations/europe-west1/registries/brews-iot/devices/"
+# Around Trondheim, spread in degrees
+LATITUDE = 63.4305
+LONGITUDE = 10.3951
+KEEPALIVE_S = 60
+PHASE_DEFAULTS = {"burst": 1.0, "steady": 2.0, "ramp": 4.0}
+
+
+def parse_phase(text: str) -> tuple:
+        parts = text.split(":")
+        if parts[0] not in PHASE_DEFAULTS or len(parts) not in (2, 3):
+                raise argparse.ArgumentTypeError(f"expected burst|steady|ramp:SECONDS[:PARAM], got {text}")
+        param = float(parts[2]) if len(parts) == 3 else PHASE_DEFAULTS[parts[0]]
+        return parts[0], float(parts[1]), param
+
+
+def poisson(rng: random.Random, duration: float, rate: float):
+        t = rng.expovariate(rate) if rate > 0 else duration
+        while t < duration:
+                yield t
+                t += rng.expovariate(rate)
+
+
+def arrivals(phases: list, devices: int, rng: random.Random) -> list:
+        """Press times from the start of the run, with the device pressing."""
+        presses = []
+        start = 0.0
+        for kind, duration, param in phases:
+                if kind == "burst":
+                        # Most presses in the middle third of the window
+                        for d in rng.sample(range(devices), round(devices * min(param, 1.0))):
+                                t = min(max(rng.gauss(duration / 2, duration / 6), 0.0), duration)
+                                presses.append((start + t, d))
+                elif kind == "steady":
+                        for t in poisson(rng, duration, devices * param / 3600):
+                                presses.append((start + t, rng.randrange(devices)))
+                else:
+                        # Thinned from the final rate
+                        for t in poisson(rng, duration, devices * param / 3600):
+                                if rng.random() < t / duration:
+                                        presses.append((start + t, rng.randrange(devices)))
+                start += duration
+        presses.sort()
+        return presses
+
+
+class Stats():
+        def __init__(self) -> None:
+                self.lock = threading.Lock()
+                self.connected = 0
+                self.disconnects = 0
+                self.sent = 0
+                self.answered = 0
+                self.timeouts = 0
+                self.superseded = 0
+                self.stale = 0
+                self.pushed = 0
+                self.full = 0
+                self.delta = 0
+                self.baseline_misses = 0
+                self.errors = 0
+                self.latencies = []
+                # Answers per second of the run
+                self.per_second = {}
+
+        def add(self, name: str, n: int = 1) -> None:
+                with self.lock:
+                        setattr(self, name, getattr(self, name) + n)
+
+        def answer(self, t: float, latency: float) -> None:
+                with self.lock:
+                        self.answered += 1
+                        self.latencies.append(latency)
+                        self.per_second[int(t)] = self.per_second.get(int(t), 0) + 1
+
+        def report(self, elapsed: float) -> dict:
+                with self.lock:
+                        latencies = sorted(self.latencies)
+                        peak = max(self.per_second.values(), default=0)
+
+                def percentile(p: float) -> float:
+                        if not latencies:
+                                return 0.0
+                        return round(latencies[min(math.ceil(p * len(latencies)) - 1, len(latencies) - 1)] * 1000, 1)
+
+                return {
+                        "connected": self.connected,
+                        "disconnects": self.disconnects,
+                        "sent": self.sent,
+                        "answered": self.answered,
+                        "timeouts": self.timeouts,
+                        "superseded": self.superseded,
+                        "stale": self.stale,
+                        "pushed": self.pushed,
+                        "full": self.full,
+                        "delta": self.delta,
+                        "baseline_misses": self.baseline_misses,
+                        "errors": self.errors,
+                        "p50_ms": percentile(0.50),
+                        "p90_ms": percentile(0.90),
+                        "p99_ms": percentile(0.99),
+                        "max_ms": round(latencies[-1] * 1000, 1) if latencies else 0.0,
+                        "answers_per_s": round(self.answered / elapsed, 1) if elapsed > 0 else 0.0,
+                        "peak_answers_per_s": peak,
+                }
+
+
+class VirtualDevice():
+        def __init__(self, name: str, stats: Stats, start: float, timeout: float, spread: float,
+                     rng: random.Random) -> None:
+                self.name = name
+                self.stats = stats
+                self.start = start
+                self.timeout = timeout
+                self.latitude = LATITUDE + rng.uniform(-spread, spread)
+                self.longitude = LONGITUDE + rng.uniform(-spread, spread)
+                self.rng = rng
+                # Sequence number of the weather held, the base for deltas
+                self.seq = 0
+                self.request_id = 0
+                self.sent_at = None
+                self.sock = None
+
+                self.client = mqtt.Client(client_id=CLIENT_ID + name, clean_session=False)
+                self.client.username_pw_set("unused", "unused")
+                self.client.on_connect = self.on_connect
+                self.client.on_disconnect = self.on_disconnect
+                self.client.on_message = self.on_message
+
+        def on_connect(self, client, userdata, flags, rc) -> None:
+                if rc != 0:
+                        print(self.name, "connect refused", rc, flush=True)
+                        return
+                self.stats.add("connected")
+                # Subscribes on every connect, like the firmware
+                client.subscribe([(f"/devices/{self.name}/config", 1), (f"/devices/{self.name}/commands/#", 1)])
+
+        def on_disconnect(self, client, userdata, rc) -> None:
+                self.stats.add("connected", -1)
+                self.stats.add("disconnects")
+
+        def press(self) -> None:
+                if self.sent_at is not None:
+                        # Like the firmware, only the newest request counts
+                        self.stats.add("superseded")
+                # Nonzero, the cloud uses id 0 for forecasts it pushes
+                self.request_id = self.rng.randrange(1, 65536)
+                payload = "%.6f;%.6f;%u;%u" % (self.latitude, self.longitude, self.request_id, self.seq)
+                info = self.client.publish(f"/devices/{self.name}/events/l", payload, qos=1)
+                if info.rc != mqtt.MQTT_ERR_SUCCESS:
+                        self.stats.add("errors")
+                        self.sent_at = None
+                        return
+                self.sent_at = time.monotonic()
+                self.stats.add("sent")
+
+        def check_timeout(self, now: float) -> None:
+                if self.sent_at is not None and now - self.sent_at > self.timeout:
+                        self.stats.add("timeouts")
+                        self.sent_at = None
+
+        def on_message(self, client, userdata, message) -> None:
+                if not message.topic.endswith("/commands/w"):
+                        return
+                try:
+                        msg = decode(message.payload)
+                except (ValueError, IndexError) as e:
+                        print(self.name, "could not decode weather", e, flush=True)
+                        self.stats.add("errors")
+                        return
+
+                if msg["delta"]:
+                        if msg["base"] != self.seq or self.seq == 0:
+                                # The next uplink carries our seq and the
+                                # bridge falls back to a full update
+                                self.stats.add("baseline_misses")
+                                return
+                        self.stats.add("delta")
+                else:
+                        self.stats.add("full")
+
+                # Applied even when stale, the bridge bases the next delta on it
+                self.seq = msg["seq"]
+
+                if msg["msg_id"] == 0:
+                        self.stats.add("pushed")
+                elif msg["msg_id"] != self.request_id or self.sent_at is None:
+                        self.stats.add("stale")
+                else:
+                        now = time.monotonic()
+                        self.stats.answer(now - self.start, now - self.sent_at)
+                        self.sent_at = None
+
+
+class Shard(threading.Thread):
+        """Runs the MQTT clients of a share of the devices on one selector."""
+
+        def __init__(self, index: int, broker: str, port: int, start: float) -> None:
+                super().__init__(name=f"shard-{index}", daemon=True)
+                self.broker = broker
+                self.port = port
+                self.start_time = start
+                self.devices = []
+                self.presses = []
+                self.selector = selectors.DefaultSelector()
+                self.writing = set()
+                self.order = itertools.count()
+                self.done = threading.Event()
+
+        def add(self, device: VirtualDevice) -> None:
+                self.devices.append(device)
+
+        def schedule(self, t: float, device: VirtualDevice) -> None:
+                self.presses.append((t, next(self.order), device))
+
+        def register(self, device: VirtualDevice) -> None:
+                self.drop(device)
+                sock = device.client.socket()
+                if sock is not None:
+                        self.selector.register(sock, selectors.EVENT_READ, device)
+                        device.sock = sock
+                        self.flush(device)
+
+        def flush(self, device: VirtualDevice) -> None:
+                client = device.client
+                if client.want_write():
+                        client.loop_write()
+                if client.want_write():
+                        self.writing.add(device)
+
+        def drop(self, device: VirtualDevice) -> None:
+                # The socket registered, paho may have closed it since
+                if device.sock is not None:
+                        try:
+                                self.selector.unregister(device.sock)
+                        except (KeyError, ValueError):
+                                pass
+                        device.sock = None
+                self.writing.discard(device)
+
+        def run(self) -> None:
+                for device in self.devices:
+                        try:
+                                device.client.connect(self.broker, self.port, KEEPALIVE_S)
+                        except OSError as e:
+                                print(device.name, "could not connect", e, flush=True)
+                                device.stats.add("errors")
+                                continue
+                        self.register(device)
+                heapq.heapify(self.presses)
+
+                next_misc = 0.0
+                while not self.done.is_set():
+                        now = time.monotonic()
+                        while self.presses and self.start_time + self.presses[0][0] <= now:
+                                device = heapq.heappop(self.presses)[2]
+                                if device.client.is_connected():
+                                        device.press()
+                                        self.flush(device)
+                                else:
+                                        device.stats.add("errors")
+
+                        if now >= next_misc:
+                                next_misc = now + 1.0
+                                for device in self.devices:
+                                        device.check_timeout(now)
+                                        if device.client.socket() is None:
+                                                # Dropped, reconnect and pick it up again
+                                                self.drop(device)
+                                                try:
+                                                        device.client.reconnect()
+                                                        self.register(device)
+                                                except OSError:
+                                                        pass
+                                        else:
+                                                device.client.loop_misc()
+                                                self.flush(device)
+
+                        for device in list(self.writing):
+                                sock = device.client.socket()
+                                if sock is None:
+                                        self.writing.discard(device)
+                                        continue
+                                events = selectors.EVENT_READ
+                                if device.client.want_write():
+                                        events |= selectors.EVENT_WRITE
+                                else:
+                                        self.writing.discard(device)
+                                self.selector.modify(sock, events, device)
+
+                        timeout = next_misc - now
+                        if self.presses:
+                                timeout = min(timeout, self.start_time + self.presses[0][0] - now)
+                        if not self.selector.get_map():
+                                time.sleep(max(timeout, 0))
+                                continue
+
+                        for key, events in self.selector.select(max(timeout, 0)):
+                                device = key.data
+                                client = device.client
+                                if events & selectors.EVENT_WRITE:
+                                        client.loop_write()
+                                if events & selectors.EVENT_READ:
+                                        if client.loop_read() != mqtt.MQTT_ERR_SUCCESS or client.socket() is None:
+                                                self.drop(device)
+                                                continue
+                                self.flush(device)
+
+                for device in self.devices:
+                        self.drop(device)
+                        device.client.disconnect()
+
+
+def main() -> None:
+        parser = argparse.ArgumentParser(description="Virtual device fleet against the local broker")
+        parser.add_argument("--broker", default=os.environ.get("LOADGEN_BROKER", "127.0.0.1"))
+        parser.add_argument("--port", type=int, default=int(os.environ.get("LOADGEN_PORT", "1883")))
+        parser.add_argument("--devices", type=int, default=100)
+        parser.add_argument("--threads", type=int, default=4, help="threads the clients are spread over")
+        parser.add_argument("--phase", type=parse_phase, action="append",
+                            help="burst|steady|ramp:SECONDS[:PARAM], repeated phases run in order")
+        parser.add_argument("--timeout", type=float, default=30, help="seconds before a request counts as lost")
+        parser.add_argument("--spread", type=float, default=0.05, help="location spread in degrees")
+        parser.add_argument("--settle", type=float, default=5, help="seconds to connect before the first phase")
+        parser.add_argument("--seed", type=int, default=None)
+        args = parser.parse_args()
+        phases = args.phase or [("burst", 120.0, 1.0)]
+
+        rng = random.Random(args.seed)
+        stats = Stats()
+        start = time.monotonic() + args.settle
+        shards = [Shard(i, args.broker, args.port, start) for i in range(args.threads)]
+        devices = []
+        for i in range(args.devices):
+                device = VirtualDevice(f"vdev-{i:04d}", stats, start, args.timeout, args.spread,
+                                       random.Random(rng.random()))
+                shards[i % len(shards)].add(device)
+                devices.append((device, shards[i % len(shards)]))
+
+        presses = arrivals(phases, args.devices, rng)
+        for t, d in presses:
+                device, shard = devices[d]
+                shard.schedule(t, device)
+
+        duration = sum(p[1] for p in phases)
+        print(f"{args.devices} devices, {len(presses)} presses over {duration:.0f} s", flush=True)
+        for shard in shards:
+                shard.start()
+
+        # Run the phases, then wait out the last requests
+        end = start + duration + args.timeout
+        last_answered, last = 0, time.monotonic()
+        try:
+                while time.monotonic() < end:
+                        time.sleep(min(10, max(end - time.monotonic(), 0)))
+                        now = time.monotonic()
+                        s = stats.report(max(now - start, 0))
+                        s["answers_per_s_last"] = round((s["answered"] - last_answered) / (now - last), 1)
+                        last_answered, last = s["answered"], now
+                        print("loadgen", s, flush=True)
+        except KeyboardInterrupt:
+                pass
+
+        for shard in shards:
+                shard.done.set()
+        for shard in shards:
+                shard.join(5)
+        for device, _ in devices:
+                device.check_timeout(math.inf)
+        print("result", stats.report(min(time.monotonic(), end) - start), flush=True)
+
+
+if __name__ == "__main__":
+        main()
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Makes a CA and a server certificate for the local broker. The build
+# embeds certs/ca.crt in place of the cloud's root CAs.
+set -e
+cd "$(dirname "$0")"
+mkdir -p certs
+cd certs
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 3650 \
+	-subj "/CN=ttk8 local CA" -keyout ca.key -out ca.crt
+# The firmware checks the broker address against the CN. No SAN, as
+# mbedTLS then only looks at DNS names.
+openssl req -newkey rsa:2048 -nodes -subj "/CN=192.0.2.2" \
+	-keyout server.key -out server.csr
+openssl x509 -req -in server.csr -CA ca.crt -CAkey ca.key -CAcreateserial \
+	-days 3650 -out server.crt
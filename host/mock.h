@@ -0,0 +1,15 @@
+#ifndef MOCK_H
+#define MOCK_H
+
+#include <zephyr.h>
+
+/* Name the display stand-in registers under */
+#define MOCK_DISPLAY_NAME "SSD16XX"
+
+/* Uptime of the last completed display refresh, 0 if none */
+int64_t mock_display_last_write();
+
+/* Display refreshes so far */
+uint32_t mock_display_writes();
+
+#endif /* MOCK_H */
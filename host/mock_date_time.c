@@ -0,0 +1,25 @@
+#include <zephyr.h>
+#include <date_time.h>
+
+#include "native_rtc.h"
+
+
+/* Network time stand-in: the host's clock, available at once */
+
+
+int date_time_now(int64_t *unix_time_ms) {
+    *unix_time_ms = native_rtc_gettime_us(RTC_CLOCK_PSEUDOHOSTREALTIME) / 1000;
+    return 0;
+}
+
+
+int date_time_update_async(date_time_evt_handler_t evt_handler) {
+    if (evt_handler) {
+        struct date_time_evt evt = {
+            .type = DATE_TIME_OBTAINED_NTP,
+        };
+        evt_handler(&evt);
+    }
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <zephyr.h>
+#include <device.h>
+#include <drivers/display.h>
+#include <string.h>
+
+#include "mock.h"
+
+
+/* SSD16xx stand-in with the panel's resolution and pixel format. Like
+   the driver, it refreshes on every write unless blanked, and on
+   unblanking. Refreshes are only counted and timed, which is what the
+   benchmark needs. */
+
+#define MOCK_DISPLAY_WIDTH  250
+#define MOCK_DISPLAY_HEIGHT 122
+
+static int64_t last_write;
+static uint32_t writes;
+static bool blanked;
+
+
+static void mock_display_refresh() {
+    if (CONFIG_MOCK_DISPLAY_REFRESH_MS > 0) {
+        k_msleep(CONFIG_MOCK_DISPLAY_REFRESH_MS);
+    }
+
+    writes++;
+    last_write = k_uptime_get();
+}
+
+
+static int mock_display_write(const struct device *dev, const uint16_t x, const uint16_t y,
+                  const struct display_buffer_descriptor *desc, const void *buf) {
+    if (!blanked) {
+        mock_display_refresh();
+    }
+
+    return 0;
+}
+
+
+static int mock_display_blanking_on(const struct device *dev) {
+    blanked = true;
+    return 0;
+}
+
+
+static int mock_display_blanking_off(const struct device *dev) {
+    if (blanked) {
+        blanked = false;
+        mock_display_refresh();
+    }
+
+    return 0;
+}
+
+
+static void mock_display_get_capabilities(const struct device *dev,
+                      struct display_capabilities *caps) {
+    memset(caps, 0, sizeof(*caps));
+    caps->x_resolution = MOCK_DISPLAY_WIDTH;
+    caps->y_resolution = MOCK_DISPLAY_HEIGHT;
+    caps->supported_pixel_formats = PIXEL_FORMAT_MONO10;
+    caps->current_pixel_format = PIXEL_FORMAT_MONO10;
+    caps->screen_info = SCREEN_INFO_MONO_VTILED | SCREEN_INFO_MONO_MSB_FIRST |
+                SCREEN_INFO_EPD | SCREEN_INFO_DOUBLE_BUFFER;
+}
+
+
+static int mock_display_set_pixel_format(const struct device *dev,
+                     const enum display_pixel_format pf) {
+    return pf == PIXEL_FORMAT_MONO10 ? 0 : -ENOTSUP;
+}
+
+
+static int mock_display_init(const struct device *dev) {
+    return 0;
+}
+
+
+static const struct display_driver_api mock_display_api = {
+    .blanking_on = mock_display_blanking_on,
+    .blanking_off = mock_display_blanking_off,
+    .write = mock_display_write,
+    .get_capabilities = mock_display_get_capabilities,
+    .set_pixel_format = mock_display_set_pixel_format,
+};
+
+DEVICE_DEFINE(mock_display, MOCK_DISPLAY_NAME, mock_display_init, NULL, NULL, NULL,
+          POST_KERNEL, CONFIG_APPLICATION_INIT_PRIORITY, &mock_display_api);
+
+
+int64_t mock_display_last_write() {
+    return last_write;
+}
+
+
+uint32_t mock_display_writes() {
+    return writes;
+}
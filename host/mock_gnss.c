@@ -0,0 +1,110 @@
+#include <zephyr.h>
+#include <string.h>
+#include <nrf_modem_gnss.h>
+
+
+/* Scripted GNSS receiver: one PVT event per second after start, with
+   more satellites tracked each second until the fix at
+   CONFIG_MOCK_GNSS_TTFF_MS. Like the real library the event handler
+   runs in interrupt context, here a timer expiry. */
+
+#define MOCK_SATELLITES 8
+
+static nrf_modem_gnss_event_handler_type_t handler;
+static struct nrf_modem_gnss_pvt_data_frame pvt;
+static int64_t start_time;
+
+
+static void fill_pvt() {
+    uint32_t elapsed = (uint32_t)(k_uptime_get() - start_time);
+    bool fix = elapsed >= CONFIG_MOCK_GNSS_TTFF_MS;
+    int tracked = MIN(MOCK_SATELLITES,
+        1 + elapsed * MOCK_SATELLITES / MAX(CONFIG_MOCK_GNSS_TTFF_MS, 1));
+
+    memset(&pvt, 0, sizeof(pvt));
+
+    for (int i = 0; i < tracked; i++) {
+        pvt.sv[i].sv = i + 1;
+        pvt.sv[i].cn0 = 300 + 20 * i;
+        pvt.sv[i].elevation = 20 + 5 * i;
+        pvt.sv[i].azimuth = 45 * i;
+        if (fix) {
+            pvt.sv[i].flags = NRF_MODEM_GNSS_SV_FLAG_USED_IN_FIX;
+        }
+    }
+
+    if (fix) {
+        pvt.flags = NRF_MODEM_GNSS_PVT_FLAG_FIX_VALID;
+        pvt.latitude = CONFIG_MOCK_GNSS_LATITUDE_UDEG / 1e6;
+        pvt.longitude = CONFIG_MOCK_GNSS_LONGITUDE_UDEG / 1e6;
+        pvt.accuracy = 5.0f;
+    }
+}
+
+
+static void pvt_timer_handler(struct k_timer *timer) {
+    fill_pvt();
+    if (handler) {
+        handler(NRF_MODEM_GNSS_EVT_PVT);
+    }
+}
+
+K_TIMER_DEFINE(pvt_timer, pvt_timer_handler, NULL);
+
+
+int32_t nrf_modem_gnss_init(void) {
+    return 0;
+}
+
+
+int32_t nrf_modem_gnss_event_handler_set(nrf_modem_gnss_event_handler_type_t evt_handler) {
+    handler = evt_handler;
+    return 0;
+}
+
+
+int32_t nrf_modem_gnss_fix_retry_set(uint16_t fix_retry) {
+    return 0;
+}
+
+
+int32_t nrf_modem_gnss_fix_interval_set(uint16_t fix_interval) {
+    return 0;
+}
+
+
+/* The stand-in only produces PVT frames */
+int32_t nrf_modem_gnss_nmea_mask_set(uint16_t nmea_mask) {
+    return 0;
+}
+
+
+int32_t nrf_modem_gnss_prio_mode_enable(void) {
+    return 0;
+}
+
+
+int32_t nrf_modem_gnss_start(void) {
+    /* Phase the 1 Hz events so one lands exactly on the fix */
+    uint32_t first = CONFIG_MOCK_GNSS_TTFF_MS % 1000;
+
+    start_time = k_uptime_get();
+    k_timer_start(&pvt_timer, K_MSEC(first ? first : 1000), K_SECONDS(1));
+    return 0;
+}
+
+
+int32_t nrf_modem_gnss_stop(void) {
+    k_timer_stop(&pvt_timer);
+    return 0;
+}
+
+
+int32_t nrf_modem_gnss_read(void *buf, int32_t buf_len, int type) {
+    if (type != NRF_MODEM_GNSS_DATA_PVT || buf_len < (int32_t)sizeof(pvt)) {
+        return -EINVAL;
+    }
+
+    memcpy(buf, &pvt, sizeof(pvt));
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include <zephyr.h>
+#include <modem/lte_lc.h>
+
+
+/* LTE link control stand-in. The host is always "attached": activating
+   LTE reports home registration after CONFIG_MOCK_LTE_ATTACH_MS and then
+   the PSM timers a typical network grants. */
+
+#define MOCK_PSM_TAU_S      3600
+#define MOCK_PSM_ACTIVE_S   60
+
+static lte_lc_evt_handler_t handler;
+
+
+static void attach_work_handler(struct k_work *work) {
+    struct lte_lc_evt evt = {
+        .type = LTE_LC_EVT_NW_REG_STATUS,
+        .nw_reg_status = LTE_LC_NW_REG_REGISTERED_HOME,
+    };
+
+    if (!handler) {
+        return;
+    }
+
+    handler(&evt);
+
+    evt.type = LTE_LC_EVT_PSM_UPDATE;
+    evt.psm_cfg.tau = MOCK_PSM_TAU_S;
+    evt.psm_cfg.active_time = MOCK_PSM_ACTIVE_S;
+    handler(&evt);
+}
+
+K_WORK_DELAYABLE_DEFINE(attach_work, attach_work_handler);
+
+
+int lte_lc_init(void) {
+    return 0;
+}
+
+
+void lte_lc_register_handler(lte_lc_evt_handler_t evt_handler) {
+    handler = evt_handler;
+}
+
+
+int lte_lc_func_mode_set(enum lte_lc_func_mode mode) {
+    if (mode == LTE_LC_FUNC_MODE_NORMAL || mode == LTE_LC_FUNC_MODE_ACTIVATE_LTE) {
+        k_work_schedule(&attach_work, K_MSEC(CONFIG_MOCK_LTE_ATTACH_MS));
+    }
+
+    return 0;
+}
+
+
+int lte_lc_conn_eval_params_get(struct lte_lc_conn_eval_params *params) {
+    params->rrc_state = LTE_LC_RRC_MODE_CONNECTED;
+    params->energy_estimate = LTE_LC_ENERGY_CONSUMPTION_NORMAL;
+    /* An index like the modem's, -90 dBm */
+    params->rsrp = 50;
+    params->ce_level = LTE_LC_CE_LEVEL_0;
+
+    return 0;
+}
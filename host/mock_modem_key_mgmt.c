@@ -0,0 +1,29 @@
+#include <zephyr.h>
+#include <net/tls_credentials.h>
+#include <modem/modem_key_mgmt.h>
+
+
+/* The modem keeps the root CAs in its own key store. On the host they go
+   to Zephyr's TLS credentials under the same tags, except that the
+   cloud's roots are swapped for the local broker's CA. */
+
+static const unsigned char local_broker_ca[] = {
+#include "local_broker_ca.inc"
+    /* mbedTLS parses PEM only with the terminating NUL */
+    0x00
+};
+
+
+int modem_key_mgmt_write(nrf_sec_tag_t sec_tag,
+             enum modem_key_mgmt_cred_type cred_type,
+             const void *buf, size_t len) {
+    if (cred_type != MODEM_KEY_MGMT_CRED_TYPE_CA_CHAIN) {
+        return -ENOTSUP;
+    }
+
+    /* Provisioning runs on every boot */
+    tls_credential_delete(sec_tag, TLS_CREDENTIAL_CA_CERTIFICATE);
+
+    return tls_credential_add(sec_tag, TLS_CREDENTIAL_CA_CERTIFICATE,
+                  local_broker_ca, sizeof(local_broker_ca));
+}
@@ -0,0 +1,69 @@
+"""Answers the host build's location requests in place of the cloud bridge.
+
+Connects to the local broker from mosquitto.conf and replies like
+cloud/main.py does, using the same downlink codec and delta baselines,
+with scripted weather instead of OpenWeatherMap. The temperature drifts
+a little with every request so deltas get exercised.
+
+        pip install paho-mqtt
+        python responder.py
+"""
+import os
+import sys
+
+import paho.mqtt.client as mqtt
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "cloud"))
+from downlink import Baselines  # noqa: E402
+from telemetry import decode  # noqa: E402
+
+BROKER = os.environ.get("RESPONDER_BROKER", "127.0.0.1")
+PORT = int(os.environ.get("RESPONDER_PORT", "1883"))
+
+client = mqtt.Client()
+requests = 0
+
+
+def publish(device: str, payload: bytes) -> None:
+        client.publish(f"/devices/{device}/commands/w", payload, qos=1)
+
+
+baselines = Baselines(publish)
+
+
+def on_connect(client, userdata, flags, rc) -> None:
+        client.subscribe("/devices/+/events/#", qos=1)
+
+
+def on_message(client, userdata, message) -> None:
+        global requests
+        parts = message.topic.split("/")
+        device, subfolder = parts[2], "/".join(parts[4:])
+
+        if subfolder == "telemetry":
+                print(device, subfolder, decode(message.payload))
+                return
+
+        data = message.payload.decode()
+
+        if subfolder != "l":
+                print(device, subfolder, data)
+                return
+
+        fields = data.split(";")
+        request_id = int(fields[2])
+        seq = int(fields[3]) if len(fields) > 3 else None
+        baselines.reported(device, seq)
+
+        requests += 1
+        temperature = 12.0 + (requests % 5) * 0.5
+        hours = f"15/0/803/{temperature},18/0/500/{temperature - 1},21/1/800/9.5,0/1/800/8"
+        days = "1/500/6/13.5,2/803/7/14,3/800/8/16.5,4/600/-1.5/3"
+        baselines.send(device, request_id, f"Clouds;04d;{temperature};Trondheim;803;{hours};{days}")
+        print(device, data, baselines.stats())
+
+
+client.on_connect = on_connect
+client.on_message = on_message
+client.connect(BROKER, PORT)
+client.loop_forever()
@@ -0,0 +1,192 @@
+"""Measures how the bridge's throughput scales with its shard count.
+
+Each shard is a process running cloud/main.py's on_message behind the
+ordered subscription stand-in from bridge_local.py, with weather lookups
+taking a scripted time and never cached, so the shards do the work a
+burst of new areas would give them. A router stand-in hands each
+device's events to one shard by a hash of the deviceId, the way Pub/Sub
+keeps an ordering key on one subscriber. The shards share their state
+through Redis, over TCP as they would across hosts: --state-url, or a
+redis-server started for the run.
+
+After the burst, a share of the events is redelivered to a different
+shard than the one that answered them, as after a rebalance. None of
+them may be answered again, and every device has to get its answers in
+the order it asked.
+
+        pip install redis
+        python shard_scaling.py --shards 1,2,4,8
+"""
+import argparse
+import multiprocessing
+import os
+import queue
+import random
+import socket
+import subprocess
+import sys
+import time
+import zlib
+
+import redis
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "cloud"))
+from downlink_codec import decode  # noqa: E402
+
+# How long to wait for stray answers to redeliveries
+REDELIVERY_WAIT_S = 2.0
+
+
+def shard(index: int, state_url: str, latency_ms: float, inbox, outbox) -> None:
+        # The bridge logs every message, which would swamp the report
+        sys.stdout = open(os.devnull, "w")
+        os.environ.update({
+                "SHARD_ID": f"shard-{index}",
+                "SHARD_STATE_URL": state_url,
+                "WEATHER_CACHE_TTL_S": "0",
+        })
+
+        import bridge_local
+        bridge_local.WEATHER_LATENCY_MS = latency_ms
+        bridge = bridge_local.load_bridge()
+
+        class Commands():
+                def send_command_to_device(self, name: str, binary_data: bytes, subfolder: str = "") -> None:
+                        outbox.put((index, name.rsplit("/", 1)[1], binary_data, time.monotonic()))
+
+        bridge.iot_client = Commands()
+        sub = bridge_local.OrderedSubscription(bridge.on_message, bridge.WORKERS, bridge.MAX_MESSAGES)
+        outbox.put((index, None, None, None))
+
+        while True:
+                item = inbox.get()
+                if item is None:
+                        return
+                device, data, event_id, published = item
+                message = bridge_local.Message(sub, device, bridge.LOCATION_SUBFOLDER, data)
+                # As the router republishes them
+                message.attributes["eventId"] = event_id
+                message.attributes["eventTime"] = str(published)
+                sub.publish(message)
+
+
+def owner(device: str, shards: int) -> int:
+        return zlib.crc32(device.encode()) % shards
+
+
+def start_redis() -> tuple:
+        """A throwaway redis-server on a free port, and its URL."""
+        with socket.socket() as s:
+                s.bind(("127.0.0.1", 0))
+                port = s.getsockname()[1]
+        server = subprocess.Popen(["redis-server", "--port", str(port), "--save", "", "--appendonly", "no"],
+                                  stdout=subprocess.DEVNULL)
+        url = f"redis://127.0.0.1:{port}/0"
+        for _ in range(50):
+                try:
+                        redis.Redis.from_url(url).ping()
+                        return server, url
+                except redis.ConnectionError:
+                        time.sleep(0.1)
+        server.kill()
+        raise RuntimeError("redis-server did not come up")
+
+
+def run(shards: int, devices: int, events: int, latency_ms: float, redeliver: float, state_url: str) -> dict:
+        ctx = multiprocessing.get_context("spawn")
+        outbox = ctx.Queue()
+        inboxes = [ctx.Queue() for _ in range(shards)]
+
+        # Every run starts without state
+        redis.Redis.from_url(state_url).flushdb()
+
+        procs = [ctx.Process(target=shard, args=(i, state_url, latency_ms, inboxes[i], outbox), daemon=True)
+                 for i in range(shards)]
+        for p in procs:
+                p.start()
+        # Wait for every shard to be up before timing
+        for _ in range(shards):
+                outbox.get()
+
+        names = [f"vdev-{i:04d}" for i in range(devices)]
+        sent = []
+        start = time.monotonic()
+        base = time.time()
+        for n in range(events):
+                device = names[n % devices]
+                # Request ids count up per device, so order shows in the answers
+                request_id = n // devices + 1
+                data = f"63.{n % 10000:04d};10.3951;{request_id};0".encode()
+                event = (device, data, f"e{n}", base + n * 1e-6)
+                sent.append(event)
+                inboxes[owner(device, shards)].put(event)
+
+        answers = {}
+        last = start
+        while sum(len(a) for a in answers.values()) < events:
+                try:
+                        _, device, payload, at = outbox.get(timeout=30)
+                except queue.Empty:
+                        break
+                answers.setdefault(device, []).append(decode(payload)["msg_id"])
+                last = at
+        elapsed = last - start
+        answered = sum(len(a) for a in answers.values())
+
+        # Redeliveries land on another shard, as after a rebalance
+        redelivered = random.sample(sent, int(len(sent) * redeliver))
+        for event in redelivered:
+                inboxes[(owner(event[0], shards) + 1) % shards].put(event)
+        extra = 0
+        deadline = time.monotonic() + REDELIVERY_WAIT_S
+        while time.monotonic() < deadline:
+                try:
+                        outbox.get(timeout=0.1)
+                        extra += 1
+                except queue.Empty:
+                        pass
+
+        for inbox in inboxes:
+                inbox.put(None)
+        for p in procs:
+                p.join(5)
+
+        return {
+                "shards": shards,
+                "events": events,
+                "answered": answered,
+                "seconds": round(elapsed, 2),
+                "per_s": round(answered / elapsed, 1) if elapsed > 0 else 0.0,
+                "in_order": all(a == sorted(a) and len(a) == len(set(a)) for a in answers.values()),
+                "redelivered": len(redelivered),
+                "answered_again": extra,
+        }
+
+
+def main() -> None:
+        parser = argparse.ArgumentParser(description="Bridge throughput against shard count")
+        parser.add_argument("--shards", default="1,2,4,8", help="shard counts to run, comma separated")
+        parser.add_argument("--devices-per-shard", type=int, default=100)
+        parser.add_argument("--events-per-shard", type=int, default=800)
+        parser.add_argument("--latency-ms", type=float, default=100, help="weather lookup time")
+        parser.add_argument("--redeliver", type=float, default=0.1, help="share of events redelivered")
+        parser.add_argument("--state-url", help="Redis the shards share, flushed before every run. By default one is started")
+        args = parser.parse_args()
+
+        server, state_url = (None, args.state_url) if args.state_url else start_redis()
+        results = []
+        try:
+                for n in (int(s) for s in args.shards.split(",")):
+                        r = run(n, args.devices_per_shard * n, args.events_per_shard * n, args.latency_ms,
+                                args.redeliver, state_url)
+                        r["scaling"] = round(r["per_s"] / (results[0]["per_s"] / results[0]["shards"]) / n, 2) \
+                                if results else 1.0
+                        results.append(r)
+                        print(r, flush=True)
+        finally:
+                if server:
+                        server.terminate()
+
+
+if __name__ == "__main__":
+        main()
@@ -0,0 +1,38 @@
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <zephyr.h>
+
+
+/* Shared pool of fixed size network buffers.
+
+   Received MQTT payloads, FOTA chunks and the JWT only live for as long
+   as one event is handled, so they take a block from here instead of
+   each keeping a static buffer of its own. The statistics tell how many
+   blocks were in use at once and how full they were, which is what
+   CONFIG_BUF_POOL_BLOCKS and CONFIG_BUF_POOL_BLOCK_SIZE are sized from.
+*/
+
+/* Requests by size, in eighths of the block size */
+#define BUF_POOL_HIST_BUCKETS 8
+
+struct buf_pool_stats {
+    uint32_t allocs;
+    /* Requests larger than a block, or with no block free in time */
+    uint32_t failures;
+    uint32_t max_used;
+    uint32_t max_request;
+    uint32_t hist[BUF_POOL_HIST_BUCKETS];
+};
+
+
+/* Returns a block for len bytes, or NULL if len does not fit or no block
+   freed up before the timeout */
+void *buf_pool_alloc(size_t len, k_timeout_t timeout);
+void buf_pool_free(void *buf);
+
+void buf_pool_stats_get(struct buf_pool_stats *out);
+void buf_pool_print_stats();
+
+
+#endif /* BUF_POOL_H */
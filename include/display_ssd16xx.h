@@ -1,11 +1,17 @@
 #ifndef DISPLAY_SSD16XX_H
 #define DISPLAY_SSD16XX_H
 
+#include <zephyr.h>
+
+#include "events.h"
 
 
 void display_init();
 void display_print_placeholder();
-void display_print_weather(char *weather, char *icon_id, char *temperature, char *location);
+void display_print_weather(char *weather, char *icon_id, uint16_t condition,
+                           char *temperature, char *location);
+void display_print_hours(const struct forecast_hour *hours, int count);
+void display_print_days(const struct forecast_day *days, int count);
 
 
 #endif /* DISPLAY_SSD16XX_H */
\ No newline at end of file
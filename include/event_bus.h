@@ -0,0 +1,94 @@
+#ifndef EVENT_BUS_H
+#define EVENT_BUS_H
+
+#include <zephyr.h>
+
+
+/* Publish/subscribe bus between the firmware modules.
+
+   Every channel carries one message type and owns a statically allocated
+   pool of message buffers. A publisher allocates a buffer from the
+   channel, fills it in place and publishes it. Subscribers receive a
+   pointer to the same buffer, so nothing is copied after the publisher
+   wrote it. The buffer goes back to the pool when the last subscriber has
+   released it.
+
+   Allocating and publishing never block and may be done from ISRs, such
+   as the GNSS event handler. A subscriber is a message queue drained by a
+   thread of the owning module, so each consumer runs at its own priority.
+*/
+
+struct bus_channel_stats {
+    uint32_t published;
+    uint32_t delivered;
+    uint32_t dropped;
+    uint32_t max_depth;
+    uint32_t latency_max_us;
+    uint64_t latency_total_us;
+};
+
+struct bus_subscriber {
+    const char *name;
+    struct k_msgq *msgq;
+};
+
+struct bus_channel {
+    const char *name;
+    size_t msg_size;
+    struct k_mem_slab *slab;
+    struct bus_subscriber *subs[CONFIG_EVENT_BUS_MAX_SUBSCRIBERS];
+    uint8_t sub_count;
+    struct bus_channel_stats stats;
+};
+
+/* Header in front of every message buffer */
+struct bus_msg {
+    struct bus_channel *chan;
+    atomic_t refs;
+    uint32_t publish_cycles;
+    uint8_t data[] __aligned(8);
+};
+
+
+#define BUS_CHANNEL_DEFINE(_name, _type, _count)                              \
+    K_MEM_SLAB_DEFINE(_name##_slab,                                           \
+        ROUND_UP(sizeof(struct bus_msg) + sizeof(_type), 8), _count, 8);      \
+    struct bus_channel _name = {                                              \
+        .name = #_name,                                                       \
+        .msg_size = sizeof(_type),                                            \
+        .slab = &_name##_slab,                                                \
+    }
+
+#define BUS_SUBSCRIBER_DEFINE(_name, _depth)                                  \
+    K_MSGQ_DEFINE(_name##_msgq, sizeof(struct bus_msg *), _depth, 4);         \
+    struct bus_subscriber _name = {                                           \
+        .name = #_name,                                                       \
+        .msgq = &_name##_msgq,                                                \
+    }
+
+
+int bus_subscribe(struct bus_channel *chan, struct bus_subscriber *sub);
+
+/* Returns a message buffer of the channel's type, or NULL when all
+   buffers are in flight. Never blocks. A buffer that ends up not being
+   published is given back with bus_release(). */
+void *bus_alloc(struct bus_channel *chan);
+
+/* Hands a buffer from bus_alloc() to all subscribers. The publisher must
+   not touch the buffer afterwards. */
+void bus_publish(void *msg);
+
+/* Waits for the next message to the subscriber. The buffer is shared
+   with the other subscribers and must be released with bus_release(). */
+const void *bus_receive(struct bus_subscriber *sub, const struct bus_channel **chan, k_timeout_t timeout);
+void bus_release(const void *msg);
+
+/* Sets up a k_poll() event that is ready once the subscriber has a
+   message, for threads that wait on other objects too. Reset its state
+   to K_POLL_STATE_NOT_READY before polling again. */
+void bus_poll_event_init(struct k_poll_event *event, struct bus_subscriber *sub);
+
+void bus_print_stats(const struct bus_channel *chan);
+
+
+#endif /* EVENT_BUS_H */
@@ -0,0 +1,106 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include "event_bus.h"
+
+
+/* Button was pressed (debounced). Long presses are reported once held
+   for CONFIG_BUTTON_LONG_PRESS_MS, short ones on release. */
+struct button_evt {
+    int64_t timestamp;
+    bool long_press;
+};
+
+/* GNSS progress, published on every PVT frame. The position and
+   velocity are copied from the frame by the GNSS handler. */
+struct gnss_status_evt {
+    bool fix;
+    uint8_t tracked;
+    uint8_t in_fix;
+    uint8_t unhealthy;
+    double latitude;
+    double longitude;
+    /* m/s and degrees from north */
+    float speed;
+    float heading;
+};
+
+/* Request for a GNSS fix. Background requests only lead to an uplink
+   when the device has moved, like adaptive tracking fixes. */
+struct location_request_evt {
+    bool user_request;
+};
+
+/* Location to request weather for */
+struct location_evt {
+    double latitude;
+    double longitude;
+    bool user_request;
+};
+
+#define FORECAST_HOURS 4
+#define FORECAST_DAYS  4
+
+enum forecast_page {
+    FORECAST_PAGE_NOW,
+    FORECAST_PAGE_HOURS,
+    FORECAST_PAGE_DAYS,
+    FORECAST_PAGE_COUNT,
+};
+
+/* Temperatures in tenths of a degree Celsius */
+struct forecast_hour {
+    uint8_t hour;
+    bool night;
+    uint16_t condition;
+    int16_t temperature;
+};
+
+struct forecast_day {
+    /* 0 is Monday */
+    uint8_t weekday;
+    uint16_t condition;
+    int16_t temp_min;
+    int16_t temp_max;
+};
+
+/* Weather received from the cloud */
+struct weather_evt {
+    char weather[32];
+    char icon_id[4];
+    /* OpenWeatherMap condition code, 0 if the cloud did not send one */
+    uint16_t condition;
+    char temperature[8];
+    char location[32];
+    /* Pushed by the cloud rather than a response to a request */
+    bool pushed;
+    uint8_t hour_count;
+    struct forecast_hour hours[FORECAST_HOURS];
+    uint8_t day_count;
+    struct forecast_day days[FORECAST_DAYS];
+    /* Page to draw, always FORECAST_PAGE_NOW from the cloud */
+    uint8_t page;
+};
+
+/* A FOTA chunk has been applied, or failed to, so the next one can be
+   requested */
+struct fota_evt {
+    int err;
+};
+
+
+extern struct bus_channel button_chan;
+extern struct bus_channel gnss_status_chan;
+extern struct bus_channel location_request_chan;
+extern struct bus_channel location_chan;
+/* Weather as received from the cloud */
+extern struct bus_channel forecast_chan;
+/* Weather to show on the display */
+extern struct bus_channel weather_chan;
+extern struct bus_channel fota_chan;
+
+
+void events_print_stats();
+
+
+#endif /* EVENTS_H */
@@ -0,0 +1,58 @@
+#ifndef FOTA_DELTA_H
+#define FOTA_DELTA_H
+
+#include <zephyr.h>
+
+
+/* Delta firmware update over MQTT.
+
+   The cloud sends a delta between the image in mcuboot_primary and the
+   new image as a stream of chunks. Each chunk starts with a header:
+
+       u8  version (FOTA_CHUNK_VERSION)
+       u8  reserved
+       u16 data length
+       u32 image id
+       u32 offset of the data in the delta stream
+       u32 total length of the delta stream
+
+   all big-endian. The device applies the delta while it is received and
+   streams the new image into mcuboot_secondary. After each chunk, or on
+   reconnect, the device asks for the next chunk with an uplink of
+   "image_id;offset", so an interrupted download resumes where it left
+   off. An image that fails to apply or verify is asked for again from
+   offset 0, up to CONFIG_FOTA_DELTA_RETRIES times.
+
+   The delta stream itself is
+
+       u32 magic (FOTA_DELTA_MAGIC)
+       u32 source size, u32 source CRC32
+       u32 target size, u32 target CRC32
+
+   followed by operations:
+
+       0x01 u32 offset u32 length   copy from the running image
+       0x02 u32 length data         insert literal data
+*/
+
+#define FOTA_CHUNK_VERSION   1
+#define FOTA_CHUNK_HDR_SIZE  16
+#define FOTA_DELTA_MAGIC     0x54444c54 /* "TDLT" */
+
+
+/* Hands over a chunk received on CONFIG_FOTA_SUB_TOPIC, in a buffer from
+   buf_pool_alloc(). It is applied on the FOTA thread, which frees the
+   buffer and publishes on fota_chan when done, so the network thread
+   does not wait for flash. Returns -EBUSY while the last chunk is still
+   being applied, and the buffer stays the caller's. */
+int fota_delta_submit_chunk(uint8_t *buf, size_t len);
+
+/* Writes the next chunk request to buf. Returns its length, or 0 when
+   no download is in progress or a chunk is still being applied. */
+int fota_delta_next_request(char *buf, size_t size);
+
+/* Marks the running image as good once it has reached the cloud */
+void fota_delta_confirm_image();
+
+
+#endif /* FOTA_DELTA_H */
@@ -0,0 +1,78 @@
+#ifndef GNSS_TRACE_H
+#define GNSS_TRACE_H
+
+#include <zephyr.h>
+#include <nrf_modem_gnss.h>
+
+
+/* GNSS trace recording and replay.
+
+   A trace starts with a header of u32 magic (GNSS_TRACE_MAGIC) and u8
+   version, followed by records of
+
+       u8  type
+       u16 payload length
+       u32 milliseconds since recording started
+
+   and the payload, all little-endian. GNSS_TRACE_START and
+   GNSS_TRACE_STOP mark where the app started and stopped the receiver,
+   so a trace holds one session per fix. PVT payloads are quantized:
+
+       u8  flags
+       i32 latitude, i32 longitude   1e-7 degrees
+       i16 altitude                  m
+       u16 accuracy                  cm
+       u16 speed                     cm/s
+       u16 heading                   0.01 degrees
+       u16 year, u8 month, day, hour, minute, seconds, u16 ms
+       u16 pdop, u16 hdop            0.01
+       u8  satellite count
+       per satellite: u8 sv, u8 signal, u16 cn0, i8 elevation,
+                      i16 azimuth, u8 flags
+
+   NMEA payloads are the sentence without terminator.
+   scripts/gnss_trace.py captures, summarizes and converts traces.
+*/
+
+#define GNSS_TRACE_MAGIC     0x43525447 /* "GTRC" */
+#define GNSS_TRACE_VERSION   1
+#define GNSS_TRACE_HDR_SIZE  5
+#define GNSS_TRACE_REC_SIZE  7
+
+enum gnss_trace_type {
+    GNSS_TRACE_START = 1,
+    GNSS_TRACE_STOP,
+    GNSS_TRACE_PVT,
+    GNSS_TRACE_NMEA,
+};
+
+
+#if defined(CONFIG_GNSS_TRACE_RECORD)
+
+/* Safe to call from the GNSS event handler */
+void gnss_trace_record_pvt(const struct nrf_modem_gnss_pvt_data_frame *pvt);
+void gnss_trace_record_nmea(const struct nrf_modem_gnss_nmea_data_frame *nmea);
+void gnss_trace_record_session(bool start);
+
+#else
+
+static inline void gnss_trace_record_pvt(const struct nrf_modem_gnss_pvt_data_frame *pvt) {}
+static inline void gnss_trace_record_nmea(const struct nrf_modem_gnss_nmea_data_frame *nmea) {}
+static inline void gnss_trace_record_session(bool start) {}
+
+#endif /* CONFIG_GNSS_TRACE_RECORD */
+
+
+#if defined(CONFIG_GNSS_TRACE_REPLAY)
+
+/* Stand-ins for the nrf_modem_gnss calls of the same name. Each start
+   plays the next session of the trace, wrapping around at the end. */
+int gnss_trace_replay_init(nrf_modem_gnss_event_handler_type_t handler);
+int32_t gnss_trace_replay_start(void);
+int32_t gnss_trace_replay_stop(void);
+int32_t gnss_trace_replay_read(void *buf, int32_t buf_len, int type);
+
+#endif /* CONFIG_GNSS_TRACE_REPLAY */
+
+
+#endif /* GNSS_TRACE_H */
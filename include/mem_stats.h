@@ -0,0 +1,14 @@
+#ifndef MEM_STATS_H
+#define MEM_STATS_H
+
+#include <zephyr.h>
+
+
+/* Prints where the statically carved up RAM goes: the stack high-water
+   mark of every thread, the use and peak of the system and modem library
+   heaps with CONFIG_MEM_STATS_HEAPS, and the network buffer pool. Printed
+   every CONFIG_MEM_STATS_INTERVAL_S if that is not 0. */
+void mem_stats_print();
+
+
+#endif /* MEM_STATS_H */
@@ -1,9 +1,53 @@
 #ifndef MQTT_H
 #define MQTT_H
 
+#include <zephyr.h>
+
+
+/* Run-time statistics of the MQTT network thread */
+struct mqtt_service_stats {
+    uint32_t loops;
+    uint32_t rx_wakeups;
+    uint32_t tx_wakeups;
+    uint32_t tx_messages;
+    uint32_t idle_wakeups;
+    uint32_t reconnects;
+    uint32_t max_service_us;
+    uint32_t weather_bytes;
+    uint32_t redraws;
+    uint32_t pushes;
+    uint32_t stale_responses;
+    uint32_t full_updates;
+    uint32_t delta_updates;
+    uint32_t baseline_misses;
+    uint32_t config_msgs;
+    uint32_t config_bytes;
+    uint32_t jwt_signed;
+    /* Uptime the first JWT was signed at, and the time source it used */
+    uint32_t first_jwt_ms;
+    uint8_t first_jwt_source;
+    /* MQTT packets, without TLS and TCP/IP */
+    uint32_t tx_bytes;
+    uint32_t tx_payload_bytes;
+    uint32_t rx_bytes;
+    uint32_t rx_payload_bytes;
+    /* Location requests answered, and the bytes it took both ways */
+    uint32_t round_trips;
+    uint32_t round_trip_up_bytes;
+    uint32_t round_trip_down_bytes;
+    uint32_t sessions_resumed;
+    int64_t last_publish_time;
+    /* Socket thread */
+    size_t stack_size;
+    size_t stack_unused;
+    /* Uplink thread */
+    size_t tx_stack_size;
+    size_t tx_stack_unused;
+};
 
 int mqtt_service_init();
 void mqtt_service_start();
-int publish_location(double latitude, double longitude);
+void mqtt_service_stats_get(struct mqtt_service_stats *out);
+void mqtt_service_print_stats();
 
 #endif /* MQTT_H */
\ No newline at end of file
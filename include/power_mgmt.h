@@ -0,0 +1,47 @@
+#ifndef POWER_MGMT_H
+#define POWER_MGMT_H
+
+#include <zephyr.h>
+
+
+/* Runtime power management of the peripherals the app drives.
+
+   A module holds its domain with power_mgmt_get() while it uses it and
+   gives it back with power_mgmt_put(). Once a domain has been left alone
+   for its idle time, its device is suspended through device PM, and the
+   next get resumes it first. A button press resumes every domain right
+   away, so the display and console are up by the time the weather is. */
+
+enum power_domain {
+    POWER_DISPLAY,  /* SPI bus of the e-paper controller */
+    POWER_CONSOLE,  /* UART of the console and AT host */
+    POWER_DOMAIN_COUNT,
+};
+
+
+#if defined(CONFIG_POWER_MGMT)
+
+/* Resumes the domain if needed. Returns 0, or the device PM error in
+   which case the domain is still held and has to be put. */
+int power_mgmt_get(enum power_domain domain);
+void power_mgmt_put(enum power_domain domain);
+
+/* Resumes all domains in the background, safe to call from ISRs */
+void power_mgmt_wake();
+
+/* Time each domain spent active and suspended, what resuming costs and
+   how long after a wake everything was up. Printed every
+   CONFIG_POWER_MGMT_STATS_INTERVAL_S if that is not 0. */
+void power_mgmt_print_stats();
+
+#else
+
+static inline int power_mgmt_get(enum power_domain domain) { return 0; }
+static inline void power_mgmt_put(enum power_domain domain) {}
+static inline void power_mgmt_wake() {}
+static inline void power_mgmt_print_stats() {}
+
+#endif /* CONFIG_POWER_MGMT */
+
+
+#endif /* POWER_MGMT_H */
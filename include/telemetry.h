@@ -0,0 +1,63 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <zephyr.h>
+#include <nrf_modem_gnss.h>
+
+
+/* GNSS and link quality summaries for the fleet.
+
+   Samples are folded into fixed-size counters as they happen, and sent
+   on CONFIG_MQTT_TELEMETRY_TOPIC along with the next location the user
+   asked for, so they never wake the radio on their own. Sending starts
+   a new period. The message is, little-endian:
+
+       u8  version                   TELEMETRY_VERSION
+       u32 period                    s
+       u16 GNSS sessions, u16 fixes
+       u16 TTFF min, max, mean       0.1 s
+       u16 TTFF histogram[6]         < 5, 10, 20, 40, 80 s and above
+       u16 C/N0 histogram[8]         per satellite and PVT, < 15, 20, 25,
+                                     30, 35, 40, 45 dB-Hz and above
+       u8  satellites in fix min, max, mean
+       u16 RSRP samples              one per uplink
+       i8  RSRP min, max, mean       dBm
+       u16 MQTT reconnects
+
+   Counters saturate, and min, max and mean are 0 without samples.
+   cloud/telemetry.py decodes it.
+*/
+
+#define TELEMETRY_VERSION    1
+#define TELEMETRY_TTFF_BINS  6
+#define TELEMETRY_CN0_BINS   8
+#define TELEMETRY_MSG_SIZE   53
+
+
+#if defined(CONFIG_TELEMETRY)
+
+/* Safe to call from the GNSS event handler */
+void telemetry_gnss_start();
+void telemetry_gnss_pvt(const struct nrf_modem_gnss_pvt_data_frame *pvt);
+void telemetry_gnss_fix(uint32_t ttff_ms, uint8_t in_fix);
+
+void telemetry_link(int16_t rsrp_dbm);
+void telemetry_reconnect();
+
+/* Encodes the summary since the last call into buf and starts a new
+   period, whether or not the message then makes it out. Returns the
+   length, 0 if nothing was recorded, or -ENOMEM. */
+int telemetry_take(uint8_t *buf, size_t size);
+
+#else
+
+static inline void telemetry_gnss_start() {}
+static inline void telemetry_gnss_pvt(const struct nrf_modem_gnss_pvt_data_frame *pvt) {}
+static inline void telemetry_gnss_fix(uint32_t ttff_ms, uint8_t in_fix) {}
+static inline void telemetry_link(int16_t rsrp_dbm) {}
+static inline void telemetry_reconnect() {}
+
+#endif /* CONFIG_TELEMETRY */
+
+
+#endif /* TELEMETRY_H */
@@ -0,0 +1,50 @@
+#ifndef TIME_SERVICE_H
+#define TIME_SERVICE_H
+
+#include <zephyr.h>
+
+
+/* Wall clock time from the best source at hand.
+
+   The time kept in settings is available right after boot, but only as a
+   lower bound, as the device may have been off for any length of time
+   since. The modem clock, set by the network (NITZ), and NTP come in
+   through the date_time library once LTE is up. */
+
+enum time_source {
+    TIME_SOURCE_NONE,
+    TIME_SOURCE_PERSISTED,
+    TIME_SOURCE_MODEM,
+    TIME_SOURCE_NTP,
+    TIME_SOURCE_COUNT,
+};
+
+/* Uncertainty of a lower bound */
+#define TIME_UNCERTAINTY_UNBOUNDED UINT32_MAX
+
+struct time_estimate {
+    int64_t unix_ms;
+    /* The true time is within unix_ms +- uncertainty_ms. For persisted
+       time it is TIME_UNCERTAINTY_UNBOUNDED, and unix_ms a lower bound. */
+    uint32_t uncertainty_ms;
+    enum time_source source;
+};
+
+/* Loads the persisted time, call before anything asks for the time */
+int time_service_init();
+
+/* Starts network time sync, once LTE is connected */
+void time_service_start();
+
+/* Returns -ENODATA if there is no time from any source yet */
+int time_service_now(struct time_estimate *t);
+
+/* Waits for the estimate to change. Returns -EAGAIN on timeout. */
+int time_service_wait(k_timeout_t timeout);
+
+const char *time_source_name(enum time_source source);
+
+void time_service_print_stats();
+
+
+#endif /* TIME_SERVICE_H */
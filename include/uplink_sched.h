@@ -0,0 +1,25 @@
+#ifndef UPLINK_SCHED_H
+#define UPLINK_SCHED_H
+
+#include <zephyr.h>
+
+
+enum uplink_priority {
+    /* Requested by the user, sent right away */
+    UPLINK_URGENT,
+    /* May wait for a better link until its deadline */
+    UPLINK_DEFERRABLE,
+};
+
+
+/* Returns true when an uplink queued at uptime queued_at should be sent
+   now, based on the modem's connection evaluation. */
+bool uplink_sched_ready(enum uplink_priority prio, int64_t queued_at);
+
+/* Records the link quality an uplink was sent at */
+void uplink_sched_transmitted(enum uplink_priority prio);
+
+void uplink_sched_print_stats();
+
+
+#endif /* UPLINK_SCHED_H */
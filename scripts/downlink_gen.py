@@ -0,0 +1,307 @@
+#!/usr/bin/env python3
+"""Generates the downlink codec for the firmware and the bridge.
+
+Reads schema/downlink.json and writes a C header and source for the
+firmware build and a Python module for the bridge, so both sides decode
+exactly the same wire format:
+
+        byte 0          schema version << 4 | flags
+        bytes 1-2       message id, big endian, 0 for pushes
+        byte 3          sequence number of the state after this message
+        byte 4          sequence number a delta applies to
+        bytes 5-6       mask of fields present, bit n is field n
+        then per field  length byte and value, in field order
+
+Strings are UTF-8 without terminator, integers big endian. Lists are up
+to max_items records of integers packed back to back, and are always
+sent whole. Every field is length prefixed, so decoders skip fields added by a newer schema with the
+same version. Removing or changing a field needs a new version.
+
+The CMake build runs this for the firmware. After changing the schema,
+regenerate the bridge codec with
+
+        python scripts/downlink_gen.py schema/downlink.json --python cloud/downlink_codec.py
+
+and check both against the golden vectors with scripts/downlink_vectors.py.
+"""
+import argparse
+import json
+
+INT_TYPES = {
+        "u8": ("uint8_t", 1),
+        "u16": ("uint16_t", 2),
+        "i16": ("int16_t", 2),
+        "u32": ("uint32_t", 4),
+}
+
+INT_FORMATS = {"u8": "B", "u16": "H", "i16": "h", "u32": "I"}
+
+HEADER = "Generated from schema/downlink.json by scripts/downlink_gen.py, do not edit"
+
+
+def item_size(field: dict) -> int:
+        return sum(INT_TYPES[i["type"]][1] for i in field["item"])
+
+
+def int_expr(src: str, offset: int, kind: str) -> str:
+        ctype, size = INT_TYPES[kind]
+        expr = " | ".join(f"((uint32_t){src}[{offset + b}] << {8 * (size - 1 - b)})" for b in range(size))
+        return f"({ctype})({expr})"
+
+
+def c_header(schema: dict) -> str:
+        msg = schema["message"]
+        upper = msg.upper()
+        out = [f"/* {HEADER} */",
+               f"#ifndef DOWNLINK_CODEC_H_",
+               f"#define DOWNLINK_CODEC_H_",
+               "",
+               "#include <stddef.h>",
+               "#include <stdint.h>",
+               "",
+               f"#define DOWNLINK_VERSION        {schema['version']}",
+               "#define DOWNLINK_HDR_SIZE       7",
+               "#define DOWNLINK_FLAG_DELTA     0x01",
+               ""]
+        for i, f in enumerate(schema["fields"]):
+                out.append(f"#define DOWNLINK_{upper}_{f['name'].upper():<12} (1u << {i})")
+        for f in schema["fields"]:
+                if f["type"] != "list":
+                        continue
+                out += ["", f"struct downlink_{msg}_{f['name']} {{"]
+                for item in f["item"]:
+                        unit = f"  /* {item['unit']} */" if "unit" in item else ""
+                        out.append(f"    {INT_TYPES[item['type']][0]} {item['name']};{unit}")
+                out.append("};")
+        out += ["", f"struct downlink_{msg} {{",
+                "    uint8_t flags;",
+                "    uint16_t msg_id;",
+                "    uint8_t seq;",
+                "    uint8_t base;",
+                "    uint16_t present;"]
+        for f in schema["fields"]:
+                if f["type"] == "str":
+                        out.append(f"    char {f['name']}[{f['max_len'] + 1}];")
+                elif f["type"] == "list":
+                        out.append(f"    uint8_t {f['name']}_count;")
+                        out.append(f"    struct downlink_{msg}_{f['name']} {f['name']}[{f['max_items']}];")
+                else:
+                        unit = f"  /* {f['unit']} */" if "unit" in f else ""
+                        out.append(f"    {INT_TYPES[f['type']][0]} {f['name']};{unit}")
+        out += ["};",
+                "",
+                "/* Returns -ENOTSUP for another schema version, -EINVAL if malformed */",
+                f"int downlink_{msg}_decode(const uint8_t *buf, size_t len, struct downlink_{msg} *msg);",
+                "",
+                "/* Copies the fields present in an update into a state */",
+                f"void downlink_{msg}_apply(struct downlink_{msg} *state, const struct downlink_{msg} *update);",
+                "",
+                "#endif",
+                ""]
+        return "\n".join(out)
+
+
+def c_source(schema: dict) -> str:
+        msg = schema["message"]
+        out = [f"/* {HEADER} */",
+               "#include <errno.h>",
+               "#include <string.h>",
+               "",
+               "#include <downlink_codec.h>",
+               "",
+               "",
+               f"int downlink_{msg}_decode(const uint8_t *buf, size_t len, struct downlink_{msg} *msg) {{",
+               "    size_t pos = DOWNLINK_HDR_SIZE;",
+               "",
+               "    if (len < DOWNLINK_HDR_SIZE) {",
+               "        return -EINVAL;",
+               "    }",
+               "    if ((buf[0] >> 4) != DOWNLINK_VERSION) {",
+               "        return -ENOTSUP;",
+               "    }",
+               "",
+               "    memset(msg, 0, sizeof(*msg));",
+               "    msg->flags = buf[0] & 0x0f;",
+               "    msg->msg_id = (buf[1] << 8) | buf[2];",
+               "    msg->seq = buf[3];",
+               "    msg->base = buf[4];",
+               "    uint16_t mask = (buf[5] << 8) | buf[6];",
+               "",
+               "    for (int i = 0; i < 16; i++) {",
+               "        if (!(mask & (1u << i))) {",
+               "            continue;",
+               "        }",
+               "        if (pos >= len || buf[pos] > len - pos - 1) {",
+               "            return -EINVAL;",
+               "        }",
+               "",
+               "        const uint8_t *val = &buf[pos + 1];",
+               "        size_t n = buf[pos];",
+               "        pos += 1 + n;",
+               "",
+               "        switch (i) {"]
+        for i, f in enumerate(schema["fields"]):
+                out.append(f"        case {i}:")
+                if f["type"] == "str":
+                        out += [f"            if (n >= sizeof(msg->{f['name']})) {{",
+                                "                return -EINVAL;",
+                                "            }",
+                                f"            memcpy(msg->{f['name']}, val, n);"]
+                elif f["type"] == "list":
+                        size = item_size(f)
+                        out += [f"            if (n % {size} != 0 || n / {size} > {f['max_items']}) {{",
+                                "                return -EINVAL;",
+                                "            }",
+                                f"            msg->{f['name']}_count = n / {size};",
+                                f"            for (size_t k = 0; k < msg->{f['name']}_count; k++) {{",
+                                f"                const uint8_t *item = &val[k * {size}];"]
+                        offset = 0
+                        for item in f["item"]:
+                                out.append(f"                msg->{f['name']}[k].{item['name']} = "
+                                           f"{int_expr('item', offset, item['type'])};")
+                                offset += INT_TYPES[item["type"]][1]
+                        out.append("            }")
+                else:
+                        ctype, size = INT_TYPES[f["type"]]
+                        out += [f"            if (n != {size}) {{",
+                                "                return -EINVAL;",
+                                "            }"]
+                        out.append(f"            msg->{f['name']} = {int_expr('val', 0, f['type'])};")
+                out += [f"            msg->present |= (1u << {i});",
+                        "            break;"]
+        out += ["        default:",
+                "            /* Field from a newer schema */",
+                "            break;",
+                "        }",
+                "    }",
+                "",
+                "    return 0;",
+                "}",
+                "",
+                "",
+                f"void downlink_{msg}_apply(struct downlink_{msg} *state, const struct downlink_{msg} *update) {{",
+                "    if (!(update->flags & DOWNLINK_FLAG_DELTA)) {",
+                "        *state = *update;",
+                "        return;",
+                "    }",
+                ""]
+        for i, f in enumerate(schema["fields"]):
+                out.append(f"    if (update->present & (1u << {i})) {{")
+                if f["type"] == "str":
+                        out.append(f"        memcpy(state->{f['name']}, update->{f['name']}, sizeof(state->{f['name']}));")
+                elif f["type"] == "list":
+                        out.append(f"        state->{f['name']}_count = update->{f['name']}_count;")
+                        out.append(f"        memcpy(state->{f['name']}, update->{f['name']}, sizeof(state->{f['name']}));")
+                else:
+                        out.append(f"        state->{f['name']} = update->{f['name']};")
+                out.append("    }")
+        out += ["    state->present |= update->present;",
+                "    state->seq = update->seq;",
+                "}",
+                ""]
+        return "\n".join(out)
+
+
+def python_module(schema: dict) -> str:
+        def size(f: dict) -> int:
+                if f["type"] == "list":
+                        return f["max_items"]
+                return f.get("max_len", INT_TYPES.get(f["type"], (0, 0))[1])
+
+        fields = ",\n".join(f"        ({f['name']!r}, {f['type']!r}, {size(f)})" for f in schema["fields"])
+        lists = ",\n".join(
+                f"        {f['name']!r}: (\">{''.join(INT_FORMATS[i['type']] for i in f['item'])}\", "
+                f"{[i['name'] for i in f['item']]!r})"
+                for f in schema["fields"] if f["type"] == "list")
+        return f'''"""{HEADER}"""
+import struct
+
+VERSION = {schema["version"]}
+HDR_SIZE = 7
+FLAG_DELTA = 0x01
+
+# (name, type, max length, size or items)
+FIELDS = [
+{fields},
+]
+
+# Record format and item names of lists
+LISTS = {{
+{lists},
+}}
+
+INT_FORMATS = {{"u8": ">B", "u16": ">H", "i16": ">h", "u32": ">I"}}
+
+
+def encode(msg_id: int, seq: int, base: int, fields: dict, delta: bool = False) -> bytes:
+        """Encodes the given fields, all of them unless delta is set."""
+        mask = 0
+        body = bytearray()
+        for i, (name, kind, size) in enumerate(FIELDS):
+                if name not in fields:
+                        continue
+                if kind == "str":
+                        value = str(fields[name]).encode("utf8")[:size]
+                        # Do not cut a multibyte character in half
+                        value = value.decode("utf8", "ignore").encode("utf8")
+                elif kind == "list":
+                        fmt, keys = LISTS[name]
+                        value = b"".join(struct.pack(fmt, *(item[k] for k in keys)) for item in fields[name][:size])
+                else:
+                        value = struct.pack(INT_FORMATS[kind], fields[name])
+                mask |= 1 << i
+                body.append(len(value))
+                body.extend(value)
+        flags = FLAG_DELTA if delta else 0
+        return struct.pack(">BHBBH", VERSION << 4 | flags, msg_id, seq, base, mask) + bytes(body)
+
+
+def decode(data: bytes) -> dict:
+        head, msg_id, seq, base, mask = struct.unpack(">BHBBH", data[:HDR_SIZE])
+        if head >> 4 != VERSION:
+                raise ValueError(f"schema version {{head >> 4}}")
+        fields = {{}}
+        pos = HDR_SIZE
+        for i in range(16):
+                if not mask & (1 << i):
+                        continue
+                n = data[pos]
+                value = data[pos + 1:pos + 1 + n]
+                if len(value) != n:
+                        raise ValueError("truncated")
+                pos += 1 + n
+                if i >= len(FIELDS):
+                        continue
+                name, kind, _ = FIELDS[i]
+                if kind == "str":
+                        fields[name] = value.decode("utf8")
+                elif kind == "list":
+                        fmt, keys = LISTS[name]
+                        step = struct.calcsize(fmt)
+                        fields[name] = [dict(zip(keys, struct.unpack_from(fmt, value, k))) for k in range(0, n, step)]
+                else:
+                        fields[name] = struct.unpack(INT_FORMATS[kind], value)[0]
+        return {{"msg_id": msg_id, "seq": seq, "base": base, "delta": bool(head & FLAG_DELTA), "fields": fields}}
+'''
+
+
+def main() -> None:
+        parser = argparse.ArgumentParser(description="Generate the downlink codec")
+        parser.add_argument("schema")
+        parser.add_argument("--c-header")
+        parser.add_argument("--c-source")
+        parser.add_argument("--python")
+        args = parser.parse_args()
+
+        schema = json.load(open(args.schema))
+        if len(schema["fields"]) > 16:
+                raise SystemExit("at most 16 fields fit the mask")
+
+        for path, gen in ((args.c_header, c_header), (args.c_source, c_source), (args.python, python_module)):
+                if path:
+                        with open(path, "w") as f:
+                                f.write(gen(schema))
+
+
+if __name__ == "__main__":
+        main()
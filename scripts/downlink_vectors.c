@@ -0,0 +1,82 @@
+/* Decodes a downlink with the generated C codec and prints it as JSON in
+   the shape of cloud/downlink_codec.py's decode(), or {"error": ...}.
+   Built with the host compiler by scripts/downlink_vectors.py. */
+#include <errno.h>
+#include <stdio.h>
+
+#include <downlink_codec.h>
+
+
+static void print_str(const char *name, const char *s, int *first) {
+    printf("%s\"%s\": \"", *first ? "" : ", ", name);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            putchar('\\');
+        }
+        putchar(*s);
+    }
+    putchar('"');
+    *first = 0;
+}
+
+
+int main(int argc, char **argv) {
+    static uint8_t buf[256];
+    struct downlink_weather msg;
+
+    FILE *f = argc > 1 ? fopen(argv[1], "rb") : NULL;
+    if (f == NULL) {
+        fprintf(stderr, "usage: %s vector.bin\n", argv[0]);
+        return 2;
+    }
+    size_t len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    int err = downlink_weather_decode(buf, len, &msg);
+    if (err) {
+        printf("{\"error\": \"%s\"}\n", err == -ENOTSUP ? "ENOTSUP" : "EINVAL");
+        return 0;
+    }
+
+    printf("{\"msg_id\": %u, \"seq\": %u, \"base\": %u, \"delta\": %s, \"fields\": {",
+        msg.msg_id, msg.seq, msg.base, (msg.flags & DOWNLINK_FLAG_DELTA) ? "true" : "false");
+
+    int first = 1;
+    if (msg.present & DOWNLINK_WEATHER_STATUS) {
+        print_str("status", msg.status, &first);
+    }
+    if (msg.present & DOWNLINK_WEATHER_ICON) {
+        print_str("icon", msg.icon, &first);
+    }
+    if (msg.present & DOWNLINK_WEATHER_TEMPERATURE) {
+        printf("%s\"temperature\": %d", first ? "" : ", ", msg.temperature);
+        first = 0;
+    }
+    if (msg.present & DOWNLINK_WEATHER_LOCATION) {
+        print_str("location", msg.location, &first);
+    }
+    if (msg.present & DOWNLINK_WEATHER_CONDITION) {
+        printf("%s\"condition\": %u", first ? "" : ", ", msg.condition);
+        first = 0;
+    }
+    if (msg.present & DOWNLINK_WEATHER_HOURS) {
+        printf("%s\"hours\": [", first ? "" : ", ");
+        for (int i = 0; i < msg.hours_count; i++) {
+            printf("%s{\"hour\": %u, \"night\": %u, \"condition\": %u, \"temperature\": %d}", i ? ", " : "",
+                msg.hours[i].hour, msg.hours[i].night, msg.hours[i].condition, msg.hours[i].temperature);
+        }
+        printf("]");
+        first = 0;
+    }
+    if (msg.present & DOWNLINK_WEATHER_DAYS) {
+        printf("%s\"days\": [", first ? "" : ", ");
+        for (int i = 0; i < msg.days_count; i++) {
+            printf("%s{\"weekday\": %u, \"condition\": %u, \"temp_min\": %d, \"temp_max\": %d}", i ? ", " : "",
+                msg.days[i].weekday, msg.days[i].condition, msg.days[i].temp_min, msg.days[i].temp_max);
+        }
+        printf("]");
+    }
+    printf("}}\n");
+
+    return 0;
+}
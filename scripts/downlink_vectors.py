@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Checks both downlink decoders against the golden vectors.
+
+Each schema/vectors/NAME.bin is a downlink as sent, and NAME.json what it
+decodes to, in the shape of cloud/downlink_codec.py's decode(), or
+{"error": "EINVAL"} / {"error": "ENOTSUP"} if it must be rejected. The
+bridge codec and the C decoder generated for the firmware, built with
+the host compiler, must both give exactly that. Vectors the bridge could
+have sent must also come out of its encoder byte for byte.
+
+        python scripts/downlink_vectors.py [--cc gcc]
+
+Exits non-zero if any vector fails.
+"""
+import argparse
+import glob
+import json
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+sys.path.insert(0, os.path.join(ROOT, "cloud"))
+import downlink_codec  # noqa: E402
+
+
+def python_decode(data: bytes) -> dict:
+        try:
+                return downlink_codec.decode(data)
+        except ValueError as e:
+                return {"error": "ENOTSUP" if "version" in str(e) else "EINVAL"}
+        except (IndexError, struct.error):
+                return {"error": "EINVAL"}
+
+
+def build_c(tmp: str, cc: str) -> str:
+        subprocess.run([sys.executable, os.path.join(ROOT, "scripts", "downlink_gen.py"),
+                        os.path.join(ROOT, "schema", "downlink.json"),
+                        "--c-header", os.path.join(tmp, "downlink_codec.h"),
+                        "--c-source", os.path.join(tmp, "downlink_codec.c")], check=True)
+        exe = os.path.join(tmp, "downlink_vectors")
+        subprocess.run([cc, "-Wall", "-Werror", "-I", tmp, "-o", exe, os.path.join(tmp, "downlink_codec.c"),
+                        os.path.join(ROOT, "scripts", "downlink_vectors.c")], check=True)
+        return exe
+
+
+def main() -> None:
+        parser = argparse.ArgumentParser(description="Check the downlink decoders against the golden vectors")
+        parser.add_argument("--cc", default=os.environ.get("CC", "gcc"))
+        args = parser.parse_args()
+
+        failed = 0
+        with tempfile.TemporaryDirectory() as tmp:
+                exe = build_c(tmp, args.cc)
+
+                for path in sorted(glob.glob(os.path.join(ROOT, "schema", "vectors", "*.bin"))):
+                        name = os.path.basename(path)[:-4]
+                        data = open(path, "rb").read()
+                        expected = json.load(open(path[:-4] + ".json"))
+
+                        results = {
+                                "python": python_decode(data),
+                                "c": json.loads(subprocess.run([exe, path], check=True, capture_output=True,
+                                                               text=True).stdout),
+                        }
+                        if "error" not in expected and expected.get("round_trip", True):
+                                m = expected
+                                results["encode"] = data if downlink_codec.encode(
+                                        m["msg_id"], m["seq"], m["base"], m["fields"], m["delta"]) == data else None
+
+                        bad = []
+                        for side, got in results.items():
+                                if side == "encode":
+                                        ok = got is not None
+                                else:
+                                        ok = got == {k: v for k, v in expected.items() if k != "round_trip"}
+                                if not ok:
+                                        bad.append(side)
+                                        print(f"FAIL {name} ({len(data)} B) {side}: {got}")
+                        failed += bool(bad)
+                        if not bad:
+                                print(f"ok   {name} ({len(data)} B) {', '.join(results)}")
+
+        sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+        main()
@@ -0,0 +1,353 @@
+#!/usr/bin/env python3
+"""Generates the run-length encoded weather icon atlas.
+
+Reads fonts/weather_icons.json and writes a C header and source with
+
+        - every icon rasterized from its parts and run-length encoded
+        - a table from OpenWeatherMap condition codes to icons
+        - a table from OpenWeatherMap icon names ("10d") to icons
+        - the night variant of every icon
+
+Icons are drawn from circles, thick lines, boxes and polygons on a square
+canvas, in order, so later parts cover earlier ones. An outlined part is
+stroked around its shape and clears its inside and a gap around it. A
+shape may subtract circles, which is how the moon gets its crescent.
+
+Pixels are stored row by row from the top left as alternating runs of
+white and black, starting with white. A run of up to 14 pixels takes
+one nibble, high nibble first. Longer runs are the nibble 15 followed by
+a byte holding the length less 15, and runs longer than 270 continue
+after a zero length run of the other color. The white run at the end is
+left out.
+
+        python scripts/glyph_atlas_gen.py fonts/weather_icons.json --preview
+
+prints every icon as text, and the sizes against uncompressed bitmaps.
+"""
+import argparse
+import json
+
+HEADER = "Generated from fonts/weather_icons.json by scripts/glyph_atlas_gen.py, do not edit"
+SUPERSAMPLE = 4
+NONE = 0xff
+ESCAPE = 0xf
+LONG_RUN = ESCAPE + 0xff
+
+
+def inside_shape(shape: dict, x: float, y: float, grow: float) -> bool:
+        if "circle" in shape:
+                cx, cy, r = shape["circle"]
+                return (x - cx) ** 2 + (y - cy) ** 2 <= (r + grow) ** 2
+        if "line" in shape:
+                x1, y1, x2, y2, r = shape["line"]
+                dx, dy = x2 - x1, y2 - y1
+                t = ((x - x1) * dx + (y - y1) * dy) / (dx * dx + dy * dy or 1)
+                t = max(0.0, min(1.0, t))
+                return (x - x1 - t * dx) ** 2 + (y - y1 - t * dy) ** 2 <= (r + grow) ** 2
+        if "box" in shape:
+                x1, y1, x2, y2 = shape["box"]
+                return x1 - grow <= x <= x2 + grow and y1 - grow <= y <= y2 + grow
+        if "poly" in shape:
+                # Even-odd rule, polygons do not grow
+                points = shape["poly"]
+                hit = False
+                for (x1, y1), (x2, y2) in zip(points, points[1:] + points[:1]):
+                        if (y1 > y) != (y2 > y) and x < x1 + (y - y1) * (x2 - x1) / (y2 - y1):
+                                hit = not hit
+                return hit
+        raise SystemExit(f"unknown shape {shape}")
+
+
+def inside(part: dict, x: float, y: float, grow: float = 0.0) -> bool:
+        if any(inside_shape(c, x, y, -grow) for c in part.get("minus", [])):
+                return False
+        return any(inside_shape(s, x, y, grow) for s in part["shapes"])
+
+
+def expand(part: dict, parts: dict) -> list:
+        """Resolves a part name, with an offset, into its shapes."""
+        if isinstance(part, str):
+                part = {"use": part}
+        base = dict(parts[part["use"]])
+        dx, dy = part.get("at", (0, 0))
+        scale = part.get("scale", 1.0)
+
+        def move(shape: dict) -> dict:
+                kind, v = next(iter(shape.items()))
+                if kind == "circle":
+                        return {kind: [v[0] * scale + dx, v[1] * scale + dy, v[2] * scale]}
+                if kind == "line":
+                        return {kind: [v[0] * scale + dx, v[1] * scale + dy,
+                                       v[2] * scale + dx, v[3] * scale + dy, v[4] * scale]}
+                if kind == "box":
+                        return {kind: [v[0] * scale + dx, v[1] * scale + dy,
+                                       v[2] * scale + dx, v[3] * scale + dy]}
+                return {kind: [[px * scale + dx, py * scale + dy] for px, py in v]}
+
+        base["shapes"] = [move(s) for s in base["shapes"]]
+        base["minus"] = [move(s) for s in base.get("minus", [])]
+        return base
+
+
+def rasterize(size: int, parts: list, stroke: float, gap: float) -> list:
+        pixels = [[False] * size for _ in range(size)]
+        for y in range(size):
+                for x in range(size):
+                        ink = 0
+                        for sy in range(SUPERSAMPLE):
+                                for sx in range(SUPERSAMPLE):
+                                        px = x + (sx + 0.5) / SUPERSAMPLE
+                                        py = y + (sy + 0.5) / SUPERSAMPLE
+                                        ink += paint(parts, px, py, stroke, gap)
+                        pixels[y][x] = ink * 2 >= SUPERSAMPLE * SUPERSAMPLE
+        return pixels
+
+
+def paint(parts: list, x: float, y: float, stroke: float, gap: float) -> bool:
+        """Color of a point after drawing all parts in order."""
+        black = False
+        for part in parts:
+                width = part.get("stroke", stroke)
+                if part.get("style", "fill") == "fill":
+                        if inside(part, x, y):
+                                black = True
+                        elif inside(part, x, y, part.get("gap", 0.0)):
+                                black = False
+                        continue
+                if inside(part, x, y):
+                        black = False
+                elif inside(part, x, y, width):
+                        black = True
+                elif inside(part, x, y, width + part.get("gap", gap)):
+                        black = False
+        return black
+
+
+def encode(pixels: list) -> bytes:
+        runs = []
+        color, length = False, 0
+        for row in pixels:
+                for p in row:
+                        if p != color:
+                                runs.append(length)
+                                color, length = p, 0
+                        length += 1
+        if color:
+                runs.append(length)
+
+        nibbles = []
+        for n in runs:
+                while n > LONG_RUN:
+                        nibbles += [ESCAPE, 0xf, 0xf, 0]
+                        n -= LONG_RUN
+                if n < ESCAPE:
+                        nibbles.append(n)
+                else:
+                        nibbles += [ESCAPE, (n - ESCAPE) >> 4, (n - ESCAPE) & 0xf]
+        if len(nibbles) % 2:
+                nibbles.append(0)
+        return bytes(hi << 4 | lo for hi, lo in zip(nibbles[::2], nibbles[1::2]))
+
+
+def decode(data: bytes, size: int) -> list:
+        nibbles = [n for b in data for n in (b >> 4, b & 0xf)]
+        flat = []
+        color = False
+        i = 0
+        while i < len(nibbles):
+                n = nibbles[i]
+                i += 1
+                if n == ESCAPE:
+                        n = ESCAPE + (nibbles[i] << 4 | nibbles[i + 1])
+                        i += 2
+                flat += [color] * n
+                color = not color
+        flat = flat[:size * size] + [False] * (size * size - len(flat))
+        return [flat[y * size:(y + 1) * size] for y in range(size)]
+
+
+def build(spec: dict) -> dict:
+        size = spec["size"]
+        names = list(spec["icons"])
+        index = {name: i for i, name in enumerate(names)}
+        if len(names) >= NONE:
+                raise SystemExit("too many icons")
+
+        data = bytearray()
+        icons = []
+        for name in names:
+                icon = spec["icons"][name]
+                parts = [expand(p, spec["parts"]) for p in icon["parts"]]
+                pixels = rasterize(size, parts, spec["stroke"], spec["gap"])
+                rle = encode(pixels)
+                assert decode(rle, size) == pixels
+                icons.append({"name": name, "offset": len(data), "size": len(rle), "pixels": pixels})
+                data += rle
+
+        night = [index[spec["icons"][n].get("night", n)] for n in names]
+
+        # Conditions by hundreds, each hundred only as long as its
+        # highest code needs
+        groups = []
+        table = []
+        for group in range(2, 9):
+                codes = {int(c) % 100: index[n] for c, n in spec["conditions"].items() if int(c) // 100 == group}
+                count = max(codes) + 1 if codes else 0
+                groups.append((len(table), count))
+                table += [codes.get(i, NONE) for i in range(count)]
+        if len(table) > 0xffff:
+                raise SystemExit("condition table too large")
+
+        by_name = [NONE] * 51
+        for n, icon in spec["names"].items():
+                by_name[int(n)] = index[icon]
+
+        return {"size": size, "names": names, "icons": icons, "data": bytes(data), "night": night,
+                "groups": groups, "table": table, "by_name": by_name}
+
+
+def footprint(atlas: dict) -> dict:
+        bitmap = (atlas["size"] * atlas["size"] + 7) // 8 * len(atlas["names"])
+        tables = (len(atlas["icons"]) * 4 + len(atlas["night"]) + len(atlas["groups"]) * 3
+                  + len(atlas["table"]) + len(atlas["by_name"]))
+        return {"rle": len(atlas["data"]), "bitmap": bitmap, "tables": tables}
+
+
+def c_array(values, per_line: int = 16) -> list:
+        values = list(values)
+        return ["    " + ", ".join(f"0x{v:02x}" for v in values[i:i + per_line]) + ","
+                for i in range(0, len(values), per_line)]
+
+
+def c_header(atlas: dict) -> str:
+        fp = footprint(atlas)
+        out = [f"/* {HEADER} */",
+               "#ifndef WEATHER_ICONS_H_",
+               "#define WEATHER_ICONS_H_",
+               "",
+               "#include <stdbool.h>",
+               "#include <stdint.h>",
+               "",
+               f"/* {len(atlas['names'])} icons in {fp['rle']} bytes of runs and {fp['tables']} bytes of tables,",
+               f"   against {fp['bitmap']} bytes as plain bitmaps */",
+               "",
+               f"#define WEATHER_ICON_SIZE   {atlas['size']}",
+               f"#define WEATHER_ICON_COUNT  {len(atlas['names'])}",
+               "",
+               "enum weather_icon {"]
+        out += [f"    WEATHER_ICON_{name.upper()}," for name in atlas["names"]]
+        out += ["};",
+                "",
+                "struct weather_icon_runs {",
+                "    uint16_t offset;",
+                "    uint16_t size;",
+                "};",
+                "",
+                "/* Nibble coded white and black runs, see scripts/glyph_atlas_gen.py */",
+                "extern const uint8_t weather_icon_data[];",
+                "extern const struct weather_icon_runs weather_icon_runs[WEATHER_ICON_COUNT];",
+                "",
+                "/* Icon for an OpenWeatherMap condition code, -1 if unknown */",
+                "int weather_icon_for_condition(uint16_t code, bool night);",
+                "",
+                "/* Icon for an OpenWeatherMap icon name like \"10d\", -1 if unknown */",
+                "int weather_icon_for_name(const char *name);",
+                "",
+                "#endif",
+                ""]
+        return "\n".join(out)
+
+
+def c_source(atlas: dict) -> str:
+        out = [f"/* {HEADER} */",
+               "#include <weather_icons.h>",
+               "",
+               "#define NONE 0xff",
+               "",
+               "const uint8_t weather_icon_data[] = {"]
+        for icon in atlas["icons"]:
+                out.append(f"    /* {icon['name']} */")
+                out += c_array(atlas["data"][icon["offset"]:icon["offset"] + icon["size"]])
+        out += ["};", "", "const struct weather_icon_runs weather_icon_runs[WEATHER_ICON_COUNT] = {"]
+        out += [f"    {{ {icon['offset']}, {icon['size']} }}," for icon in atlas["icons"]]
+        out += ["};", "", "static const uint8_t night_icon[WEATHER_ICON_COUNT] = {"]
+        out += c_array(atlas["night"])
+        out += ["};", "", "/* Start in the table and number of codes, for codes 200 to 899 */",
+                "static const struct {",
+                "    uint16_t first;",
+                "    uint8_t count;",
+                "} condition_group[] = {"]
+        out += [f"    {{ {first}, {count} }}," for first, count in atlas["groups"]]
+        out += ["};", "", "static const uint8_t condition_icon[] = {"]
+        out += c_array(atlas["table"])
+        out += ["};", "", "/* By the number in icon names, 01 to 50 */",
+                "static const uint8_t name_icon[] = {"]
+        out += c_array(atlas["by_name"])
+        out += ["};",
+                "",
+                "",
+                "int weather_icon_for_condition(uint16_t code, bool night) {",
+                "    unsigned int group = code / 100 - 2;",
+                "    unsigned int index = code % 100;",
+                "",
+                "    if (code < 200 || group >= sizeof(condition_group) / sizeof(condition_group[0]) ||",
+                "        index >= condition_group[group].count) {",
+                "        return -1;",
+                "    }",
+                "",
+                "    uint8_t icon = condition_icon[condition_group[group].first + index];",
+                "    if (icon == NONE) {",
+                "        return -1;",
+                "    }",
+                "",
+                "    return night ? night_icon[icon] : icon;",
+                "}",
+                "",
+                "",
+                "int weather_icon_for_name(const char *name) {",
+                "    if (name[0] < '0' || name[0] > '9' || name[1] < '0' || name[1] > '9') {",
+                "        return -1;",
+                "    }",
+                "",
+                "    unsigned int number = (name[0] - '0') * 10 + (name[1] - '0');",
+                "    if (number >= sizeof(name_icon) || name_icon[number] == NONE) {",
+                "        return -1;",
+                "    }",
+                "",
+                "    return name[2] == 'n' ? night_icon[name_icon[number]] : name_icon[number];",
+                "}",
+                ""]
+        return "\n".join(out)
+
+
+def preview(atlas: dict) -> None:
+        for icon in atlas["icons"]:
+                print(f"{icon['name']}: {icon['size']} bytes")
+                for row in icon["pixels"]:
+                        print("".join("#" if p else "." for p in row))
+                print()
+        fp = footprint(atlas)
+        print(f"{len(atlas['names'])} icons: {fp['rle']} bytes of runs + {fp['tables']} bytes of tables, "
+              f"{fp['bitmap']} bytes as bitmaps ({fp['rle'] / fp['bitmap']:.0%})")
+
+
+def main() -> None:
+        parser = argparse.ArgumentParser(description="Generate the weather icon atlas")
+        parser.add_argument("spec")
+        parser.add_argument("--c-header")
+        parser.add_argument("--c-source")
+        parser.add_argument("--preview", action="store_true")
+        args = parser.parse_args()
+
+        atlas = build(json.load(open(args.spec)))
+
+        for path, gen in ((args.c_header, c_header), (args.c_source, c_source)):
+                if path:
+                        with open(path, "w") as f:
+                                f.write(gen(atlas))
+        if args.preview:
+                preview(atlas)
+
+
+if __name__ == "__main__":
+        main()
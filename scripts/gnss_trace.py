@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+"""Captures and reads GNSS traces, see include/gnss_trace.h for the format.
+
+        pip install pyserial
+        python scripts/gnss_trace.py capture /dev/ttyACM1 traces/session.gtrc
+        python scripts/gnss_trace.py info traces/session.gtrc
+        python scripts/gnss_trace.py nmea traces/session.gtrc > session.nmea
+
+A trace recorded to flash is read with the debugger as a raw dump of the
+gnss_trace partition (0xec000, 72 kB, see pm_static.yml), erased tail
+included:
+
+        JLinkExe -device nRF9160_xxAA -if SWD -speed 4000 -autoconnect 1
+        J-Link> savebin traces/session.gtrc, 0xec000, 0x12000
+
+Erasing the page at 0xec000 is enough to record again. Replaying a file
+needs CONFIG_GNSS_TRACE_REPLAY_FILE pointing at it.
+"""
+import argparse
+import statistics
+import struct
+import sys
+
+MAGIC = 0x43525447
+VERSION = 1
+HDR = struct.Struct("<IB")
+REC = struct.Struct("<BHI")
+PAD = 0xFF
+
+START, STOP, PVT, NMEA = 1, 2, 3, 4
+
+PVT_FIXED = struct.Struct("<BiihHHHHBBBBBHHHB")
+PVT_SV = struct.Struct("<BBHbhB")
+FLAG_FIX_VALID = 0x01
+
+
+def records(data: bytes):
+        """Yields (type, time_ms, payload) for every record."""
+        magic, version = HDR.unpack_from(data)
+        if magic != MAGIC:
+                raise SystemExit("not a GNSS trace")
+        if version != VERSION:
+                raise SystemExit(f"trace version {version}, expected {VERSION}")
+
+        pos = HDR.size
+        while pos < len(data):
+                if data[pos] == PAD:
+                        pos += 1
+                        continue
+                if pos + REC.size > len(data):
+                        break
+                kind, length, time_ms = REC.unpack_from(data, pos)
+                pos += REC.size
+                payload = data[pos:pos + length]
+                if len(payload) != length:
+                        break
+                pos += length
+                yield kind, time_ms, payload
+
+
+def decode_pvt(payload: bytes) -> dict:
+        (flags, lat, lon, alt, acc, speed, heading, year, month, day, hour, minute,
+         seconds, ms, pdop, hdop, count) = PVT_FIXED.unpack_from(payload)
+        svs = [PVT_SV.unpack_from(payload, PVT_FIXED.size + i * PVT_SV.size) for i in range(count)]
+        return {
+                "fix": bool(flags & FLAG_FIX_VALID),
+                "lat": lat / 1e7,
+                "lon": lon / 1e7,
+                "alt": alt,
+                "accuracy": acc / 100,
+                "speed": speed / 100,
+                "time": f"{year:04}-{month:02}-{day:02}T{hour:02}:{minute:02}:{seconds:02}.{ms:03}Z",
+                "cn0": [sv[2] / 10 for sv in svs],
+        }
+
+
+def sessions(data: bytes) -> list:
+        """Groups records by receiver start."""
+        out = []
+        current = None
+        for kind, time_ms, payload in records(data):
+                if kind == START:
+                        current = {"start": time_ms, "end": time_ms, "pvt": [], "nmea": 0}
+                        out.append(current)
+                elif current is None:
+                        continue
+                elif kind == STOP:
+                        current["end"] = time_ms
+                        current = None
+                elif kind == PVT:
+                        current["pvt"].append((time_ms, decode_pvt(payload)))
+                        current["end"] = time_ms
+                elif kind == NMEA:
+                        current["nmea"] += 1
+        return out
+
+
+def info(args) -> None:
+        data = open(args.trace, "rb").read()
+        ttffs = []
+        for i, s in enumerate(sessions(data)):
+                fixes = [(t, p) for t, p in s["pvt"] if p["fix"]]
+                cn0 = [c for _, p in s["pvt"] for c in p["cn0"]]
+                line = f"session {i}: at {s['start'] / 1000:.1f} s, {len(s['pvt'])} pvt, {s['nmea']} nmea"
+                if fixes:
+                        t, p = fixes[0]
+                        ttffs.append(t - s["start"])
+                        line += (f", fix after {(t - s['start']) / 1000:.1f} s"
+                                 f" at {p['lat']:.6f},{p['lon']:.6f} +-{p['accuracy']:.0f} m")
+                else:
+                        line += f", no fix in {(s['end'] - s['start']) / 1000:.1f} s"
+                if cn0:
+                        line += f", C/N0 mean {statistics.mean(cn0):.1f} max {max(cn0):.1f} dB-Hz"
+                print(line)
+        if ttffs:
+                print(f"TTFF median {statistics.median(ttffs) / 1000:.1f} s, "
+                      f"max {max(ttffs) / 1000:.1f} s over {len(ttffs)} fixes")
+
+
+def nmea(args) -> None:
+        data = open(args.trace, "rb").read()
+        for kind, _, payload in records(data):
+                if kind == NMEA:
+                        sys.stdout.write(payload.decode("ascii", "replace") + "\r\n")
+
+
+def capture(args) -> None:
+        import serial
+
+        port = serial.Serial(args.port, args.baud)
+        head = HDR.pack(MAGIC, VERSION)
+        window = b""
+        # The recorder writes the header once at boot, so reset the
+        # device after starting the capture
+        print("waiting for trace header, reset the device", file=sys.stderr)
+        while not window.endswith(head):
+                window = (window + port.read(1))[-len(head):]
+
+        size = 0
+        with open(args.trace, "wb") as out:
+                out.write(head)
+                try:
+                        while True:
+                                chunk = port.read(max(1, port.in_waiting))
+                                out.write(chunk)
+                                out.flush()
+                                size += len(chunk)
+                except KeyboardInterrupt:
+                        pass
+        print(f"{size} bytes", file=sys.stderr)
+
+
+def main() -> None:
+        parser = argparse.ArgumentParser(description="GNSS trace tool")
+        sub = parser.add_subparsers(dest="command", required=True)
+
+        p = sub.add_parser("capture", help="record a trace streamed over UART")
+        p.add_argument("port")
+        p.add_argument("trace")
+        p.add_argument("--baud", type=int, default=115200)
+        p.set_defaults(func=capture)
+
+        p = sub.add_parser("info", help="sessions, time to fix and signal levels")
+        p.add_argument("trace")
+        p.set_defaults(func=info)
+
+        p = sub.add_parser("nmea", help="print the recorded NMEA sentences")
+        p.add_argument("trace")
+        p.set_defaults(func=nmea)
+
+        args = parser.parse_args()
+        args.func(args)
+
+
+if __name__ == "__main__":
+        main()
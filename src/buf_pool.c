@@ -0,0 +1,62 @@
+#include <zephyr.h>
+
+#include "buf_pool.h"
+
+
+K_MEM_SLAB_DEFINE(buf_slab, ROUND_UP(CONFIG_BUF_POOL_BLOCK_SIZE, 4), CONFIG_BUF_POOL_BLOCKS, 4);
+
+static struct k_spinlock lock;
+static struct buf_pool_stats stats;
+
+
+void *buf_pool_alloc(size_t len, k_timeout_t timeout) {
+    void *buf = NULL;
+
+    if (len <= CONFIG_BUF_POOL_BLOCK_SIZE && k_mem_slab_alloc(&buf_slab, &buf, timeout) != 0) {
+        buf = NULL;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (buf) {
+        stats.allocs++;
+        stats.max_used = MAX(stats.max_used, k_mem_slab_num_used_get(&buf_slab));
+        stats.hist[len * BUF_POOL_HIST_BUCKETS / (CONFIG_BUF_POOL_BLOCK_SIZE + 1)]++;
+    } else {
+        stats.failures++;
+    }
+    stats.max_request = MAX(stats.max_request, len);
+    k_spin_unlock(&lock, key);
+
+    return buf;
+}
+
+
+void buf_pool_free(void *buf) {
+    if (buf) {
+        k_mem_slab_free(&buf_slab, &buf);
+    }
+}
+
+
+void buf_pool_stats_get(struct buf_pool_stats *out) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    *out = stats;
+    k_spin_unlock(&lock, key);
+}
+
+
+void buf_pool_print_stats() {
+    struct buf_pool_stats s;
+    buf_pool_stats_get(&s);
+
+    printk("Buffer pool: %u x %u bytes, %u allocs, %u failures, "
+           "max %u in use, largest request %u bytes\n",
+        CONFIG_BUF_POOL_BLOCKS, CONFIG_BUF_POOL_BLOCK_SIZE, s.allocs, s.failures,
+        s.max_used, s.max_request);
+
+    printk("  fill %%:");
+    for (int i = 0; i < BUF_POOL_HIST_BUCKETS; i++) {
+        printk(" <=%u: %u", (i + 1) * 100 / BUF_POOL_HIST_BUCKETS, s.hist[i]);
+    }
+    printk("\n");
+}
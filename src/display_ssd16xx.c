@@ -5,17 +5,33 @@
 #include <stdio.h>
 #include <string.h>
 
-#include "cfb_font_weather.h"
+#include "weather_icons.h"
+#include "display_ssd16xx.h"
+#include "events.h"
+#include "power_mgmt.h"
 
 
 #if DT_NODE_HAS_STATUS(DT_INST(0, solomon_ssd16xxfb), okay)
 #define DISPLAY_DEV_NAME DT_LABEL(DT_INST(0, solomon_ssd16xxfb))
+#elif defined(CONFIG_MOCK_DISPLAY)
+#include "mock.h"
+#define DISPLAY_DEV_NAME MOCK_DISPLAY_NAME
 #endif
 
+/* Built-in cfb fonts by height */
+#define FONT_SMALL_HEIGHT 16
+#define FONT_LARGE_HEIGHT 24
+
+/* Nibble that starts a long run in the icon data */
+#define RUN_ESCAPE 0xf
+
 static const struct device *dev;
+static uint8_t font_small;
+static uint8_t font_large;
+static bool msb_first;
 
 
-void display_init() {
+static void display_setup() {
 
     uint8_t font_width, font_height;
 
@@ -44,11 +60,21 @@ void display_init() {
             break;
         }
         printk("font width %d, font height %d\n", font_width, font_height);
+
+        if (font_height == FONT_SMALL_HEIGHT) {
+            font_small = i;
+        } else if (font_height == FONT_LARGE_HEIGHT) {
+            font_large = i;
+        }
     }
 
+    struct display_capabilities caps;
+    display_get_capabilities(dev, &caps);
+    msb_first = caps.screen_info & SCREEN_INFO_MONO_MSB_FIRST;
+
     cfb_framebuffer_clear(dev, false);
 
-    err = cfb_framebuffer_set_font(dev, 1);
+    err = cfb_framebuffer_set_font(dev, font_small);
     if (err) {
         printk("Could not set font, err %d\n", err);
     }
@@ -64,144 +90,290 @@ void display_init() {
 }
 
 
+void display_init() {
+    /* The bus would suspend during the wait for the panel otherwise */
+    power_mgmt_get(POWER_DISPLAY);
+    display_setup();
+    power_mgmt_put(POWER_DISPLAY);
+}
 
-void display_print_placeholder() {
 
-    int err;
 
-    cfb_framebuffer_clear(dev, false);
+static uint8_t icon_nibble(const uint8_t *data, size_t i) {
+    return i % 2 ? data[i / 2] & 0x0f : data[i / 2] >> 4;
+}
 
-    err = cfb_framebuffer_set_font(dev, 2);
-    if (err) {
-        printk("Could not set font, err %d\n", err);
-    }
 
-    err = cfb_print(dev, "Press button", 35, 8);
-    if (err) {
-        printk("Could not display string, err %d\n", err);
+static void draw_icon(int icon, uint16_t x, uint16_t y) {
+    /* Decompressed straight into the panel's vertically tiled format,
+       eight rows at a time. y must be a multiple of eight. */
+    const uint8_t *data = &weather_icon_data[weather_icon_runs[icon].offset];
+    size_t nibbles = weather_icon_runs[icon].size * 2;
+    size_t next = 0;
+    uint16_t run = 0;
+    bool black = true;
+    uint8_t band[WEATHER_ICON_SIZE];
+
+    struct display_buffer_descriptor desc = {
+        .buf_size = sizeof(band),
+        .width = WEATHER_ICON_SIZE,
+        .height = 8,
+        .pitch = WEATHER_ICON_SIZE,
+    };
+
+    for (int row = 0; row < WEATHER_ICON_SIZE; row++) {
+        uint8_t bit = msb_first ? BIT(7 - row % 8) : BIT(row % 8);
+
+        if (row % 8 == 0) {
+            /* cfb_framebuffer_finalize() inverts MONO10 frames, so ink
+               is a cleared bit here too */
+            memset(band, 0xff, sizeof(band));
+        }
+
+        for (int col = 0; col < WEATHER_ICON_SIZE; col++) {
+            while (run == 0 && next < nibbles) {
+                run = icon_nibble(data, next++);
+                if (run == RUN_ESCAPE && next + 2 <= nibbles) {
+                    run += icon_nibble(data, next) << 4 | icon_nibble(data, next + 1);
+                    next += 2;
+                }
+                black = !black;
+            }
+
+            if (run == 0) {
+                /* The white run at the end is left out */
+                black = false;
+            } else {
+                run--;
+            }
+
+            if (black) {
+                band[col] &= ~bit;
+            }
+        }
+
+        if (row % 8 == 7) {
+            int err = display_write(dev, x, y + row - 7, &desc, band);
+            if (err) {
+                printk("Could not draw icon, err %d\n", err);
+                return;
+            }
+        }
     }
+}
+
+
+static void frame_begin() {
+    /* Everything written until frame_end() is shown in one refresh, the
+       bus suspends again once the display has been idle for a while */
+    power_mgmt_get(POWER_DISPLAY);
+    display_blanking_on(dev);
+    cfb_framebuffer_clear(dev, false);
+}
+
+
+static void frame_end() {
+    display_blanking_off(dev);
+    power_mgmt_put(POWER_DISPLAY);
+}
+
 
-    err = cfb_framebuffer_set_font(dev, 1);
+static void print_text(uint8_t font, const char *text, uint16_t x, uint16_t y) {
+    int err = cfb_framebuffer_set_font(dev, font);
     if (err) {
         printk("Could not set font, err %d\n", err);
+        return;
     }
 
-    err = cfb_print(dev, "to get weather forecast", 10, 40);
+    /* cfb_print() takes mutable strings but does not modify them */
+    err = cfb_print(dev, (char *)text, x, y);
     if (err) {
         printk("Could not display string, err %d\n", err);
     }
+}
 
-    err = cfb_framebuffer_set_font(dev, 0);
-    if (err) {
-        printk("Could not set font, err %d\n", err);
+
+/* Cut to what fits left of max_x, cfb_print() would wrap the rest onto
+   the next line */
+static void print_text_clipped(uint8_t font, const char *text, uint16_t x, uint16_t y,
+                               uint16_t max_x) {
+    uint8_t width, height;
+    char line[32];
+
+    if (cfb_get_font_size(dev, font, &width, &height) || width == 0) {
+        return;
     }
 
-    err = cfb_print(dev, "123456", 29, 72);
-    if (err) {
-        printk("Could not display custom font, err %d\n", err);
+    size_t fits = MIN((size_t)((max_x - x) / width), sizeof(line) - 1);
+    strncpy(line, text, fits);
+    line[fits] = '\0';
+
+    print_text(font, line, x, y);
+}
+
+
+static int condition_icon(uint16_t condition, bool night, const char *icon_id) {
+    /* The condition code tells more than the icon name, which older
+       bridges send alone */
+    int icon = weather_icon_for_condition(condition, night);
+    if (icon < 0 && icon_id) {
+        icon = weather_icon_for_name(icon_id);
     }
+    if (icon < 0) {
+        printk("Unsupported weather %u, icon ID %s\n", condition, icon_id ? icon_id : "-");
+    }
+
+    return icon;
+}
+
+
+static void format_degrees(char *buf, size_t size, int16_t deci_c) {
+    /* Whole degrees, to fit a column */
+    snprintf(buf, size, "%dC", (deci_c + (deci_c < 0 ? -5 : 5)) / 10);
+}
+
+
+void display_print_placeholder() {
+
+    frame_begin();
+
+    print_text(font_large, "Press button", 35, 8);
+    print_text(font_small, "to get weather forecast", 10, 40);
 
     cfb_framebuffer_finalize(dev);
 
+    draw_icon(WEATHER_ICON_CLEAR_DAY, 29, 72);
+    draw_icon(WEATHER_ICON_FEW_CLOUDS_DAY, 85, 72);
+    draw_icon(WEATHER_ICON_RAIN_DAY, 141, 72);
+    draw_icon(WEATHER_ICON_SNOW, 197, 72);
+
+    frame_end();
+
     return;
 }
 
 
-char* id_to_icon(char *id) {
-    /* Function for converting icon ID received
-       from openweathermap.org to weather icon
-       supported by weather font.
-    */
-    char buf[3];
-    memcpy(buf, id, 2);
-    buf[2] = '\0';
-    if (strcmp(buf, "01") == 0) {
-        /* Clear sky */
-        return "1";
-    } else if (strcmp(buf, "02") == 0) {
-        /* Few clouds */
-        return "2";
-    } else if (strcmp(buf, "03") == 0) {
-        /* Scattered clouds */
-        return "3";
-    } else if (strcmp(buf, "04") == 0) {
-        /* Broken clouds */
-        return "3";
-    } else if (strcmp(buf, "09") == 0) {
-        /* Shower rain */
-        return "4";
-    } else if (strcmp(buf, "10") == 0) {
-        /* Rain */
-        return "4";
-    } else if (strcmp(buf, "11") == 0) {
-        /* Thunderstorm */
-        return "6";
-    } else if (strcmp(buf, "13") == 0) {
-        /* Snow */
-        return "5";
-    } else {
-        printk("Unsupported weather icon ID %s\n", id);
-        return NULL;
+/* Left edge of the icon on the current weather page */
+#define WEATHER_ICON_X 170
+
+
+void display_print_weather(char *weather, char *icon_id, uint16_t condition,
+                           char *temperature, char *location) {
+
+    frame_begin();
+
+    print_text(font_large, location, 35, 16);
+    print_text(font_small, "Temp:", 35, 48);
+    print_text(font_small, temperature, 161, 48);
+    /* The icon is streamed in after the text and would cover it */
+    print_text_clipped(font_small, weather, 35, 72, WEATHER_ICON_X);
+
+    cfb_framebuffer_finalize(dev);
+
+    /* Names like "10n", the bridge may send a short or empty one */
+    bool night = strlen(icon_id) >= 3 && icon_id[2] == 'n';
+    int icon = condition_icon(condition, night, icon_id);
+    if (icon >= 0) {
+        draw_icon(icon, WEATHER_ICON_X, 64);
     }
+
+    frame_end();
+
+    return;
 }
 
 
-void display_print_weather(char *weather, char *icon_id, char *temperature, char *location) {
+/* The forecast pages are columns of label, icon and temperatures. Text
+   goes through cfb first, then the icons are streamed in on top. */
+#define COLUMN_WIDTH  62
+#define COLUMN_ICON_Y 24
+#define COLUMN_TEXT_Y 80
 
-    int err;
 
-    cfb_framebuffer_clear(dev, false);
+void display_print_hours(const struct forecast_hour *hours, int count) {
+    char text[8];
 
-    err = cfb_framebuffer_set_font(dev, 2);
-    if (err) {
-        printk("Could not set font, err %d\n", err);
-    }
+    frame_begin();
 
-    err = cfb_print(dev, location, 35, 16);
-    if (err) {
-        printk("Could not display string, err %d\n", err);
-    }
+    for (int i = 0; i < count; i++) {
+        snprintf(text, sizeof(text), "%02u:00", hours[i].hour);
+        print_text(font_small, text, i * COLUMN_WIDTH + 6, 0);
 
-    err = cfb_framebuffer_set_font(dev, 1);
-    if (err) {
-        printk("Could not set font, err %d\n", err);
+        format_degrees(text, sizeof(text), hours[i].temperature);
+        print_text(font_small, text, i * COLUMN_WIDTH + 11, COLUMN_TEXT_Y);
     }
 
-    err = cfb_print(dev, "Temp:", 35, 48);
-    if (err) {
-        printk("Could not display string, err %d\n", err);
-    }
+    cfb_framebuffer_finalize(dev);
 
-    err = cfb_print(dev, temperature, 161, 48);
-    if (err) {
-        printk("Could not display string, err %d\n", err);
+    for (int i = 0; i < count; i++) {
+        int icon = condition_icon(hours[i].condition, hours[i].night, NULL);
+        if (icon >= 0) {
+            draw_icon(icon, i * COLUMN_WIDTH + 7, COLUMN_ICON_Y);
+        }
     }
 
-    err = cfb_framebuffer_set_font(dev, 1);
-    if (err) {
-        printk("Could not set font, err %d\n", err);
-    }
+    frame_end();
+}
 
-    err = cfb_print(dev, weather, 35, 72);
-    if (err) {
-        printk("Could not display string, err %d\n", err);
-    }
 
-    /* Convert icon id to weather icon */
-    char *icon = id_to_icon(icon_id);
-    if (icon) {
-        err = cfb_framebuffer_set_font(dev, 0);
-        if (err) {
-            printk("Could not set font, err %d\n", err);
-        }
+void display_print_days(const struct forecast_day *days, int count) {
+    static const char *const weekdays[] = {"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"};
+    char text[8];
+
+    frame_begin();
 
-        err = cfb_print(dev, icon, 170, 64);
-        if (err) {
-            printk("Could not display string, err %d\n", err);
+    for (int i = 0; i < count; i++) {
+        if (days[i].weekday < ARRAY_SIZE(weekdays)) {
+            print_text(font_small, weekdays[days[i].weekday], i * COLUMN_WIDTH + 16, 0);
         }
+
+        format_degrees(text, sizeof(text), days[i].temp_max);
+        print_text(font_small, text, i * COLUMN_WIDTH + 11, COLUMN_TEXT_Y);
+        format_degrees(text, sizeof(text), days[i].temp_min);
+        print_text(font_small, text, i * COLUMN_WIDTH + 11, COLUMN_TEXT_Y + 16);
     }
 
     cfb_framebuffer_finalize(dev);
 
-    return;
-}
\ No newline at end of file
+    for (int i = 0; i < count; i++) {
+        int icon = condition_icon(days[i].condition, false, NULL);
+        if (icon >= 0) {
+            draw_icon(icon, i * COLUMN_WIDTH + 7, COLUMN_ICON_Y);
+        }
+    }
+
+    frame_end();
+}
+
+
+BUS_SUBSCRIBER_DEFINE(display_sub, 2);
+
+static void display_thread(void) {
+
+    bus_subscribe(&weather_chan, &display_sub);
+
+    while (1) {
+        const struct weather_evt *evt = bus_receive(&display_sub, NULL, K_FOREVER);
+
+        switch (evt->page) {
+        case FORECAST_PAGE_HOURS:
+            display_print_hours(evt->hours, evt->hour_count);
+            break;
+
+        case FORECAST_PAGE_DAYS:
+            display_print_days(evt->days, evt->day_count);
+            break;
+
+        default:
+            /* cfb_print() takes mutable strings but does not modify them */
+            display_print_weather((char *)evt->weather, (char *)evt->icon_id, evt->condition,
+                (char *)evt->temperature, (char *)evt->location);
+            break;
+        }
+
+        bus_release(evt);
+    }
+}
+
+K_THREAD_DEFINE(display_tid, 1024, display_thread, NULL, NULL, NULL,
+        CONFIG_DISPLAY_THREAD_PRIORITY, 0, 0);
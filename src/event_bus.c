@@ -0,0 +1,136 @@
+#include <zephyr.h>
+#include <string.h>
+
+#include "event_bus.h"
+
+
+static struct k_spinlock lock;
+
+
+static struct bus_msg *to_header(const void *msg) {
+    return CONTAINER_OF(msg, struct bus_msg, data);
+}
+
+
+int bus_subscribe(struct bus_channel *chan, struct bus_subscriber *sub) {
+    int err = 0;
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    if (chan->sub_count < CONFIG_EVENT_BUS_MAX_SUBSCRIBERS) {
+        chan->subs[chan->sub_count++] = sub;
+    } else {
+        printk("Too many subscribers on %s\n", chan->name);
+        err = -ENOMEM;
+    }
+
+    k_spin_unlock(&lock, key);
+    return err;
+}
+
+
+void *bus_alloc(struct bus_channel *chan) {
+    struct bus_msg *hdr;
+
+    if (k_mem_slab_alloc(chan->slab, (void **)&hdr, K_NO_WAIT) != 0) {
+        k_spinlock_key_t key = k_spin_lock(&lock);
+        chan->stats.dropped++;
+        k_spin_unlock(&lock, key);
+        return NULL;
+    }
+
+    hdr->chan = chan;
+    /* The publisher's reference, handed over by bus_publish() */
+    atomic_set(&hdr->refs, 1);
+    memset(hdr->data, 0, chan->msg_size);
+
+    return hdr->data;
+}
+
+
+void bus_publish(void *msg) {
+    struct bus_msg *hdr = to_header(msg);
+    struct bus_channel *chan = hdr->chan;
+    uint32_t depth = 0;
+    uint32_t dropped = 0;
+
+    /* The publisher's reference is held while queueing so an early
+       subscriber cannot free the buffer before it has reached the others */
+    hdr->publish_cycles = k_cycle_get_32();
+
+    for (int i = 0; i < chan->sub_count; i++) {
+        struct k_msgq *msgq = chan->subs[i]->msgq;
+
+        atomic_inc(&hdr->refs);
+        if (k_msgq_put(msgq, &hdr, K_NO_WAIT) != 0) {
+            atomic_dec(&hdr->refs);
+            dropped++;
+            continue;
+        }
+
+        depth = MAX(depth, k_msgq_num_used_get(msgq));
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    chan->stats.published++;
+    chan->stats.dropped += dropped;
+    chan->stats.max_depth = MAX(chan->stats.max_depth, depth);
+    k_spin_unlock(&lock, key);
+
+    bus_release(msg);
+}
+
+
+const void *bus_receive(struct bus_subscriber *sub, const struct bus_channel **chan, k_timeout_t timeout) {
+    struct bus_msg *hdr;
+
+    if (k_msgq_get(sub->msgq, &hdr, timeout) != 0) {
+        return NULL;
+    }
+
+    uint32_t latency = k_cyc_to_us_floor32(k_cycle_get_32() - hdr->publish_cycles);
+    struct bus_channel_stats *stats = &hdr->chan->stats;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    stats->delivered++;
+    stats->latency_total_us += latency;
+    stats->latency_max_us = MAX(stats->latency_max_us, latency);
+    k_spin_unlock(&lock, key);
+
+    if (chan) {
+        *chan = hdr->chan;
+    }
+
+    return hdr->data;
+}
+
+
+void bus_release(const void *msg) {
+    struct bus_msg *hdr = to_header(msg);
+
+    if (atomic_dec(&hdr->refs) == 1) {
+        k_mem_slab_free(hdr->chan->slab, (void **)&hdr);
+    }
+}
+
+
+void bus_poll_event_init(struct k_poll_event *event, struct bus_subscriber *sub) {
+    k_poll_event_init(event, K_POLL_TYPE_MSGQ_DATA_AVAILABLE, K_POLL_MODE_NOTIFY_ONLY, sub->msgq);
+}
+
+
+void bus_print_stats(const struct bus_channel *chan) {
+    struct bus_channel_stats stats;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    stats = chan->stats;
+    k_spin_unlock(&lock, key);
+
+    uint32_t latency_avg = stats.delivered ?
+        (uint32_t)(stats.latency_total_us / stats.delivered) : 0;
+
+    printk("%s: published %u delivered %u dropped %u, max depth %u, "
+           "latency avg %u us max %u us, buffers in use %u\n",
+        chan->name, stats.published, stats.delivered, stats.dropped,
+        stats.max_depth, latency_avg, stats.latency_max_us,
+        k_mem_slab_num_used_get(chan->slab));
+}
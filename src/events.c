@@ -0,0 +1,51 @@
+#include <zephyr.h>
+#include <init.h>
+
+#include "events.h"
+
+
+BUS_CHANNEL_DEFINE(button_chan, struct button_evt, 2);
+BUS_CHANNEL_DEFINE(gnss_status_chan, struct gnss_status_evt, 4);
+BUS_CHANNEL_DEFINE(location_request_chan, struct location_request_evt, 2);
+BUS_CHANNEL_DEFINE(location_chan, struct location_evt, 2);
+BUS_CHANNEL_DEFINE(forecast_chan, struct weather_evt, 2);
+BUS_CHANNEL_DEFINE(weather_chan, struct weather_evt, 2);
+BUS_CHANNEL_DEFINE(fota_chan, struct fota_evt, 1);
+
+static struct bus_channel *const channels[] = {
+    &button_chan,
+    &gnss_status_chan,
+    &location_request_chan,
+    &location_chan,
+    &forecast_chan,
+    &weather_chan,
+    &fota_chan,
+};
+
+
+void events_print_stats() {
+    for (int i = 0; i < ARRAY_SIZE(channels); i++) {
+        bus_print_stats(channels[i]);
+    }
+}
+
+
+#if CONFIG_EVENT_BUS_STATS_INTERVAL_S > 0
+
+static void stats_work_handler(struct k_work *work);
+
+K_WORK_DELAYABLE_DEFINE(stats_work, stats_work_handler);
+
+static void stats_work_handler(struct k_work *work) {
+    events_print_stats();
+    k_work_schedule(&stats_work, K_SECONDS(CONFIG_EVENT_BUS_STATS_INTERVAL_S));
+}
+
+static int stats_init(const struct device *dev) {
+    k_work_schedule(&stats_work, K_SECONDS(CONFIG_EVENT_BUS_STATS_INTERVAL_S));
+    return 0;
+}
+
+SYS_INIT(stats_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+#endif
@@ -0,0 +1,117 @@
+#include <zephyr.h>
+#include <string.h>
+
+#include "events.h"
+
+
+/* Latest weather from the cloud, kept so a button press can be answered
+   from local state while the cloud keeps it fresh with pushes. It holds
+   the next hours and days too, which short presses page through. */
+static struct weather_evt latest;
+static int64_t latest_time;
+static bool latest_valid;
+static bool latest_shown;
+static uint8_t page;
+
+
+static bool latest_fresh() {
+    return latest_valid &&
+           k_uptime_get() - latest_time < CONFIG_FORECAST_MAX_AGE_S * 1000LL;
+}
+
+
+static bool page_empty(uint8_t p) {
+    return (p == FORECAST_PAGE_HOURS && latest.hour_count == 0) ||
+           (p == FORECAST_PAGE_DAYS && latest.day_count == 0);
+}
+
+
+static uint8_t next_page(uint8_t p) {
+    do {
+        p = (p + 1) % FORECAST_PAGE_COUNT;
+    } while (page_empty(p));
+
+    return p;
+}
+
+
+static void show_latest() {
+    struct weather_evt *evt = bus_alloc(&weather_chan);
+    if (!evt) {
+        printk("Weather event dropped\n");
+        return;
+    }
+
+    *evt = latest;
+    evt->page = page;
+    bus_publish(evt);
+    latest_shown = true;
+}
+
+
+static void request_location(bool user_request) {
+    struct location_request_evt *req = bus_alloc(&location_request_chan);
+    if (!req) {
+        printk("Location request dropped\n");
+        return;
+    }
+
+    req->user_request = user_request;
+    bus_publish(req);
+}
+
+
+BUS_SUBSCRIBER_DEFINE(forecast_sub, 4);
+
+static void forecast_thread(void) {
+    const struct bus_channel *chan;
+
+    bus_subscribe(&button_chan, &forecast_sub);
+    bus_subscribe(&forecast_chan, &forecast_sub);
+
+    while (1) {
+        const void *msg = bus_receive(&forecast_sub, &chan, K_FOREVER);
+
+        if (chan == &forecast_chan) {
+            const struct weather_evt *evt = msg;
+
+            latest = *evt;
+            latest_time = k_uptime_get();
+            latest_valid = true;
+            latest_shown = false;
+            page = FORECAST_PAGE_NOW;
+
+            /* Pushes are only stored, the next press draws them */
+            if (!evt->pushed) {
+                show_latest();
+            }
+        } else if (chan == &button_chan) {
+            const struct button_evt *press = msg;
+
+            if (!press->long_press && latest_fresh()) {
+                /* Page through what we have, or draw a pushed forecast
+                   first. No network traffic unless back on the first page. */
+                page = latest_shown ? next_page(page) : FORECAST_PAGE_NOW;
+
+                show_latest();
+                printk("Rendered local page %u %u ms after press, age %u s\n", page,
+                    (uint32_t)(k_uptime_get() - press->timestamp),
+                    (uint32_t)((k_uptime_get() - latest_time) / 1000));
+
+                /* Still check whether we moved out of the forecast area,
+                   this only reaches the cloud if we did */
+                if (page == FORECAST_PAGE_NOW) {
+                    request_location(false);
+                }
+            } else {
+                page = FORECAST_PAGE_NOW;
+                request_location(true);
+            }
+        }
+
+        bus_release(msg);
+    }
+}
+
+K_THREAD_DEFINE(forecast_tid, 1024, forecast_thread, NULL, NULL, NULL,
+        CONFIG_FORECAST_THREAD_PRIORITY, 0, 0);
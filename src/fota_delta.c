@@ -0,0 +1,464 @@
+#include <zephyr.h>
+#include <init.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/byteorder.h>
+#include <sys/crc.h>
+#include <sys/reboot.h>
+#include <storage/flash_map.h>
+#include <dfu/flash_img.h>
+#include <dfu/mcuboot.h>
+
+#include "fota_delta.h"
+#include "buf_pool.h"
+#include "events.h"
+
+#define DELTA_HDR_SIZE  20
+#define OP_COPY         0x01
+#define OP_INSERT       0x02
+#define COPY_BUF_SIZE   256
+
+
+enum delta_state {
+    DELTA_IDLE,
+    DELTA_HEADER,
+    DELTA_OP,
+    DELTA_COPY_ARGS,
+    DELTA_INSERT_LEN,
+    DELTA_INSERT_DATA,
+    DELTA_DONE,
+    DELTA_FAILED,
+};
+
+static struct {
+    enum delta_state state;
+    uint32_t image_id;
+    uint32_t offset;
+    uint32_t total;
+
+    /* Fixed size field being assembled across chunk boundaries */
+    uint8_t field[DELTA_HDR_SIZE];
+    size_t field_len;
+    size_t field_need;
+
+    uint32_t insert_left;
+    uint32_t source_size;
+    uint32_t target_size;
+    uint32_t target_crc;
+    uint32_t written;
+    uint32_t crc;
+
+    int64_t start_time;
+    uint32_t chunks;
+} dl;
+
+/* Failed attempts at the last image that failed. It is downloaded again
+   from the start up to CONFIG_FOTA_DELTA_RETRIES times. */
+static uint32_t failed_image_id;
+static uint8_t failures;
+
+static struct flash_img_context flash_ctx;
+static const struct flash_area *primary;
+static uint8_t copy_buf[COPY_BUF_SIZE];
+
+/* Chunks are applied here, checking the running image and copying from
+   it take far longer than the network thread may be away from the socket */
+K_THREAD_STACK_DEFINE(fota_stack, CONFIG_FOTA_DELTA_THREAD_STACK_SIZE);
+static struct k_work_q fota_queue;
+
+/* Set while a chunk is queued or being applied, dl is the FOTA
+   thread's until it is cleared */
+static atomic_t busy;
+static uint8_t *chunk_buf;
+static size_t chunk_len;
+
+
+static void reboot_work_handler(struct k_work *work) {
+    sys_reboot(SYS_REBOOT_WARM);
+}
+
+K_WORK_DELAYABLE_DEFINE(reboot_work, reboot_work_handler);
+
+
+static void expect(enum delta_state state, size_t len) {
+    dl.state = state;
+    dl.field_len = 0;
+    dl.field_need = len;
+}
+
+
+static int write_target(const uint8_t *data, size_t len) {
+    if (dl.written + len > dl.target_size) {
+        printk("Delta writes past target size %u\n", dl.target_size);
+        return -EFBIG;
+    }
+
+    dl.crc = crc32_ieee_update(dl.crc, data, len);
+    dl.written += len;
+
+    return flash_img_buffered_write(&flash_ctx, data, len, false);
+}
+
+
+static int copy_source(uint32_t offset, uint32_t len) {
+    if (offset > dl.source_size || len > dl.source_size - offset) {
+        printk("Delta copy %u+%u outside source\n", offset, len);
+        return -EINVAL;
+    }
+
+    while (len > 0) {
+        size_t n = MIN(len, sizeof(copy_buf));
+        int err = flash_area_read(primary, offset, copy_buf, n);
+        if (err) {
+            return err;
+        }
+
+        err = write_target(copy_buf, n);
+        if (err) {
+            return err;
+        }
+
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+static int verify_source() {
+    /* A delta applied to another base than it was made against
+       would produce a broken image, so check before writing. */
+    uint32_t crc = 0;
+    uint32_t offset = 0;
+
+    if (dl.source_size > primary->fa_size) {
+        return -EINVAL;
+    }
+
+    while (offset < dl.source_size) {
+        size_t n = MIN(dl.source_size - offset, sizeof(copy_buf));
+        int err = flash_area_read(primary, offset, copy_buf, n);
+        if (err) {
+            return err;
+        }
+
+        crc = crc32_ieee_update(crc, copy_buf, n);
+        offset += n;
+    }
+
+    return crc == sys_get_be32(&dl.field[8]) ? 0 : -EBADMSG;
+}
+
+
+static int field_complete() {
+    int err;
+
+    switch (dl.state) {
+    case DELTA_HEADER:
+        if (sys_get_be32(&dl.field[0]) != FOTA_DELTA_MAGIC) {
+            printk("Not a delta image\n");
+            return -EINVAL;
+        }
+
+        dl.source_size = sys_get_be32(&dl.field[4]);
+        dl.target_size = sys_get_be32(&dl.field[12]);
+        dl.target_crc = sys_get_be32(&dl.field[16]);
+
+        if (dl.target_size == 0) {
+            return -EINVAL;
+        }
+
+        err = verify_source();
+        if (err) {
+            printk("Delta does not match running image: %d\n", err);
+            return err;
+        }
+
+        err = flash_img_init(&flash_ctx);
+        if (err) {
+            printk("flash_img_init: %d\n", err);
+            return err;
+        }
+
+        expect(DELTA_OP, 1);
+        return 0;
+
+    case DELTA_OP:
+        if (dl.field[0] == OP_COPY) {
+            expect(DELTA_COPY_ARGS, 8);
+        } else if (dl.field[0] == OP_INSERT) {
+            expect(DELTA_INSERT_LEN, 4);
+        } else {
+            printk("Unknown delta op 0x%02x\n", dl.field[0]);
+            return -EINVAL;
+        }
+        return 0;
+
+    case DELTA_COPY_ARGS:
+        err = copy_source(sys_get_be32(&dl.field[0]), sys_get_be32(&dl.field[4]));
+        expect(DELTA_OP, 1);
+        return err;
+
+    case DELTA_INSERT_LEN:
+        dl.insert_left = sys_get_be32(&dl.field[0]);
+        if (dl.insert_left == 0) {
+            expect(DELTA_OP, 1);
+        } else {
+            dl.state = DELTA_INSERT_DATA;
+        }
+        return 0;
+
+    default:
+        return -EINVAL;
+    }
+}
+
+
+static int apply(const uint8_t *data, size_t len) {
+    int err;
+
+    while (len > 0) {
+        size_t n;
+
+        if (dl.state == DELTA_INSERT_DATA) {
+            n = MIN(len, dl.insert_left);
+            err = write_target(data, n);
+            if (err) {
+                return err;
+            }
+
+            dl.insert_left -= n;
+            if (dl.insert_left == 0) {
+                expect(DELTA_OP, 1);
+            }
+        } else {
+            n = MIN(len, dl.field_need - dl.field_len);
+            memcpy(&dl.field[dl.field_len], data, n);
+            dl.field_len += n;
+
+            if (dl.field_len == dl.field_need) {
+                err = field_complete();
+                if (err) {
+                    return err;
+                }
+            }
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+static int finish() {
+    int err = flash_img_buffered_write(&flash_ctx, NULL, 0, true);
+    if (err) {
+        return err;
+    }
+
+    if (dl.written != dl.target_size || dl.crc != dl.target_crc) {
+        printk("Delta produced a bad image: %u/%u bytes, crc %08x expected %08x\n",
+            dl.written, dl.target_size, dl.crc, dl.target_crc);
+        return -EBADMSG;
+    }
+
+    uint32_t ms = (uint32_t)(k_uptime_get() - dl.start_time);
+
+    printk("Delta update: %u bytes downloaded for a %u byte image (%u%%) "
+           "in %u chunks, %u s\n",
+        dl.total, dl.target_size, dl.total * 100 / dl.target_size,
+        dl.chunks, ms / 1000);
+    printk("Full image at the same rate: %u bytes, ~%u s\n",
+        dl.target_size, (uint32_t)((uint64_t)ms * dl.target_size / dl.total / 1000));
+
+    err = boot_request_upgrade(BOOT_UPGRADE_TEST);
+    if (err) {
+        printk("boot_request_upgrade: %d\n", err);
+        return err;
+    }
+
+    printk("Rebooting into new image\n");
+    k_work_schedule(&reboot_work, K_SECONDS(2));
+
+    return 0;
+}
+
+
+static void start(uint32_t image_id, uint32_t total) {
+    memset(&dl, 0, sizeof(dl));
+    dl.image_id = image_id;
+    dl.total = total;
+    dl.start_time = k_uptime_get();
+    expect(DELTA_HEADER, DELTA_HDR_SIZE);
+
+    printk("Starting delta update %u, %u bytes\n", image_id, total);
+}
+
+
+static void fail(int err) {
+    dl.state = DELTA_FAILED;
+
+    if (failed_image_id != dl.image_id) {
+        failed_image_id = dl.image_id;
+        failures = 0;
+    }
+    failures++;
+
+    if (failures <= CONFIG_FOTA_DELTA_RETRIES) {
+        printk("Delta update failed: %d, starting over (%u/%u)\n",
+            err, failures, CONFIG_FOTA_DELTA_RETRIES);
+    } else {
+        printk("Delta update failed: %d, giving up\n", err);
+    }
+}
+
+
+static int handle_chunk(const uint8_t *buf, size_t len) {
+    int err;
+
+    if (len < FOTA_CHUNK_HDR_SIZE) {
+        return -EMSGSIZE;
+    }
+
+    uint16_t data_len = sys_get_be16(&buf[2]);
+    uint32_t image_id = sys_get_be32(&buf[4]);
+    uint32_t offset = sys_get_be32(&buf[8]);
+    uint32_t total = sys_get_be32(&buf[12]);
+
+    if (buf[0] != FOTA_CHUNK_VERSION || data_len != len - FOTA_CHUNK_HDR_SIZE ||
+        total < DELTA_HDR_SIZE) {
+        printk("Malformed FOTA chunk\n");
+        return -EINVAL;
+    }
+
+    if (!primary) {
+        err = flash_area_open(FLASH_AREA_ID(image_0), &primary);
+        if (err) {
+            printk("Could not open primary slot: %d\n", err);
+            return err;
+        }
+    }
+
+    if (image_id != dl.image_id || dl.state == DELTA_IDLE ||
+        (dl.state == DELTA_FAILED && offset == 0)) {
+        if (offset != 0) {
+            /* Tail of an image we are not downloading */
+            return -EAGAIN;
+        }
+        start(image_id, total);
+    }
+
+    if (dl.state == DELTA_DONE || dl.state == DELTA_FAILED) {
+        return 0;
+    }
+
+    if (offset != dl.offset || total != dl.total) {
+        /* Duplicate or out of order, the next request asks again */
+        printk("FOTA chunk at %u, expected %u\n", offset, dl.offset);
+        return -EAGAIN;
+    }
+
+    err = apply(&buf[FOTA_CHUNK_HDR_SIZE], data_len);
+    if (err) {
+        fail(err);
+        return err;
+    }
+
+    dl.offset += data_len;
+    dl.chunks++;
+
+    if (dl.offset >= dl.total) {
+        err = finish();
+        if (err) {
+            fail(err);
+        } else {
+            dl.state = DELTA_DONE;
+        }
+    }
+
+    return err;
+}
+
+
+static void chunk_work_handler(struct k_work *work) {
+    int err = handle_chunk(chunk_buf, chunk_len);
+
+    buf_pool_free(chunk_buf);
+    chunk_buf = NULL;
+    atomic_clear(&busy);
+
+    struct fota_evt *evt = bus_alloc(&fota_chan);
+    if (!evt) {
+        /* The next reconnect asks for the chunk again */
+        printk("No buffer for FOTA event\n");
+        return;
+    }
+    evt->err = err;
+    bus_publish(evt);
+}
+
+K_WORK_DEFINE(chunk_work, chunk_work_handler);
+
+
+int fota_delta_submit_chunk(uint8_t *buf, size_t len) {
+    if (!atomic_cas(&busy, 0, 1)) {
+        return -EBUSY;
+    }
+
+    chunk_buf = buf;
+    chunk_len = len;
+    k_work_submit_to_queue(&fota_queue, &chunk_work);
+
+    return 0;
+}
+
+
+int fota_delta_next_request(char *buf, size_t size) {
+    if (atomic_get(&busy)) {
+        /* Asked for once it has been applied */
+        return 0;
+    }
+
+    if (dl.state == DELTA_FAILED && failures <= CONFIG_FOTA_DELTA_RETRIES) {
+        /* A chunk at offset 0 starts the image over */
+        return snprintf(buf, size, "%u;0", dl.image_id);
+    }
+
+    if (dl.state == DELTA_IDLE || dl.state == DELTA_DONE || dl.state == DELTA_FAILED) {
+        return 0;
+    }
+
+    return snprintf(buf, size, "%u;%u", dl.image_id, dl.offset);
+}
+
+
+void fota_delta_confirm_image() {
+    if (boot_is_img_confirmed()) {
+        return;
+    }
+
+    int err = boot_write_img_confirmed();
+    if (err) {
+        printk("Could not confirm image: %d\n", err);
+        return;
+    }
+
+    printk("Running image confirmed\n");
+}
+
+
+static int fota_delta_init(const struct device *dev) {
+    const struct k_work_queue_config cfg = {
+        .name = "fota",
+    };
+
+    k_work_queue_start(&fota_queue, fota_stack, K_THREAD_STACK_SIZEOF(fota_stack),
+                       CONFIG_FOTA_DELTA_THREAD_PRIORITY, &cfg);
+
+    return 0;
+}
+
+SYS_INIT(fota_delta_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
@@ -0,0 +1,514 @@
+#include <zephyr.h>
+#include <device.h>
+#include <string.h>
+#include <sys/byteorder.h>
+#include <sys/ring_buffer.h>
+#include <drivers/uart.h>
+#include <storage/flash_map.h>
+#include <storage/stream_flash.h>
+
+#include "gnss_trace.h"
+
+#define PVT_FIXED_SIZE  31
+#define PVT_SV_SIZE     8
+#define PVT_MAX_SIZE    (PVT_FIXED_SIZE + PVT_SV_SIZE * NRF_MODEM_GNSS_MAX_SATELLITES)
+
+/* Records never start with this byte, so it pads between records and
+   marks the erased end of a trace in flash */
+#define TRACE_PAD       0xff
+
+
+#if defined(CONFIG_GNSS_TRACE_RECORD)
+
+static uint16_t clamp_u16(double v) {
+    return v < 0 ? 0 : v > UINT16_MAX ? UINT16_MAX : (uint16_t)v;
+}
+
+
+static size_t encode_pvt(const struct nrf_modem_gnss_pvt_data_frame *pvt, uint8_t *buf) {
+    uint8_t *p = buf;
+    uint8_t *count;
+
+    *p++ = pvt->flags;
+    sys_put_le32((int32_t)(pvt->latitude * 1e7), p); p += 4;
+    sys_put_le32((int32_t)(pvt->longitude * 1e7), p); p += 4;
+    sys_put_le16((int16_t)pvt->altitude, p); p += 2;
+    sys_put_le16(clamp_u16(pvt->accuracy * 100), p); p += 2;
+    sys_put_le16(clamp_u16(pvt->speed * 100), p); p += 2;
+    sys_put_le16(clamp_u16(pvt->heading * 100), p); p += 2;
+    sys_put_le16(pvt->datetime.year, p); p += 2;
+    *p++ = pvt->datetime.month;
+    *p++ = pvt->datetime.day;
+    *p++ = pvt->datetime.hour;
+    *p++ = pvt->datetime.minute;
+    *p++ = pvt->datetime.seconds;
+    sys_put_le16(pvt->datetime.ms, p); p += 2;
+    sys_put_le16(clamp_u16(pvt->pdop * 100), p); p += 2;
+    sys_put_le16(clamp_u16(pvt->hdop * 100), p); p += 2;
+
+    /* Only satellites being tracked */
+    count = p++;
+    *count = 0;
+    for (int i = 0; i < NRF_MODEM_GNSS_MAX_SATELLITES; i++) {
+        const struct nrf_modem_gnss_sv *sv = &pvt->sv[i];
+        if (sv->sv == 0) {
+            continue;
+        }
+
+        *p++ = sv->sv;
+        *p++ = sv->signal;
+        sys_put_le16(sv->cn0, p); p += 2;
+        *p++ = (int8_t)sv->elevation;
+        sys_put_le16(sv->azimuth, p); p += 2;
+        *p++ = sv->flags;
+        (*count)++;
+    }
+
+    return p - buf;
+}
+
+
+RING_BUF_DECLARE(trace_ring, CONFIG_GNSS_TRACE_BUFFER_SIZE);
+static struct k_spinlock ring_lock;
+K_SEM_DEFINE(trace_sem, 0, 1);
+
+static int64_t record_start;
+static uint32_t recorded;
+static uint32_t dropped;
+
+
+static void put_record(uint8_t type, const uint8_t *payload, size_t len) {
+    uint8_t hdr[GNSS_TRACE_REC_SIZE];
+
+    hdr[0] = type;
+    sys_put_le16(len, &hdr[1]);
+    sys_put_le32((uint32_t)(k_uptime_get() - record_start), &hdr[3]);
+
+    /* Called from the GNSS handler and the GNSS thread */
+    k_spinlock_key_t key = k_spin_lock(&ring_lock);
+    if (ring_buf_space_get(&trace_ring) < sizeof(hdr) + len) {
+        dropped++;
+    } else {
+        ring_buf_put(&trace_ring, hdr, sizeof(hdr));
+        ring_buf_put(&trace_ring, payload, len);
+        recorded++;
+    }
+    k_spin_unlock(&ring_lock, key);
+
+    k_sem_give(&trace_sem);
+}
+
+
+void gnss_trace_record_pvt(const struct nrf_modem_gnss_pvt_data_frame *pvt) {
+    uint8_t buf[PVT_MAX_SIZE];
+
+    put_record(GNSS_TRACE_PVT, buf, encode_pvt(pvt, buf));
+}
+
+
+void gnss_trace_record_nmea(const struct nrf_modem_gnss_nmea_data_frame *nmea) {
+    if (!IS_ENABLED(CONFIG_GNSS_TRACE_NMEA)) {
+        return;
+    }
+
+    size_t len = strnlen(nmea->nmea_str, sizeof(nmea->nmea_str));
+
+    /* Drop the line ending */
+    while (len > 0 && (nmea->nmea_str[len - 1] == '\r' || nmea->nmea_str[len - 1] == '\n')) {
+        len--;
+    }
+
+    put_record(GNSS_TRACE_NMEA, nmea->nmea_str, len);
+}
+
+
+void gnss_trace_record_session(bool start) {
+    put_record(start ? GNSS_TRACE_START : GNSS_TRACE_STOP, NULL, 0);
+
+    if (!start) {
+        printk("GNSS trace: %u records, %u dropped\n", recorded, dropped);
+    }
+}
+
+
+#if defined(CONFIG_GNSS_TRACE_UART)
+
+static const struct device *uart;
+
+
+static int backend_init() {
+    uart = device_get_binding(CONFIG_GNSS_TRACE_UART_DEV);
+    if (!uart) {
+        printk("GNSS trace: no UART %s\n", CONFIG_GNSS_TRACE_UART_DEV);
+        return -ENODEV;
+    }
+
+    return 0;
+}
+
+
+static int backend_write(const uint8_t *data, size_t len, bool flush) {
+    for (size_t i = 0; i < len; i++) {
+        uart_poll_out(uart, data[i]);
+    }
+
+    return 0;
+}
+
+#else /* CONFIG_GNSS_TRACE_FLASH */
+
+static struct stream_flash_ctx stream;
+static uint8_t stream_buf[256];
+
+
+static int backend_init() {
+    const struct flash_area *fa;
+    uint32_t first;
+
+    int err = flash_area_open(FLASH_AREA_ID(gnss_trace), &fa);
+    if (err) {
+        printk("GNSS trace: no gnss_trace partition: %d\n", err);
+        return err;
+    }
+
+    /* Keep a recorded trace until the partition is erased. Anything
+       else there is from before the partition existed. */
+    err = flash_area_read(fa, 0, &first, sizeof(first));
+    if (err || sys_le32_to_cpu(first) == GNSS_TRACE_MAGIC) {
+        printk("GNSS trace: partition holds a trace, erase it to record again\n");
+        return -EEXIST;
+    }
+
+    if (first != 0xffffffff) {
+        err = flash_area_erase(fa, 0, fa->fa_size);
+        if (err) {
+            printk("GNSS trace: erase failed: %d\n", err);
+            return err;
+        }
+    }
+
+    printk("GNSS trace: recording %u bytes to flash\n", (unsigned int)fa->fa_size);
+
+    return stream_flash_init(&stream, device_get_binding(fa->fa_dev_name),
+                 stream_buf, sizeof(stream_buf), fa->fa_off, fa->fa_size, NULL);
+}
+
+
+static int backend_write(const uint8_t *data, size_t len, bool flush) {
+    /* A flush pads to the write block size with TRACE_PAD */
+    int err = stream_flash_buffered_write(&stream, data, len, flush);
+    if (err == -ENOMEM) {
+        printk("GNSS trace: partition full\n");
+    }
+
+    return err;
+}
+
+#endif
+
+
+static void trace_thread(void) {
+    uint8_t hdr[GNSS_TRACE_HDR_SIZE];
+    uint8_t chunk[64];
+    uint32_t n;
+
+    record_start = k_uptime_get();
+
+    if (backend_init() != 0) {
+        return;
+    }
+
+    sys_put_le32(GNSS_TRACE_MAGIC, hdr);
+    hdr[4] = GNSS_TRACE_VERSION;
+    if (backend_write(hdr, sizeof(hdr), false) != 0) {
+        return;
+    }
+
+    while (1) {
+        k_sem_take(&trace_sem, K_FOREVER);
+
+        while ((n = ring_buf_get(&trace_ring, chunk, sizeof(chunk))) > 0) {
+            if (backend_write(chunk, n, false) != 0) {
+                return;
+            }
+        }
+
+        if (backend_write(NULL, 0, true) != 0) {
+            return;
+        }
+    }
+}
+
+K_THREAD_DEFINE(gnss_trace_tid, 1024, trace_thread, NULL, NULL, NULL,
+        CONFIG_GNSS_TRACE_THREAD_PRIORITY, 0, 0);
+
+#endif /* CONFIG_GNSS_TRACE_RECORD */
+
+
+#if defined(CONFIG_GNSS_TRACE_REPLAY)
+
+#if defined(CONFIG_GNSS_TRACE_REPLAY_FROM_FILE)
+
+static const uint8_t trace_file[] = {
+#include "gnss_trace_replay.inc"
+};
+
+
+static int source_init() {
+    return 0;
+}
+
+
+static size_t source_size() {
+    return sizeof(trace_file);
+}
+
+
+static int source_read(size_t offset, void *buf, size_t len) {
+    if (offset > sizeof(trace_file) || len > sizeof(trace_file) - offset) {
+        return -EINVAL;
+    }
+
+    memcpy(buf, &trace_file[offset], len);
+    return 0;
+}
+
+#else /* CONFIG_GNSS_TRACE_REPLAY_FROM_FLASH */
+
+static const struct flash_area *replay_fa;
+
+
+static int source_init() {
+    return flash_area_open(FLASH_AREA_ID(gnss_trace), &replay_fa);
+}
+
+
+static size_t source_size() {
+    return replay_fa->fa_size;
+}
+
+
+static int source_read(size_t offset, void *buf, size_t len) {
+    if (offset > replay_fa->fa_size || len > replay_fa->fa_size - offset) {
+        return -EINVAL;
+    }
+
+    return flash_area_read(replay_fa, offset, buf, len);
+}
+
+#endif
+
+
+struct trace_record {
+    size_t payload;
+    uint8_t type;
+    uint16_t len;
+    uint32_t time;
+};
+
+static nrf_modem_gnss_event_handler_type_t replay_handler;
+static struct trace_record next_rec;
+static size_t replay_pos;
+static uint32_t session_time;
+static uint32_t last_time;
+static bool replay_running;
+static bool replay_fixed;
+
+static uint8_t rec_buf[MAX(PVT_MAX_SIZE, NRF_MODEM_GNSS_NMEA_MAX_LEN)];
+static struct nrf_modem_gnss_pvt_data_frame replay_pvt;
+static struct nrf_modem_gnss_nmea_data_frame replay_nmea;
+
+
+static int read_record(size_t *pos, struct trace_record *rec) {
+    uint8_t hdr[GNSS_TRACE_REC_SIZE];
+
+    /* Skip flush padding */
+    do {
+        if (*pos >= source_size() || source_read(*pos, hdr, 1) != 0) {
+            return -ENOENT;
+        }
+        (*pos)++;
+    } while (hdr[0] == TRACE_PAD);
+    (*pos)--;
+
+    if (source_read(*pos, hdr, sizeof(hdr)) != 0) {
+        return -ENOENT;
+    }
+
+    rec->type = hdr[0];
+    rec->len = sys_get_le16(&hdr[1]);
+    rec->time = sys_get_le32(&hdr[3]);
+    rec->payload = *pos + sizeof(hdr);
+
+    if (rec->len > sizeof(rec_buf) || rec->payload + rec->len > source_size()) {
+        return -EINVAL;
+    }
+
+    *pos = rec->payload + rec->len;
+    return 0;
+}
+
+
+static void decode_pvt(const uint8_t *p, size_t len, struct nrf_modem_gnss_pvt_data_frame *pvt) {
+    memset(pvt, 0, sizeof(*pvt));
+    if (len < PVT_FIXED_SIZE) {
+        return;
+    }
+
+    pvt->flags = *p++;
+    pvt->latitude = (int32_t)sys_get_le32(p) / 1e7; p += 4;
+    pvt->longitude = (int32_t)sys_get_le32(p) / 1e7; p += 4;
+    pvt->altitude = (int16_t)sys_get_le16(p); p += 2;
+    pvt->accuracy = sys_get_le16(p) / 100.0f; p += 2;
+    pvt->speed = sys_get_le16(p) / 100.0f; p += 2;
+    pvt->heading = sys_get_le16(p) / 100.0f; p += 2;
+    pvt->datetime.year = sys_get_le16(p); p += 2;
+    pvt->datetime.month = *p++;
+    pvt->datetime.day = *p++;
+    pvt->datetime.hour = *p++;
+    pvt->datetime.minute = *p++;
+    pvt->datetime.seconds = *p++;
+    pvt->datetime.ms = sys_get_le16(p); p += 2;
+    pvt->pdop = sys_get_le16(p) / 100.0f; p += 2;
+    pvt->hdop = sys_get_le16(p) / 100.0f; p += 2;
+
+    int count = MIN(*p++, NRF_MODEM_GNSS_MAX_SATELLITES);
+    count = MIN(count, (len - PVT_FIXED_SIZE) / PVT_SV_SIZE);
+
+    for (int i = 0; i < count; i++) {
+        struct nrf_modem_gnss_sv *sv = &pvt->sv[i];
+
+        sv->sv = *p++;
+        sv->signal = *p++;
+        sv->cn0 = sys_get_le16(p); p += 2;
+        sv->elevation = (int8_t)*p++;
+        sv->azimuth = (int16_t)sys_get_le16(p); p += 2;
+        sv->flags = *p++;
+    }
+}
+
+
+static void replay_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(replay_work, replay_work_handler);
+
+
+static void schedule_next() {
+    if (read_record(&replay_pos, &next_rec) != 0 ||
+        next_rec.type == GNSS_TRACE_START || next_rec.type == GNSS_TRACE_STOP) {
+        /* Session over, the receiver goes quiet like under a roof */
+        printk("GNSS replay: end of session\n");
+        return;
+    }
+
+    uint32_t delay = next_rec.time - last_time;
+    if (CONFIG_GNSS_TRACE_REPLAY_SPEED > 0) {
+        delay /= CONFIG_GNSS_TRACE_REPLAY_SPEED;
+    } else {
+        delay = 0;
+    }
+
+    last_time = next_rec.time;
+    k_work_schedule(&replay_work, K_MSEC(delay));
+}
+
+
+static void replay_work_handler(struct k_work *work) {
+    if (!replay_running || source_read(next_rec.payload, rec_buf, next_rec.len) != 0) {
+        return;
+    }
+
+    if (next_rec.type == GNSS_TRACE_PVT) {
+        decode_pvt(rec_buf, next_rec.len, &replay_pvt);
+
+        if (!replay_fixed && (replay_pvt.flags & NRF_MODEM_GNSS_PVT_FLAG_FIX_VALID)) {
+            replay_fixed = true;
+            printk("GNSS replay: recorded fix after %u ms\n", next_rec.time - session_time);
+        }
+        replay_handler(NRF_MODEM_GNSS_EVT_PVT);
+    } else if (next_rec.type == GNSS_TRACE_NMEA) {
+        memcpy(replay_nmea.nmea_str, rec_buf, next_rec.len);
+        replay_nmea.nmea_str[MIN(next_rec.len, sizeof(replay_nmea.nmea_str) - 1)] = '\0';
+        replay_handler(NRF_MODEM_GNSS_EVT_NMEA);
+    }
+
+    schedule_next();
+}
+
+
+int gnss_trace_replay_init(nrf_modem_gnss_event_handler_type_t handler) {
+    uint8_t hdr[GNSS_TRACE_HDR_SIZE];
+
+    int err = source_init();
+    if (err) {
+        return err;
+    }
+
+    if (source_read(0, hdr, sizeof(hdr)) != 0 ||
+        sys_get_le32(hdr) != GNSS_TRACE_MAGIC || hdr[4] != GNSS_TRACE_VERSION) {
+        printk("GNSS replay: no trace\n");
+        return -ENOENT;
+    }
+
+    replay_handler = handler;
+    replay_pos = GNSS_TRACE_HDR_SIZE;
+    return 0;
+}
+
+
+int32_t gnss_trace_replay_start(void) {
+    struct trace_record rec;
+    bool wrapped = false;
+
+    if (!replay_handler) {
+        return -ENOENT;
+    }
+
+    /* Next session, from the start again after the last one */
+    while (1) {
+        if (read_record(&replay_pos, &rec) != 0) {
+            if (wrapped) {
+                return -ENOENT;
+            }
+            wrapped = true;
+            replay_pos = GNSS_TRACE_HDR_SIZE;
+            continue;
+        }
+        if (rec.type == GNSS_TRACE_START) {
+            break;
+        }
+    }
+
+    printk("GNSS replay: session at %u ms, %ux speed\n", rec.time,
+        CONFIG_GNSS_TRACE_REPLAY_SPEED);
+
+    session_time = rec.time;
+    last_time = rec.time;
+    replay_fixed = false;
+    replay_running = true;
+    schedule_next();
+
+    return 0;
+}
+
+
+int32_t gnss_trace_replay_stop(void) {
+    replay_running = false;
+    k_work_cancel_delayable(&replay_work);
+    return 0;
+}
+
+
+int32_t gnss_trace_replay_read(void *buf, int32_t buf_len, int type) {
+    if (type == NRF_MODEM_GNSS_DATA_PVT && buf_len >= sizeof(replay_pvt)) {
+        memcpy(buf, &replay_pvt, sizeof(replay_pvt));
+        return 0;
+    }
+    if (type == NRF_MODEM_GNSS_DATA_NMEA && buf_len >= sizeof(replay_nmea)) {
+        memcpy(buf, &replay_nmea, sizeof(replay_nmea));
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+#endif /* CONFIG_GNSS_TRACE_REPLAY */
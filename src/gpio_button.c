@@ -10,9 +10,8 @@
 #include <drivers/gpio.h>
 
 #include "gpio_button.h"
-#include "gpio_led.h"
-#include "gps_location.h"
-#include "display_ssd16xx.h"
+#include "events.h"
+#include "power_mgmt.h"
 
 
 
@@ -26,16 +25,71 @@
 static const struct gpio_dt_spec button = GPIO_DT_SPEC_GET_OR(SW0_NODE, gpios, {0});
 static struct gpio_callback button_cb_data;
 
-void gpio_work_handler(struct k_work *work) {
+/* The level is read this long after an edge, once contact bounce has
+   settled */
+#define DEBOUNCE_MS 30
+
+static bool held;
+static bool long_press_sent;
+
+
+static void publish_press(bool long_press) {
     printk("Button pressed! :)\n");
-    gpio_led_on_off(0);
-    gps_request_coordinates();
+
+    struct button_evt *evt = bus_alloc(&button_chan);
+    if (!evt) {
+        printk("Button event dropped\n");
+        return;
+    }
+
+    evt->timestamp = k_uptime_get();
+    evt->long_press = long_press;
+    bus_publish(evt);
+}
+
+/* Both run on the system work queue, so a release is handled either
+   before the long press fires or after it */
+void long_press_handler(struct k_work *work) {
+    long_press_sent = true;
+    publish_press(true);
 }
 
-K_WORK_DELAYABLE_DEFINE(gpio_work, gpio_work_handler);
+K_WORK_DELAYABLE_DEFINE(long_press_work, long_press_handler);
+
+void settle_handler(struct k_work *work) {
+    bool pressed = gpio_pin_get_dt(&button) > 0;
+
+    /* A tap shorter than the window, or bounce that ended where it
+       started, changes nothing */
+    if (pressed == held) {
+        return;
+    }
+    held = pressed;
+
+    if (pressed) {
+        /* Timed from the edge, not from when it settled */
+        k_work_schedule(&long_press_work,
+            K_MSEC(MAX(CONFIG_BUTTON_LONG_PRESS_MS - DEBOUNCE_MS, 0)));
+    } else {
+        k_work_cancel_delayable(&long_press_work);
+        if (!long_press_sent) {
+            publish_press(false);
+        }
+        long_press_sent = false;
+    }
+}
+
+K_WORK_DELAYABLE_DEFINE(settle_work, settle_handler);
 
 void button_pressed(const struct device *dev, struct gpio_callback *cb, uint32_t pins) {
-    k_work_schedule(&gpio_work, K_MSEC(300));
+    if (!held) {
+        /* Resume the display and console while the press is timed */
+        power_mgmt_wake();
+    }
+
+    /* Later edges in the window do not move the read, it is already
+       scheduled */
+    k_work_schedule(&settle_work, K_MSEC(DEBOUNCE_MS));
 }
 
 
@@ -53,7 +107,8 @@ void gpio_button_init(void) {
         return;
     }
 
-    ret = gpio_pin_interrupt_configure_dt(&button, GPIO_INT_EDGE_TO_ACTIVE);
+    /* Presses are classified by how long they are held */
+    ret = gpio_pin_interrupt_configure_dt(&button, GPIO_INT_EDGE_BOTH);
     if (ret != 0) {
         printk("Error %d: failed to configure interrupt on %s pin %d\n", ret, button.port->name, button.pin);
         return;
@@ -8,6 +8,9 @@
 #include <device.h>
 #include <drivers/gpio.h>
 
+#include "gpio_led.h"
+#include "events.h"
+
 /* The devicetree node identifier for the "led2" alias (blue LED). */
 #define LED2_NODE DT_ALIAS(led2)
 
@@ -35,7 +38,7 @@ void gpio_led_init()
 		return;
 	}
 
-	ret = gpio_pin_configure(dev, PIN, GPIO_OUTPUT_ACTIVE | FLAGS);
+	ret = gpio_pin_configure(dev, PIN, GPIO_OUTPUT_INACTIVE | FLAGS);
 	if (ret < 0) {
 		return;
 	}
@@ -49,4 +52,50 @@ void gpio_led_on_off(int on) {
 }
 
 
+static void led_off_handler(struct k_work *work)
+{
+	gpio_led_on_off(0);
+}
+
+K_WORK_DELAYABLE_DEFINE(led_off_work, led_off_handler);
+
+
+BUS_SUBSCRIBER_DEFINE(led_sub, 4);
+
+static void led_thread(void)
+{
+	const struct bus_channel *chan;
+	int64_t last_flash = 0;
+
+	bus_subscribe(&button_chan, &led_sub);
+	bus_subscribe(&gnss_status_chan, &led_sub);
+
+	while (1) {
+		const void *msg = bus_receive(&led_sub, &chan, K_FOREVER);
+		int64_t now = k_uptime_get();
+
+		if (chan == &gnss_status_chan) {
+			const struct gnss_status_evt *status = msg;
+
+			/* A short flash every so often while searching rather
+			   than a toggle on every PVT, off once there is a fix */
+			if (status->fix) {
+				k_work_cancel_delayable(&led_off_work);
+				gpio_led_on_off(0);
+			} else if (last_flash == 0 ||
+				   now - last_flash >= CONFIG_LED_BLINK_INTERVAL_MS) {
+				last_flash = now;
+				gpio_led_on_off(1);
+				k_work_reschedule(&led_off_work, K_MSEC(CONFIG_LED_FLASH_MS));
+			}
+		} else if (chan == &button_chan) {
+			k_work_cancel_delayable(&led_off_work);
+			gpio_led_on_off(0);
+		}
+
+		bus_release(msg);
+	}
+}
 
+K_THREAD_DEFINE(led_tid, 512, led_thread, NULL, NULL, NULL,
+		CONFIG_LED_THREAD_PRIORITY, 0, 0);
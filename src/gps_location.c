@@ -7,45 +7,299 @@
 #include <zephyr.h>
 #include <nrf_modem_gnss.h>
 #include <string.h>
+#include <math.h>
+
+#if defined(CONFIG_GPS_SAMPLE_NMEA_ONLY)
+#include <device.h>
+#include <drivers/uart.h>
+#include <sys/ring_buffer.h>
+#endif
 
 #include "gps_location.h"
-#include "mqtt_service.h"
-#include "gpio_led.h"
+#include "gnss_trace.h"
+#include "telemetry.h"
+#include "events.h"
+#include "power_mgmt.h"
+
+#define EARTH_RADIUS_M 6371000.0
+#define DEG_TO_RAD     (3.14159265358979323846 / 180.0)
 
+/* A replayed trace stands in for the receiver */
+#if defined(CONFIG_GNSS_TRACE_REPLAY)
+#define GNSS_START()              gnss_trace_replay_start()
+#define GNSS_STOP()               gnss_trace_replay_stop()
+#define GNSS_READ(buf, len, type) gnss_trace_replay_read(buf, len, type)
+#else
+#define GNSS_START()              nrf_modem_gnss_start()
+#define GNSS_STOP()               nrf_modem_gnss_stop()
+#define GNSS_READ(buf, len, type) nrf_modem_gnss_read(buf, len, type)
+#endif
 
+
+/* Only touched by the GNSS handler, the thread gets a copy of what it
+   needs in gnss_status_evt */
 static struct nrf_modem_gnss_pvt_data_frame last_pvt;
+static struct nrf_modem_gnss_nmea_data_frame last_nmea;
 static volatile bool gnss_blocked;
 
+/* Set when the running fix was requested by the user, cleared for
+   fixes started by the tracking timer. */
+static bool user_request;
+static bool gnss_running;
+static int64_t gnss_start_time;
 
-void gps_work_handler(struct k_work *work) {
+/* Uptime of the next tracking fix, 0 when not tracking */
+static int64_t next_track_fix;
 
-    printk("Getting GNSS data...\n");
-    double latitude = last_pvt.latitude;
-    double longitude = last_pvt.longitude;
+/* Location weather was last requested for */
+static bool anchor_valid;
+static double anchor_latitude;
+static double anchor_longitude;
+
+/* Statistics */
+static uint32_t gnss_on_time_ms;
+static uint32_t uplinks_sent;
+static uint32_t uplinks_saved;
+
+
+#if defined(CONFIG_GPS_SAMPLE_NMEA_ONLY)
+
+/* The console carries nothing but NMEA sentences, printk and stdout
+   are turned off in nmea_only.conf. The GNSS handler queues sentences
+   and the NMEA thread writes them out, holding the console only while
+   it does. */
+static const struct device *nmea_uart = DEVICE_DT_GET(DT_CHOSEN(zephyr_console));
 
-    int err = publish_location(latitude, longitude);
-    if (err != 0) {
-        printk("Could not publish location\n");
+RING_BUF_DECLARE(nmea_ring, CONFIG_GPS_SAMPLE_NMEA_BUFFER_SIZE);
+static struct k_spinlock nmea_lock;
+K_SEM_DEFINE(nmea_sem, 0, 1);
+
+
+static void nmea_queue(const char *sentence) {
+    size_t len = strlen(sentence);
+
+    /* Whole sentences only, a cut one would confuse NMEA tools. There
+       is no console left to report dropped ones on. */
+    k_spinlock_key_t key = k_spin_lock(&nmea_lock);
+    if (ring_buf_space_get(&nmea_ring) >= len) {
+        ring_buf_put(&nmea_ring, sentence, len);
     }
+    k_spin_unlock(&nmea_lock, key);
 
+    k_sem_give(&nmea_sem);
 }
 
-K_WORK_DEFINE(gps_work, gps_work_handler);
 
-void gps_request_coordinates() {
-    if (nrf_modem_gnss_start() != 0) {
+static void nmea_thread(void) {
+    uint8_t chunk[64];
+    uint32_t n;
+
+    while (1) {
+        k_sem_take(&nmea_sem, K_FOREVER);
+
+        power_mgmt_get(POWER_CONSOLE);
+        while ((n = ring_buf_get(&nmea_ring, chunk, sizeof(chunk))) > 0) {
+            for (uint32_t i = 0; i < n; i++) {
+                uart_poll_out(nmea_uart, chunk[i]);
+            }
+        }
+        power_mgmt_put(POWER_CONSOLE);
+    }
+}
+
+K_THREAD_DEFINE(nmea_tid, CONFIG_GPS_SAMPLE_NMEA_THREAD_STACK_SIZE, nmea_thread,
+        NULL, NULL, NULL, CONFIG_GPS_SAMPLE_NMEA_THREAD_PRIORITY, 0, 0);
+
+#endif
+
+
+static int gnss_start(bool priority) {
+    if (GNSS_START() != 0) {
         printk("Failed to start GNSS\n");
+        return -EIO;
+    }
+
+    gnss_running = true;
+    gnss_start_time = k_uptime_get();
+    gnss_trace_record_session(true);
+    telemetry_gnss_start();
+
+    if (priority && !IS_ENABLED(CONFIG_GNSS_TRACE_REPLAY)) {
+        int err = nrf_modem_gnss_prio_mode_enable();
+        if (err != 0) {
+            printk("priority mode error\n");
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static void gnss_stop() {
+    if (!gnss_running) {
         return;
     }
 
-    int err = nrf_modem_gnss_prio_mode_enable();
-    if (err != 0) {
-        printk("priority mode error\n");
+    GNSS_STOP();
+    gnss_running = false;
+    gnss_trace_record_session(false);
+    gnss_on_time_ms += (uint32_t)(k_uptime_get() - gnss_start_time);
+}
+
+
+#if defined(CONFIG_GPS_ADAPTIVE_TRACKING)
+
+static void local_offset(double latitude, double longitude, double *east, double *north) {
+    /* Equirectangular approximation, good to well below a meter
+       over the few kilometers the refresh distance covers. */
+    double mean_lat = (latitude + anchor_latitude) / 2.0 * DEG_TO_RAD;
+
+    *east = (longitude - anchor_longitude) * DEG_TO_RAD * cos(mean_lat) * EARTH_RADIUS_M;
+    *north = (latitude - anchor_latitude) * DEG_TO_RAD * EARTH_RADIUS_M;
+}
+
+static uint32_t next_fix_interval(const struct gnss_status_evt *pvt) {
+    /* Find the time t at which the position predicted from the current
+       velocity, p + v*t, leaves the refresh circle around the anchor:
+       |p + v*t| = D, solved for the positive root. */
+    double px, py;
+    double heading = pvt->heading * DEG_TO_RAD;
+    double vx = pvt->speed * sin(heading);
+    double vy = pvt->speed * cos(heading);
+    double radius = CONFIG_GPS_REFRESH_DISTANCE_M;
+
+    /* Without an anchor the offset would be from 0,0 */
+    if (!anchor_valid) {
+        return CONFIG_GPS_TRACKING_MIN_INTERVAL_S;
+    }
+
+    local_offset(pvt->latitude, pvt->longitude, &px, &py);
+
+    double a = vx * vx + vy * vy;
+    double b = 2.0 * (px * vx + py * vy);
+    double c = px * px + py * py - radius * radius;
+
+    if (a <= 0.0) {
+        return CONFIG_GPS_TRACKING_MAX_INTERVAL_S;
+    }
+
+    /* No root when the fix is already outside the circle and not
+       heading back into it */
+    double discriminant = b * b - 4.0 * a * c;
+    if (discriminant < 0.0) {
+        return CONFIG_GPS_TRACKING_MIN_INTERVAL_S;
+    }
+
+    double t = (-b + sqrt(discriminant)) / (2.0 * a);
+
+    /* Written so that NaN takes the minimum too */
+    if (!(t >= CONFIG_GPS_TRACKING_MIN_INTERVAL_S)) {
+        return CONFIG_GPS_TRACKING_MIN_INTERVAL_S;
+    }
+    if (t > CONFIG_GPS_TRACKING_MAX_INTERVAL_S) {
+        return CONFIG_GPS_TRACKING_MAX_INTERVAL_S;
+    }
+    return (uint32_t)t;
+}
+
+static bool moved_enough(double latitude, double longitude) {
+    double east, north;
+
+    if (!anchor_valid) {
+        return true;
+    }
+
+    local_offset(latitude, longitude, &east, &north);
+    return sqrt(east * east + north * north) >= CONFIG_GPS_REFRESH_DISTANCE_M;
+}
+
+static void schedule_tracking(const struct gnss_status_evt *pvt) {
+    if (pvt->speed * 100.0f < CONFIG_GPS_STATIONARY_SPEED_CM_S) {
+        printk("Stationary, GNSS stopped until next button press\n");
+        next_track_fix = 0;
         return;
     }
+
+    uint32_t interval = next_fix_interval(pvt);
+    printk("Moving %d.%01d m/s heading %d, next fix in %u s\n",
+        (int)pvt->speed, (int)(pvt->speed * 10.0f) % 10, (int)pvt->heading, interval);
+    next_track_fix = k_uptime_get() + interval * 1000LL;
+}
+
+#else
+
+static bool moved_enough(double latitude, double longitude) {
+    return true;
 }
 
-static void print_satellite_stats(struct nrf_modem_gnss_pvt_data_frame *pvt_data)
+static void schedule_tracking(const struct gnss_status_evt *pvt) {
+}
+
+#endif /* CONFIG_GPS_ADAPTIVE_TRACKING */
+
+
+static void handle_fix(const struct gnss_status_evt *pvt) {
+
+    printk("Getting GNSS data...\n");
+
+    uint32_t ttff = (uint32_t)(k_uptime_get() - gnss_start_time);
+    printk("Fix after %u ms\n", ttff);
+    telemetry_gnss_fix(ttff, pvt->in_fix);
+
+    gnss_stop();
+
+    if (user_request || moved_enough(pvt->latitude, pvt->longitude)) {
+        struct location_evt *evt = bus_alloc(&location_chan);
+        if (!evt) {
+            printk("Could not publish location\n");
+        } else {
+            evt->latitude = pvt->latitude;
+            evt->longitude = pvt->longitude;
+            evt->user_request = user_request;
+            bus_publish(evt);
+
+            anchor_valid = true;
+            anchor_latitude = pvt->latitude;
+            anchor_longitude = pvt->longitude;
+            uplinks_sent++;
+        }
+    } else {
+        uplinks_saved++;
+    }
+
+    /* Answered, later tracking fixes are not the user's */
+    user_request = false;
+
+    printk("GNSS on-time: %u ms, uplinks sent: %u, saved: %u\n",
+        gnss_on_time_ms, uplinks_sent, uplinks_saved);
+
+    schedule_tracking(pvt);
+}
+
+void gps_request_coordinates() {
+    if (gnss_running) {
+        /* A tracking fix is already underway, let it serve the user */
+        user_request = true;
+        return;
+    }
+
+    user_request = true;
+    gnss_start(true);
+}
+
+static void start_tracking_fix() {
+    next_track_fix = 0;
+    if (gnss_running) {
+        return;
+    }
+
+    printk("Tracking fix\n");
+    user_request = false;
+    gnss_start(false);
+}
+
+static void print_satellite_stats(struct nrf_modem_gnss_pvt_data_frame *pvt_data,
+				  struct gnss_status_evt *status)
 {
 	uint8_t tracked   = 0;
 	uint8_t in_fix    = 0;
@@ -65,27 +319,55 @@ static void print_satellite_stats(struct nrf_modem_gnss_pvt_data_frame *pvt_data
 		}
 	}
 
-	printk("Tracking: %d Using: %d Unhealthy: %d\n", tracked, in_fix, unhealthy);
+	if (!status->fix && !IS_ENABLED(CONFIG_GPS_SAMPLE_NMEA_ONLY)) {
+		printk("Tracking: %d Using: %d Unhealthy: %d\n", tracked, in_fix, unhealthy);
+	}
+
+	status->tracked = tracked;
+	status->in_fix = in_fix;
+	status->unhealthy = unhealthy;
 }
 
 
 static void gnss_event_handler(int event) {
     int retval;
 
-    static int count = 0;
+    struct gnss_status_evt *status;
 
     switch (event)
     {
     case NRF_MODEM_GNSS_EVT_PVT:
-        count++;
-        retval = nrf_modem_gnss_read(&last_pvt, sizeof(last_pvt), NRF_MODEM_GNSS_DATA_PVT);
-        if (retval == 0 && (last_pvt.flags & NRF_MODEM_GNSS_PVT_FLAG_FIX_VALID)) {
-            k_work_submit(&gps_work);
-            gpio_led_on_off(0);
-            return;
+        retval = GNSS_READ(&last_pvt, sizeof(last_pvt), NRF_MODEM_GNSS_DATA_PVT);
+        if (retval != 0) {
+            break;
+        }
+        gnss_trace_record_pvt(&last_pvt);
+        telemetry_gnss_pvt(&last_pvt);
+
+        status = bus_alloc(&gnss_status_chan);
+        if (!status) {
+            break;
         }
-        print_satellite_stats(&last_pvt);
-        gpio_led_on_off(count%2);
+
+        status->fix = last_pvt.flags & NRF_MODEM_GNSS_PVT_FLAG_FIX_VALID;
+        status->latitude = last_pvt.latitude;
+        status->longitude = last_pvt.longitude;
+        status->speed = last_pvt.speed;
+        status->heading = last_pvt.heading;
+        print_satellite_stats(&last_pvt, status);
+        bus_publish(status);
+        break;
+
+    case NRF_MODEM_GNSS_EVT_NMEA:
+        retval = GNSS_READ(&last_nmea, sizeof(last_nmea), NRF_MODEM_GNSS_DATA_NMEA);
+        if (retval != 0) {
+            break;
+        }
+        gnss_trace_record_nmea(&last_nmea);
+
+#if defined(CONFIG_GPS_SAMPLE_NMEA_ONLY)
+        nmea_queue(last_nmea.nmea_str);
+#endif
         break;
     
     case NRF_MODEM_GNSS_EVT_BLOCKED:
@@ -103,6 +385,13 @@ static void gnss_event_handler(int event) {
 
 void gps_init() {
 
+#if defined(CONFIG_GNSS_TRACE_REPLAY)
+    if (gnss_trace_replay_init(gnss_event_handler) != 0) {
+        printk("Failed to load GNSS trace\n");
+    }
+    return;
+#endif
+
     /* Initialize and configure GNSS */
     if (nrf_modem_gnss_init() != 0) {
         printk("Failed to initialize GNSS interface\n");
@@ -124,7 +413,57 @@ void gps_init() {
         return;
     }
 
+    if (IS_ENABLED(CONFIG_GPS_SAMPLE_NMEA_ONLY) || IS_ENABLED(CONFIG_GNSS_TRACE_NMEA)) {
+        uint16_t nmea_mask = NRF_MODEM_GNSS_NMEA_RMC_MASK | NRF_MODEM_GNSS_NMEA_GGA_MASK |
+                             NRF_MODEM_GNSS_NMEA_GSA_MASK | NRF_MODEM_GNSS_NMEA_GSV_MASK;
+
+        if (nrf_modem_gnss_nmea_mask_set(nmea_mask) != 0) {
+            printk("Failed to set GNSS NMEA mask\n");
+            return;
+        }
+    }
+
     return;
 }
 
 
+BUS_SUBSCRIBER_DEFINE(gps_sub, 4);
+
+static void gps_thread(void) {
+    const struct bus_channel *chan;
+
+    bus_subscribe(&location_request_chan, &gps_sub);
+    bus_subscribe(&gnss_status_chan, &gps_sub);
+
+    while (1) {
+        k_timeout_t timeout = K_FOREVER;
+        if (next_track_fix) {
+            timeout = K_MSEC(MAX(next_track_fix - k_uptime_get(), 0));
+        }
+
+        const void *msg = bus_receive(&gps_sub, &chan, timeout);
+        if (!msg) {
+            start_tracking_fix();
+            continue;
+        }
+
+        if (chan == &location_request_chan) {
+            const struct location_request_evt *req = msg;
+            if (req->user_request) {
+                gps_request_coordinates();
+            } else {
+                start_tracking_fix();
+            }
+        } else if (chan == &gnss_status_chan) {
+            const struct gnss_status_evt *status = msg;
+            if (status->fix && gnss_running) {
+                handle_fix(status);
+            }
+        }
+
+        bus_release(msg);
+    }
+}
+
+K_THREAD_DEFINE(gps_tid, CONFIG_GPS_THREAD_STACK_SIZE, gps_thread, NULL, NULL, NULL,
+        CONFIG_GPS_THREAD_PRIORITY, 0, 0);
@@ -9,6 +9,7 @@
 #include "gps_location.h"
 #include "display_ssd16xx.h"
 #include "mqtt_service.h"
+#include "time_service.h"
 
 
 
@@ -17,6 +18,7 @@
 void main(void) {
 
     /* Initialize modules */
+    time_service_init();
     display_init();
     gpio_led_init();
     mqtt_service_init();
@@ -43,12 +45,10 @@ void main(void) {
     
     gps_init();
 
-    k_sleep(K_SECONDS(7));
-
     /* System ready to start */
     display_print_placeholder();
 
-
+    /* MQTT runs in its own thread and connects on the first location */
     mqtt_service_start();
     
 
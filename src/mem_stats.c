@@ -0,0 +1,210 @@
+#include <zephyr.h>
+#include <init.h>
+
+#include "mem_stats.h"
+#include "buf_pool.h"
+
+
+static void print_thread(const struct k_thread *thread, void *user_data) {
+    size_t size = thread->stack_info.size;
+    size_t unused = 0;
+
+    k_thread_stack_space_get(thread, &unused);
+    printk("  %-12s stack %u/%u used, %u%% headroom\n", k_thread_name_get((k_tid_t)thread),
+        (unsigned int)(size - unused), (unsigned int)size,
+        size ? (unsigned int)(unused * 100 / size) : 0);
+}
+
+
+#if defined(CONFIG_MEM_STATS_HEAPS)
+
+/* The kernel keeps no heap statistics, so the allocators are wrapped at
+   link time (see CMakeLists.txt) and the bytes asked for are counted.
+   Block headers and fragmentation come on top. */
+struct heap_track {
+    const char *name;
+    size_t size;
+    size_t used;
+    size_t peak;
+    uint32_t allocs;
+    uint32_t failures;
+    /* Allocations that did not fit in live[] and are not counted */
+    uint32_t untracked;
+    struct {
+        void *ptr;
+        size_t len;
+    } live[CONFIG_MEM_STATS_HEAP_LIVE_ALLOCS];
+};
+
+static struct k_spinlock track_lock;
+
+
+static void track_alloc(struct heap_track *h, void *ptr, size_t len) {
+    k_spinlock_key_t key = k_spin_lock(&track_lock);
+
+    if (!ptr) {
+        h->failures++;
+        k_spin_unlock(&track_lock, key);
+        return;
+    }
+
+    h->allocs++;
+    for (int i = 0; i < ARRAY_SIZE(h->live); i++) {
+        if (h->live[i].ptr == NULL) {
+            h->live[i].ptr = ptr;
+            h->live[i].len = len;
+            h->used += len;
+            h->peak = MAX(h->peak, h->used);
+            k_spin_unlock(&track_lock, key);
+            return;
+        }
+    }
+    h->untracked++;
+
+    k_spin_unlock(&track_lock, key);
+}
+
+
+/* Called before the block is given back, so it cannot be handed out
+   and tracked again while still in live[] */
+static void track_free(struct heap_track *h, void *ptr) {
+    k_spinlock_key_t key = k_spin_lock(&track_lock);
+
+    for (int i = 0; ptr && i < ARRAY_SIZE(h->live); i++) {
+        if (h->live[i].ptr == ptr) {
+            h->used -= h->live[i].len;
+            h->live[i].ptr = NULL;
+            break;
+        }
+    }
+
+    k_spin_unlock(&track_lock, key);
+}
+
+
+static void print_heap(struct heap_track *h) {
+    k_spinlock_key_t key = k_spin_lock(&track_lock);
+    size_t used = h->used;
+    size_t peak = h->peak;
+    uint32_t allocs = h->allocs;
+    uint32_t failures = h->failures;
+    uint32_t untracked = h->untracked;
+    k_spin_unlock(&track_lock, key);
+
+    printk("  %-12s heap %u/%u used, peak %u, %u allocs, %u failures",
+        h->name, (unsigned int)used, (unsigned int)h->size, (unsigned int)peak,
+        allocs, failures);
+    if (untracked) {
+        printk(", %u not counted", untracked);
+    }
+    printk("\n");
+}
+
+
+static struct heap_track system_heap = {
+    .name = "system",
+    .size = CONFIG_HEAP_MEM_POOL_SIZE,
+};
+
+void *__real_k_malloc(size_t size);
+void *__real_k_calloc(size_t nmemb, size_t size);
+void __real_k_free(void *ptr);
+
+void *__wrap_k_malloc(size_t size) {
+    void *ptr = __real_k_malloc(size);
+    track_alloc(&system_heap, ptr, size);
+    return ptr;
+}
+
+void *__wrap_k_calloc(size_t nmemb, size_t size) {
+    void *ptr = __real_k_calloc(nmemb, size);
+    track_alloc(&system_heap, ptr, nmemb * size);
+    return ptr;
+}
+
+void __wrap_k_free(void *ptr) {
+    track_free(&system_heap, ptr);
+    __real_k_free(ptr);
+}
+
+
+#if defined(CONFIG_NRF_MODEM_LIB)
+
+static struct heap_track modem_heap = {
+    .name = "modem lib",
+    .size = CONFIG_NRF_MODEM_LIB_HEAP_SIZE,
+};
+
+static struct heap_track modem_tx = {
+    .name = "modem tx",
+    .size = CONFIG_NRF_MODEM_LIB_SHMEM_TX_SIZE,
+};
+
+void *__real_nrf_modem_os_alloc(size_t bytes);
+void __real_nrf_modem_os_free(void *mem);
+void *__real_nrf_modem_os_shm_tx_alloc(size_t bytes);
+void __real_nrf_modem_os_shm_tx_free(void *mem);
+
+void *__wrap_nrf_modem_os_alloc(size_t bytes) {
+    void *ptr = __real_nrf_modem_os_alloc(bytes);
+    track_alloc(&modem_heap, ptr, bytes);
+    return ptr;
+}
+
+void __wrap_nrf_modem_os_free(void *mem) {
+    track_free(&modem_heap, mem);
+    __real_nrf_modem_os_free(mem);
+}
+
+void *__wrap_nrf_modem_os_shm_tx_alloc(size_t bytes) {
+    void *ptr = __real_nrf_modem_os_shm_tx_alloc(bytes);
+    track_alloc(&modem_tx, ptr, bytes);
+    return ptr;
+}
+
+void __wrap_nrf_modem_os_shm_tx_free(void *mem) {
+    track_free(&modem_tx, mem);
+    __real_nrf_modem_os_shm_tx_free(mem);
+}
+
+#endif /* CONFIG_NRF_MODEM_LIB */
+
+#endif /* CONFIG_MEM_STATS_HEAPS */
+
+
+void mem_stats_print() {
+    printk("Memory: threads\n");
+    k_thread_foreach(print_thread, NULL);
+
+#if defined(CONFIG_MEM_STATS_HEAPS)
+    printk("Memory: heaps, bytes requested\n");
+    print_heap(&system_heap);
+#if defined(CONFIG_NRF_MODEM_LIB)
+    print_heap(&modem_heap);
+    print_heap(&modem_tx);
+#endif
+#endif
+
+    buf_pool_print_stats();
+}
+
+
+#if CONFIG_MEM_STATS_INTERVAL_S > 0
+
+static void stats_work_handler(struct k_work *work);
+
+K_WORK_DELAYABLE_DEFINE(stats_work, stats_work_handler);
+
+static void stats_work_handler(struct k_work *work) {
+    mem_stats_print();
+    k_work_schedule(&stats_work, K_SECONDS(CONFIG_MEM_STATS_INTERVAL_S));
+}
+
+static int stats_init(const struct device *dev) {
+    k_work_schedule(&stats_work, K_SECONDS(CONFIG_MEM_STATS_INTERVAL_S));
+    return 0;
+}
+
+SYS_INIT(stats_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+#endif
@@ -16,30 +16,42 @@
 #include <modem/modem_key_mgmt.h>
 #include <logging/log.h>
 #include <data/jwt.h>
-#include <date_time.h>
+#include <downlink_codec.h>
 
 #include "mqtt_service.h"
 #include "certificates.h"
 #include "keys.h"
-#include "gps_location.h"
-#include "display_ssd16xx.h"
+#include "events.h"
+#include "uplink_sched.h"
+#include "fota_delta.h"
+#include "time_service.h"
+#include "buf_pool.h"
+#include "telemetry.h"
 
 #define PRIMARY_SEC_TAG 10
 #define BACKUP_SEC_TAG  11
 
+/* Longest JWT lifetime IoT Core accepts */
+#define JWT_MAX_LIFETIME_S (24 * 3600)
+#define JWT_BUF_SIZE 256
 
+BUILD_ASSERT(CONFIG_BUF_POOL_BLOCK_SIZE >= JWT_BUF_SIZE, "Network buffers must hold the JWT");
+#if defined(CONFIG_FOTA_DELTA)
+BUILD_ASSERT(CONFIG_BUF_POOL_BLOCK_SIZE >= FOTA_CHUNK_HDR_SIZE + CONFIG_FOTA_CHUNK_SIZE,
+             "Network buffers must hold a FOTA chunk");
 
-K_SEM_DEFINE(time_sem, 0, 1);
-K_SEM_DEFINE(connect_sem, 0, 1);
-K_SEM_DEFINE(tx_sem, 0, 1);
+static int fota_request_next(struct mqtt_client *client);
+#endif
+
+
+/* Locations to publish and FOTA progress, drained by the uplink thread */
+BUS_SUBSCRIBER_DEFINE(mqtt_sub, 4);
 
 
 // Buffers for MQTT client
 static uint8_t rx_buffer[CONFIG_MQTT_MESSAGE_BUFFER_SIZE];
 static uint8_t tx_buffer[CONFIG_MQTT_MESSAGE_BUFFER_SIZE];
-static uint8_t payload_buf[CONFIG_MQTT_PAYLOAD_BUFFER_SIZE];
-static uint8_t msg_id_buf[11];
-static uint8_t jwt_buf[256];
+static uint16_t request_id;
 
 // MQTT client context
 static struct mqtt_client client_ctx;
@@ -50,7 +62,127 @@ static struct sockaddr_storage broker;
 // File descrciptor
 static struct pollfd fds;
 
-bool connected = false;
+static bool connected = false;
+
+/* Weather as last acknowledged, the base for delta updates. Its sequence
+   number goes out with every uplink so the cloud can tell. */
+static struct downlink_weather forecast;
+
+/* PSM timers granted by the network, reported to the cloud so it can
+   time forecast pushes to when the modem is reachable */
+static struct {
+    int tau;
+    int active_time;
+    bool report;
+} psm;
+
+/* Bytes of the last location request and the weather answering it,
+   with the acks both ways */
+static struct {
+    bool open;
+    uint32_t up;
+    uint32_t down;
+} round_trip;
+
+/* Deferrable locations wait here for a better link. Only the newest is
+   kept since it supersedes the ones before it. */
+static struct {
+    bool valid;
+    double latitude;
+    double longitude;
+    int64_t queued_at;
+} deferred;
+
+/* The socket thread sleeps in poll() until input or the keepalive is
+   due, the uplink thread in k_poll() until there is something to send.
+   nRF91 sockets are offloaded to the modem, so one thread cannot wait
+   for both. They take turns on the client with client_lock. */
+static K_MUTEX_DEFINE(client_lock);
+/* Raised when there is something to send other than bus messages */
+static struct k_poll_signal tx_signal = K_POLL_SIGNAL_INITIALIZER(tx_signal);
+/* Given on the first uplink, LTE stays off until then */
+static K_SEM_DEFINE(online, 0, 1);
+
+// Network threads
+K_THREAD_STACK_DEFINE(mqtt_stack, CONFIG_MQTT_THREAD_STACK_SIZE);
+static struct k_thread mqtt_thread_data;
+K_THREAD_STACK_DEFINE(mqtt_tx_stack, CONFIG_MQTT_TX_THREAD_STACK_SIZE);
+static struct k_thread mqtt_tx_thread_data;
+static struct mqtt_service_stats stats;
+
+
+/* MQTT bytes on the air, before TLS and TCP/IP. The library does not
+   count them, so they are worked out from the 3.1.1 packet layout. */
+#define MQTT_ACK_SIZE     4
+#define MQTT_PING_SIZE    2
+#define MQTT_CONNACK_SIZE 4
+
+/* A byte of packet type and flags, then the remaining length in 7-bit
+   groups */
+static uint32_t packet_size(uint32_t remaining) {
+    uint32_t size = 1 + remaining;
+
+    do {
+        size++;
+        remaining >>= 7;
+    } while (remaining > 0);
+
+    return size;
+}
+
+
+static uint32_t publish_size(const struct mqtt_publish_param *p) {
+    uint32_t packet_id = p->message.topic.qos > MQTT_QOS_0_AT_MOST_ONCE ? 2 : 0;
+    return packet_size(2 + p->message.topic.topic.size + packet_id + p->message.payload.len);
+}
+
+
+static uint32_t connect_size(const struct mqtt_client *client) {
+    /* Protocol name, level, flags and keepalive */
+    uint32_t remaining = 10 + 2 + client->client_id.size;
+
+    if (client->user_name) {
+        remaining += 2 + client->user_name->size;
+    }
+    if (client->password) {
+        remaining += 2 + client->password->size;
+    }
+
+    return packet_size(remaining);
+}
+
+
+static void account_tx(uint32_t bytes, uint32_t payload) {
+    stats.tx_bytes += bytes;
+    stats.tx_payload_bytes += payload;
+}
+
+
+static void account_rx(uint32_t bytes, uint32_t payload) {
+    stats.rx_bytes += bytes;
+    stats.rx_payload_bytes += payload;
+}
+
+
+static int publish(struct mqtt_client *client, const struct mqtt_publish_param *param) {
+    int err = mqtt_publish(client, param);
+    if (err == 0) {
+        account_tx(publish_size(param), param->message.payload.len);
+    }
+
+    return err;
+}
+
+
+static void send_puback(struct mqtt_client *client, uint16_t message_id) {
+    const struct mqtt_puback_param ack = {
+        .message_id = message_id
+    };
+
+    if (mqtt_publish_qos1_ack(client, &ack) == 0) {
+        account_tx(MQTT_ACK_SIZE, 0);
+    }
+}
 
 
 static int certificates_provision(void) {
@@ -78,21 +210,19 @@ static int certificates_provision(void) {
 }
 
 
-int publish_location(double latitude, double longitude) {
+static int publish_location(double latitude, double longitude) {
     struct mqtt_publish_param param;
     int err;
 
-    k_sem_give(&connect_sem);
-    k_sem_take(&tx_sem, K_FOREVER);
-
     param.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
     param.message.topic.topic.utf8 = CONFIG_MQTT_PUB_TOPIC;
     param.message.topic.topic.size = strlen(CONFIG_MQTT_PUB_TOPIC);
-    param.message_id = sys_rand32_get();
+    /* Nonzero, the cloud uses id 0 for forecasts it pushes */
+    param.message_id = sys_rand32_get() % UINT16_MAX + 1;
     param.dup_flag = 0;
     param.retain_flag = 0;
 
-    /* Format GPS coordinates to "latitude;longitude;msg_id" */
+    /* Format GPS coordinates to "latitude;longitude;msg_id;seq" */
     /* Assuming we only need 6 decimals' precision for coordinates.
        Latitude can have a value between +/- 90, and longitude
        can have a value between +/- 180. Since we convert to string,
@@ -101,57 +231,394 @@ int publish_location(double latitude, double longitude) {
        meaning we must account for 10 bytes for latitude + 11 bytes
        for longitude, as well as 1 byte for the semicolon that
        separates them. This amounts to 22 bytes.
-       The message ID buffer requires an additional 11 bytes.
-       For good measure we set the buffer size to be 64 bytes.
+       The message ID requires an additional 6 bytes and the
+       forecast sequence number 4 bytes. For good measure we set the buffer size to be 64 bytes.
     */
     char coordinates[64];
 
-    sprintf(msg_id_buf, "%d", param.message_id);
-    sprintf(coordinates, "%.6f;%.6f;%d", latitude, longitude, param.message_id);
+    request_id = param.message_id;
+    stats.last_publish_time = k_uptime_get();
+    sprintf(coordinates, "%.6f;%.6f;%u;%u", latitude, longitude,
+        param.message_id, forecast.seq);
     printk("Coordinates: %s\n", coordinates);
     param.message.payload.data = coordinates;
     param.message.payload.len = strlen(coordinates);
 
-    err = mqtt_publish(&client_ctx, &param);
+    err = publish(&client_ctx, &param);
     if (err != 0) {
         printk("MQTT publish error %d\n", err);
+        round_trip.open = false;
+        return err;
     }
 
-    k_sem_give(&tx_sem);
+    round_trip.open = true;
+    round_trip.up = publish_size(&param);
+    round_trip.down = 0;
+
     return err;
 }
 
 
+static int publish_psm() {
+    struct mqtt_publish_param param;
+    char report[24];
+
+    snprintf(report, sizeof(report), "%d;%d", psm.tau, psm.active_time);
+
+    param.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
+    param.message.topic.topic.utf8 = CONFIG_MQTT_PSM_TOPIC;
+    param.message.topic.topic.size = strlen(CONFIG_MQTT_PSM_TOPIC);
+    param.message.payload.data = report;
+    param.message.payload.len = strlen(report);
+    param.message_id = sys_rand32_get() % UINT16_MAX + 1;
+    param.dup_flag = 0;
+    param.retain_flag = 0;
+
+    int err = publish(&client_ctx, &param);
+    if (err != 0) {
+        printk("PSM report error %d\n", err);
+    }
+
+    return err;
+}
+
+
+#if defined(CONFIG_TELEMETRY)
+
+static void publish_telemetry() {
+    struct mqtt_publish_param param;
+    uint8_t summary[TELEMETRY_MSG_SIZE];
+
+    int len = telemetry_take(summary, sizeof(summary));
+    if (len <= 0) {
+        return;
+    }
+
+    param.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
+    param.message.topic.topic.utf8 = CONFIG_MQTT_TELEMETRY_TOPIC;
+    param.message.topic.topic.size = strlen(CONFIG_MQTT_TELEMETRY_TOPIC);
+    param.message.payload.data = summary;
+    param.message.payload.len = len;
+    param.message_id = sys_rand32_get() % UINT16_MAX + 1;
+    param.dup_flag = 0;
+    param.retain_flag = 0;
+
+    int err = publish(&client_ctx, &param);
+    if (err != 0) {
+        printk("Telemetry error %d\n", err);
+    }
+}
+
+#else
+
+static void publish_telemetry() {
+}
+
+#endif /* CONFIG_TELEMETRY */
+
+
+static void account_service_time(uint32_t start) {
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+    stats.max_service_us = MAX(stats.max_service_us, us);
+}
+
+
+static void send_location(double latitude, double longitude, enum uplink_priority prio) {
+    int err = publish_location(latitude, longitude);
+    if (err != 0) {
+        printk("Could not publish location\n");
+        return;
+    }
+
+    uplink_sched_transmitted(prio);
+}
+
+
+/* Called with client_lock held */
+static int publish_pending() {
+    const struct bus_channel *chan;
+    const struct location_evt *evt;
+    int sent = 0;
+
+    while ((evt = bus_receive(&mqtt_sub, &chan, K_NO_WAIT)) != NULL) {
+#if defined(CONFIG_FOTA_DELTA)
+        if (chan == &fota_chan) {
+            /* The last chunk has been applied */
+            sent += fota_request_next(&client_ctx);
+            bus_release(evt);
+            continue;
+        }
+#endif
+        if (evt->user_request) {
+            /* Urgent location also answers any deferred one */
+            deferred.valid = false;
+            send_location(evt->latitude, evt->longitude, UPLINK_URGENT);
+            sent++;
+
+            /* The radio is up for the user anyway */
+            publish_telemetry();
+        } else {
+            if (!deferred.valid) {
+                deferred.queued_at = k_uptime_get();
+            }
+            deferred.valid = true;
+            deferred.latitude = evt->latitude;
+            deferred.longitude = evt->longitude;
+        }
+        bus_release(evt);
+    }
+
+    if (deferred.valid && uplink_sched_ready(UPLINK_DEFERRABLE, deferred.queued_at)) {
+        deferred.valid = false;
+        send_location(deferred.latitude, deferred.longitude, UPLINK_DEFERRABLE);
+        sent++;
+    }
+
+    return sent;
+}
+
+
+/* How long the uplink thread may sleep before a deferred location has to
+   be looked at again. The link is evaluated at most once per interval. */
+static k_timeout_t deferred_wait() {
+    if (!deferred.valid) {
+        return K_FOREVER;
+    }
+
+    int64_t left = deferred.queued_at + CONFIG_UPLINK_DEFER_DEADLINE_S * 1000LL - k_uptime_get();
+
+    return K_MSEC(MAX(MIN(left, CONFIG_UPLINK_EVAL_INTERVAL_S * 1000LL), 0));
+}
+
+
 static int subscribe(void) {
-    struct mqtt_topic subscribe_topic = {
-        .topic = {
-            .utf8 = CONFIG_MQTT_SUB_TOPIC,
-            .size = strlen(CONFIG_MQTT_SUB_TOPIC)
+    struct mqtt_topic subscribe_topics[] = {
+        {
+            .topic = {
+                .utf8 = CONFIG_MQTT_SUB_TOPIC,
+                .size = strlen(CONFIG_MQTT_SUB_TOPIC)
+            },
+            .qos = MQTT_QOS_1_AT_LEAST_ONCE
+        },
+        {
+            .topic = {
+                .utf8 = CONFIG_MQTT_COMMAND_TOPIC,
+                .size = strlen(CONFIG_MQTT_COMMAND_TOPIC)
+            },
+            .qos = MQTT_QOS_1_AT_LEAST_ONCE
         },
-        .qos = MQTT_QOS_1_AT_LEAST_ONCE
     };
 
     const struct mqtt_subscription_list subscription_list = {
-        .list = &subscribe_topic,
-        .list_count = 1,
+        .list = subscribe_topics,
+        .list_count = ARRAY_SIZE(subscribe_topics),
         .message_id = 1234
     };
 
-    printk("Subscribing to %s\n", CONFIG_MQTT_SUB_TOPIC);
+    printk("Subscribing to %s and %s\n", CONFIG_MQTT_SUB_TOPIC, CONFIG_MQTT_COMMAND_TOPIC);
+
+    int err = mqtt_subscribe(&client_ctx, &subscription_list);
+    if (err == 0) {
+        /* Packet id, and length and QoS of each topic */
+        uint32_t remaining = 2;
+        for (int i = 0; i < ARRAY_SIZE(subscribe_topics); i++) {
+            remaining += 2 + subscribe_topics[i].topic.size + 1;
+        }
+        account_tx(packet_size(remaining), 0);
+    }
+
+    return err;
+}
+
+
+static bool topic_is(const struct mqtt_topic *topic, const char *name) {
+    return topic->topic.size == strlen(name) &&
+           memcmp(topic->topic.utf8, name, topic->topic.size) == 0;
+}
+
+
+#if defined(CONFIG_FOTA_DELTA)
+
+/* Returns the number of messages sent */
+static int fota_request_next(struct mqtt_client *client) {
+    struct mqtt_publish_param param;
+    char request[24];
+
+    int len = fota_delta_next_request(request, sizeof(request));
+    if (len <= 0) {
+        return 0;
+    }
+
+    param.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
+    param.message.topic.topic.utf8 = CONFIG_FOTA_PUB_TOPIC;
+    param.message.topic.topic.size = strlen(CONFIG_FOTA_PUB_TOPIC);
+    param.message.payload.data = request;
+    param.message.payload.len = len;
+    param.message_id = sys_rand32_get() % UINT16_MAX + 1;
+    param.dup_flag = 0;
+    param.retain_flag = 0;
+
+    int err = publish(client, &param);
+    if (err != 0) {
+        printk("FOTA request error %d\n", err);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/* Reads a payload there is no room for, so the stream stays in step */
+static int discard_payload(struct mqtt_client *client, size_t len) {
+    uint8_t scratch[32];
+
+    while (len > 0) {
+        size_t n = MIN(len, sizeof(scratch));
+        int err = mqtt_readall_publish_payload(client, scratch, n);
+        if (err < 0) {
+            return err;
+        }
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+/* Returns 0 once the chunk is queued for the FOTA thread, -EAGAIN if it
+   was dropped, or the read error after which the session is lost */
+static int fota_handle_publish(struct mqtt_client *client, const struct mqtt_publish_param *p) {
+    size_t len = p->message.payload.len;
+    int err;
+
+    uint8_t *buf = buf_pool_alloc(len, K_NO_WAIT);
+    if (!buf) {
+        printk("No buffer for FOTA chunk of %u bytes\n", (unsigned int)len);
+        err = discard_payload(client, len);
+        return err < 0 ? err : -EAGAIN;
+    }
+
+    err = mqtt_readall_publish_payload(client, buf, len);
+    if (err < 0) {
+        printk("FOTA chunk read failed: %d\n", err);
+        buf_pool_free(buf);
+        return err;
+    }
+
+    err = fota_delta_submit_chunk(buf, len);
+    if (err) {
+        /* A redelivery while the last chunk is still being written */
+        printk("FOTA busy, dropping chunk\n");
+        buf_pool_free(buf);
+        return -EAGAIN;
+    }
 
-    return mqtt_subscribe(&client_ctx, &subscription_list);
+    return 0;
 }
 
+#endif /* CONFIG_FOTA_DELTA */
+
 
-static int publish_get_payload(struct mqtt_client *client, size_t length) {
-    if (length > sizeof(payload_buf)) {
+/* On success the payload is in a pool buffer the caller frees */
+static int publish_get_payload(struct mqtt_client *client, size_t length, uint8_t **buf) {
+    if (length > CONFIG_BUF_POOL_BLOCK_SIZE) {
         return -EMSGSIZE;
     }
 
-    return mqtt_readall_publish_payload(client, payload_buf, length);
+    *buf = buf_pool_alloc(length, K_NO_WAIT);
+    if (!*buf) {
+        return -ENOMEM;
+    }
+
+    int err = mqtt_readall_publish_payload(client, *buf, length);
+    if (err < 0) {
+        buf_pool_free(*buf);
+    }
+
+    return err;
+}
+
+
+static void format_temperature(char *buf, size_t size, int16_t deci_c) {
+    int t = deci_c < 0 ? -deci_c : deci_c;
+    snprintf(buf, size, "%s%d.%d", deci_c < 0 ? "-" : "", t / 10, t % 10);
 }
 
 
+/* Returns whether this answered the last request */
+static bool handle_weather(const uint8_t *buf, size_t len) {
+    struct downlink_weather msg;
+
+    int err = downlink_weather_decode(buf, len, &msg);
+    if (err) {
+        printk("Could not decode weather: %d\n", err);
+        return false;
+    }
+
+    if (msg.flags & DOWNLINK_FLAG_DELTA) {
+        if (msg.base != forecast.seq || forecast.seq == 0) {
+            /* The next uplink carries our sequence number and
+               the cloud falls back to a full update */
+            printk("Delta against %u, have %u\n", msg.base, forecast.seq);
+            stats.baseline_misses++;
+            return false;
+        }
+        stats.delta_updates++;
+    } else {
+        stats.full_updates++;
+    }
+
+    /* Apply even stale responses, the cloud bases the next delta on it */
+    downlink_weather_apply(&forecast, &msg);
+
+    bool pushed = msg.msg_id == 0;
+
+    if (!pushed && msg.msg_id != request_id) {
+        /* Response to an older request, a newer one is on its way */
+        printk("%u not equal %u\n", msg.msg_id, request_id);
+        stats.stale_responses++;
+        return false;
+    }
+
+    struct weather_evt *w = bus_alloc(&forecast_chan);
+    if (!w) {
+        printk("Weather event dropped\n");
+        return !pushed;
+    }
+
+    strncpy(w->weather, forecast.status, sizeof(w->weather) - 1);
+    strncpy(w->icon_id, forecast.icon, sizeof(w->icon_id) - 1);
+    w->condition = forecast.condition;
+    format_temperature(w->temperature, sizeof(w->temperature), forecast.temperature);
+    strncpy(w->location, forecast.location, sizeof(w->location) - 1);
+    w->pushed = pushed;
+
+    w->hour_count = MIN(forecast.hours_count, FORECAST_HOURS);
+    for (int i = 0; i < w->hour_count; i++) {
+        w->hours[i].hour = forecast.hours[i].hour;
+        w->hours[i].night = forecast.hours[i].night;
+        w->hours[i].condition = forecast.hours[i].condition;
+        w->hours[i].temperature = forecast.hours[i].temperature;
+    }
+
+    w->day_count = MIN(forecast.days_count, FORECAST_DAYS);
+    for (int i = 0; i < w->day_count; i++) {
+        w->days[i].weekday = forecast.days[i].weekday;
+        w->days[i].condition = forecast.days[i].condition;
+        w->days[i].temp_min = forecast.days[i].temp_min;
+        w->days[i].temp_max = forecast.days[i].temp_max;
+    }
+    bus_publish(w);
+
+    if (pushed) {
+        stats.pushes++;
+    } else {
+        stats.redraws++;
+    }
+
+    return !pushed;
+}
+
 
 void mqtt_evt_handler(struct mqtt_client *client, const struct mqtt_evt *evt) {
 
@@ -164,48 +631,92 @@ void mqtt_evt_handler(struct mqtt_client *client, const struct mqtt_evt *evt) {
             break;
         }
         connected = true;
+        account_rx(MQTT_CONNACK_SIZE, 0);
+        /* Sends what queued up while offline */
+        k_poll_signal_raise(&tx_signal, 0);
         printk("MQTT client connected!\n");
+
+        /* A resumed session keeps what the broker queued while away.
+           Subscribing again is still needed, the session may predate
+           topics a new image added, and re-subscribing to a topic
+           does not drop what is queued on it. */
+        if (evt->param.connack.session_present_flag) {
+            printk("MQTT session resumed\n");
+            stats.sessions_resumed++;
+        }
         subscribe();
+#if defined(CONFIG_FOTA_DELTA)
+        /* Reaching the cloud proves the image, and resumes any
+           download interrupted by the disconnect. */
+        fota_delta_confirm_image();
+        fota_request_next(client);
+#endif
         break;
         
     case MQTT_EVT_DISCONNECT:
+        connected = false;
         printk("MQTT client disconnected %d\n", evt->result);
         break;
 
     case MQTT_EVT_PUBLISH: {
         const struct mqtt_publish_param *p = &evt->param.publish;
         printk("MQTT PUBLISH result: %d\n", evt->result);
-        err = publish_get_payload(client, p->message.payload.len);
+        account_rx(publish_size(p), p->message.payload.len);
+
+#if defined(CONFIG_FOTA_DELTA)
+        if (topic_is(&p->message.topic, CONFIG_FOTA_SUB_TOPIC)) {
+            err = fota_handle_publish(client, p);
+            if (err == 0 || err == -EAGAIN) {
+                /* A dropped chunk is acked too, so the broker does not
+                   redeliver a stale copy later. It is asked for again by
+                   offset once the FOTA thread is free. */
+                if (p->message.topic.qos == MQTT_QOS_1_AT_LEAST_ONCE) {
+                    send_puback(&client_ctx, p->message_id);
+                }
+                if (err == -EAGAIN) {
+                    fota_request_next(client);
+                }
+            } else {
+                printk("Disconnecting MQTT client...\n");
+                err = mqtt_disconnect(client);
+                if (err) {
+                    printk("Could not disconnect: %d\n", err);
+                }
+            }
+            break;
+        }
+#endif
 
-        if (p->message.topic.qos == MQTT_QOS_1_AT_LEAST_ONCE) {
-            const struct mqtt_puback_param ack = {
-                .message_id = p->message_id
-            };
+        uint8_t *payload = NULL;
+        err = publish_get_payload(client, p->message.payload.len, &payload);
 
-            /* Send acknowledgement */
-            mqtt_publish_qos1_ack(&client_ctx, &ack);
+        if (p->message.topic.qos == MQTT_QOS_1_AT_LEAST_ONCE) {
+            send_puback(&client_ctx, p->message_id);
         }
 
         if (err >= 0) {
-            payload_buf[p->message.payload.len] = '\0';
-            printk("Data received: %s\n", payload_buf);
-
-            char *msg_id = strtok(payload_buf, ";");
-            char *weather = strtok(NULL, ";");
-            char *icon_id = strtok(NULL, ";");
-            char *temperature = strtok(NULL, ";");
-            char *location = strtok(NULL, ";");
-
-            if (!weather || !icon_id || !temperature || !location) {
-                printk("Could not extract weather tokens\n");
-                return;
-            }
-
-            if (strcmp(msg_id_buf, msg_id) == 0) {
-                display_print_weather(weather, icon_id, temperature, location);
+            printk("Data received: %u bytes\n", p->message.payload.len);
+
+            if (topic_is(&p->message.topic, CONFIG_MQTT_WEATHER_TOPIC)) {
+                stats.weather_bytes += p->message.payload.len;
+                if (round_trip.open) {
+                    round_trip.down += publish_size(p);
+                    round_trip.up += p->message.topic.qos == MQTT_QOS_1_AT_LEAST_ONCE ? MQTT_ACK_SIZE : 0;
+                }
+                if (handle_weather(payload, p->message.payload.len) && round_trip.open) {
+                    round_trip.open = false;
+                    stats.round_trips++;
+                    stats.round_trip_up_bytes += round_trip.up;
+                    stats.round_trip_down_bytes += round_trip.down;
+                }
             } else {
-                printk("%s not equal %s", msg_id_buf, msg_id);
+                /* Config is redelivered on every connect. It no longer
+                   carries weather, so it is not drawn. */
+                stats.config_msgs++;
+                stats.config_bytes += p->message.payload.len;
+                printk("Config received, %u bytes\n", p->message.payload.len);
             }
+            buf_pool_free(payload);
 
         } else {
             printk("publish_get_payload failed: %d\n", err);
@@ -219,10 +730,14 @@ void mqtt_evt_handler(struct mqtt_client *client, const struct mqtt_evt *evt) {
     } break;
 
     case MQTT_EVT_PUBACK:
+        account_rx(MQTT_ACK_SIZE, 0);
         if (evt->result != 0) {
             printk("MQTT PUBACK error %d\n", evt->result);
             break;
         }
+        if (round_trip.open && evt->param.puback.message_id == request_id) {
+            round_trip.down += MQTT_ACK_SIZE;
+        }
         printk("PUBACK packet id: %u", evt->param.puback.message_id);
         break;
 
@@ -252,6 +767,8 @@ void mqtt_evt_handler(struct mqtt_client *client, const struct mqtt_evt *evt) {
         break;
 
     case MQTT_EVT_SUBACK:
+        /* Packet id and a return code for each of the two topics */
+        account_rx(packet_size(2 + 2), 0);
         if (evt->result != 0) {
             printk("MQTT SUBACK error %d\n", evt->result);
             break;
@@ -260,6 +777,9 @@ void mqtt_evt_handler(struct mqtt_client *client, const struct mqtt_evt *evt) {
         break;
 
     case MQTT_EVT_PINGRESP:
+        /* And the PINGREQ it answers */
+        account_tx(MQTT_PING_SIZE, 0);
+        account_rx(MQTT_PING_SIZE, 0);
         printk("PINGRESP packet\n");
         break;
 
@@ -319,20 +839,54 @@ static int broker_init(void) {
 }
 
 
-void gen_jwt() {
+/* Issue time and lifetime of a JWT, if the time is good enough to sign one */
+static bool jwt_time(int32_t *iat, int32_t *lifetime) {
+    struct time_estimate t;
+    if (time_service_now(&t) != 0) {
+        return false;
+    }
+
+    if (t.uncertainty_ms == TIME_UNCERTAINTY_UNBOUNDED) {
+        /* Only a lower bound, so the token gets the longest lifetime to
+           cover the time the device was off. If that was longer, the
+           broker turns it down and the reconnect has network time. */
+        *iat = t.unix_ms / 1000;
+        *lifetime = JWT_MAX_LIFETIME_S;
+    } else if (t.uncertainty_ms <= CONFIG_MQTT_JWT_MAX_SKEW_S * 1000U) {
+        /* Issued at the earliest the time can be, never in the future */
+        *iat = (t.unix_ms - t.uncertainty_ms) / 1000;
+        *lifetime = CONFIG_MQTT_JWT_LIFETIME_S;
+    } else {
+        return false;
+    }
+
+    if (stats.jwt_signed++ == 0) {
+        stats.first_jwt_ms = (uint32_t)k_uptime_get();
+        stats.first_jwt_source = t.source;
+    }
+    printk("Signing JWT with %s time\n", time_source_name(t.source));
+
+    return true;
+}
+
+
+size_t gen_jwt(uint8_t *buf, size_t size) {
     struct jwt_builder jwt;
-    jwt_init_builder(&jwt, jwt_buf, sizeof(jwt_buf));
+    jwt_init_builder(&jwt, buf, size);
 
-    int64_t time;
-    date_time_now(&time);
-    int32_t now = time / 1000;
+    int32_t iat, lifetime;
+    while (!jwt_time(&iat, &lifetime)) {
+        printk("Waiting for the time to sign a JWT\n");
+        time_service_wait(K_FOREVER);
+    }
 
-    jwt_add_payload(&jwt, now+3600, now, "wearebrews");
+    jwt_add_payload(&jwt, iat + lifetime, iat, "wearebrews");
 
     jwt_sign(&jwt, private_der, private_der_len);
     size_t len = jwt_payload_len(&jwt);
 
-    jwt_buf[len] = '\0';
+    buf[len] = '\0';
+    return len;
 }
 
 
@@ -348,8 +902,6 @@ static int client_init(struct mqtt_client *client) {
 		return err;
 	}
 
-    gen_jwt();
-
     static struct mqtt_utf8 username = MQTT_UTF8_LITERAL("stray");
     static struct mqtt_utf8 password;
 
@@ -359,8 +911,7 @@ static int client_init(struct mqtt_client *client) {
     client->client_id.utf8 = CONFIG_MQTT_CLIENT_ID;
     client->client_id.size = sizeof(CONFIG_MQTT_CLIENT_ID) - 1;
     client->password = &password;
-    client->password->size = strlen(jwt_buf);
-    client->password->utf8 = jwt_buf;
+    /* Signed before every connection attempt */
     client->user_name = &username;
     client->protocol_version = MQTT_VERSION_3_1_1;
 
@@ -404,11 +955,6 @@ static int fds_init(struct mqtt_client *client) {
 
 
 
-void date_time_evt_handler(const struct date_time_evt *evt) {
-    k_sem_give(&time_sem);
-}
-
-
 K_SEM_DEFINE(lte_ready, 0, 1);
 
 static void lte_lc_event_handler(const struct lte_lc_evt *const evt)
@@ -422,6 +968,15 @@ static void lte_lc_event_handler(const struct lte_lc_evt *const evt)
 		}
 		break;
 
+	case LTE_LC_EVT_PSM_UPDATE:
+		printk("PSM granted: TAU %d s, active time %d s\n",
+		       evt->psm_cfg.tau, evt->psm_cfg.active_time);
+		psm.tau = evt->psm_cfg.tau;
+		psm.active_time = evt->psm_cfg.active_time;
+		psm.report = true;
+		k_poll_signal_raise(&tx_signal, 0);
+		break;
+
 	default:
 		break;
 	}
@@ -435,13 +990,61 @@ int mqtt_service_init() {
         return err;
     }
 
+    bus_subscribe(&location_chan, &mqtt_sub);
+#if defined(CONFIG_FOTA_DELTA)
+    bus_subscribe(&fota_chan, &mqtt_sub);
+#endif
+
+    return 0;
+}
+
+/* Called with client_lock held after poll() returned. Returns an error
+   once the connection is lost. */
+static int service_socket(bool idle) {
+    uint32_t start = k_cycle_get_32();
+    int err;
+
+    stats.loops++;
+    if (idle) {
+        stats.idle_wakeups++;
+    }
+
+    err = mqtt_live(&client_ctx);
+    if ((err != 0) && (err != -EAGAIN)) {
+        printk("ERROR: mqtt_live: %d\n", err);
+        return err;
+    }
+
+    if ((fds.revents & POLLIN) == POLLIN) {
+        stats.rx_wakeups++;
+        err = mqtt_input(&client_ctx);
+        if (err != 0) {
+            printk("mqtt_input: %d\n", err);
+            return err;
+        }
+        account_service_time(start);
+    }
+
+    if ((fds.revents & POLLERR) == POLLERR) {
+        printk("POLLERR\n");
+        return -EIO;
+    }
+
+    if ((fds.revents & POLLNVAL) == POLLNVAL) {
+        printk("POLLNVAL\n");
+        return -EBADF;
+    }
+
     return 0;
 }
 
-void mqtt_service_start() {
-    k_sem_take(&connect_sem, K_FOREVER);
+
+static void mqtt_thread(void *p1, void *p2, void *p3) {
     int err;
 
+    /* Stay offline until there is a first location to publish */
+    k_sem_take(&online, K_FOREVER);
+
     lte_lc_register_handler(lte_lc_event_handler);
 
     err = lte_lc_func_mode_set(LTE_LC_FUNC_MODE_ACTIVATE_LTE);
@@ -456,9 +1059,9 @@ void mqtt_service_start() {
     uint32_t connect_attempt = 0;
     printk("Starting MQTT connection\n");
 
-    /* Sync time */
-    date_time_update_async(date_time_evt_handler);
-    k_sem_take(&time_sem, K_FOREVER);
+    /* Network time comes in the background, the JWT only waits for it
+       if there is no persisted time either */
+    time_service_start();
 
     err = client_init(&client_ctx);
     if (err != 0) {
@@ -468,10 +1071,31 @@ void mqtt_service_start() {
 
 do_connect:
     if (connect_attempt++ > 0) {
+        stats.reconnects++;
+        telemetry_reconnect();
         printk("Reconnecting in %d seconds...\n", CONFIG_MQTT_RECONNECT_DELAY_S);
         k_sleep(K_SECONDS(CONFIG_MQTT_RECONNECT_DELAY_S));
     }
+
+    /* A fresh token each time, the last one may have expired or been
+       signed with a worse time. It is only needed until mqtt_connect()
+       has encoded the CONNECT packet. */
+    uint8_t *jwt = buf_pool_alloc(JWT_BUF_SIZE, K_NO_WAIT);
+    if (!jwt) {
+        printk("No buffer for the JWT\n");
+        goto do_connect;
+    }
+    client_ctx.password->utf8 = jwt;
+    client_ctx.password->size = gen_jwt(jwt, JWT_BUF_SIZE);
+
+    k_mutex_lock(&client_lock, K_FOREVER);
     err = mqtt_connect(&client_ctx);
+    if (err == 0) {
+        account_tx(connect_size(&client_ctx), 0);
+    }
+    k_mutex_unlock(&client_lock);
+    buf_pool_free(jwt);
+    client_ctx.password->utf8 = NULL;
     if (err != 0) {
         printk("mqtt_connect %d\n", err);
         goto do_connect;
@@ -485,51 +1109,132 @@ do_connect:
     
     printk("MQTT init complete\n");
     while(1) {
-        bool shared = false;
-        if (connected) {
-            k_sem_give(&tx_sem);
-            shared = true;
-        }
-        err = poll(&fds, 1, mqtt_keepalive_time_left(&client_ctx));
-		if (err < 0) {
-		    printk("poll: %d\n", err);
-		    break;
-		}
-        if (shared) {
-            k_sem_take(&tx_sem, K_FOREVER);
+        /* Wake up on socket input or the keepalive deadline, uplinks
+           are sent by the uplink thread meanwhile */
+        k_mutex_lock(&client_lock, K_FOREVER);
+        int timeout = mqtt_keepalive_time_left(&client_ctx);
+        k_mutex_unlock(&client_lock);
+
+        err = poll(&fds, 1, timeout);
+        if (err < 0) {
+            printk("poll: %d\n", err);
+            break;
         }
-        
-		err = mqtt_live(&client_ctx);
-		if ((err != 0) && (err != -EAGAIN)) {
-			printk("ERROR: mqtt_live: %d\n", err);
-			break;
-		}
-
-		if ((fds.revents & POLLIN) == POLLIN) {
-			err = mqtt_input(&client_ctx);
-			if (err != 0) {
-				printk("mqtt_input: %d\n", err);
-				break;
-			}
-		}
-
-		if ((fds.revents & POLLERR) == POLLERR) {
-			printk("POLLERR\n");
-			break;
-		}
-
-		if ((fds.revents & POLLNVAL) == POLLNVAL) {
-			printk("POLLNVAL\n");
-			break;
-		}
 
+        k_mutex_lock(&client_lock, K_FOREVER);
+        err = service_socket(err == 0);
+        k_mutex_unlock(&client_lock);
+        if (err) {
+            break;
+        }
     }
 
     printk("Disconnecting MQTT client...\n");
 
+    k_mutex_lock(&client_lock, K_FOREVER);
     err = mqtt_disconnect(&client_ctx);
+    k_mutex_unlock(&client_lock);
     if (err) {
         printk("Could not disconnect MQTT client: %d\n", err);
     }
     goto do_connect;
 }
+
+
+static void mqtt_tx_thread(void *p1, void *p2, void *p3) {
+    struct k_poll_event events[2];
+
+    k_poll_event_init(&events[0], K_POLL_TYPE_SIGNAL, K_POLL_MODE_NOTIFY_ONLY, &tx_signal);
+    bus_poll_event_init(&events[1], &mqtt_sub);
+
+    /* The first location brings the network up */
+    k_poll(&events[1], 1, K_FOREVER);
+    k_sem_give(&online);
+
+    while (1) {
+        k_mutex_lock(&client_lock, K_FOREVER);
+        bool up = connected;
+        k_timeout_t timeout = up ? deferred_wait() : K_FOREVER;
+        k_mutex_unlock(&client_lock);
+
+        /* Offline, bus messages wait in the queue until the CONNACK
+           raises the signal */
+        events[0].state = K_POLL_STATE_NOT_READY;
+        events[1].state = K_POLL_STATE_NOT_READY;
+        k_poll(events, up ? 2 : 1, timeout);
+        k_poll_signal_reset(&tx_signal);
+
+        k_mutex_lock(&client_lock, K_FOREVER);
+        if (connected) {
+            uint32_t start = k_cycle_get_32();
+            int sent = publish_pending();
+
+            if (psm.report && publish_psm() == 0) {
+                psm.report = false;
+                sent++;
+            }
+
+            if (sent > 0) {
+                stats.tx_wakeups++;
+                stats.tx_messages += sent;
+                account_service_time(start);
+                mqtt_service_print_stats();
+                uplink_sched_print_stats();
+            }
+        }
+        k_mutex_unlock(&client_lock);
+    }
+}
+
+
+void mqtt_service_start() {
+    k_tid_t tid = k_thread_create(&mqtt_thread_data, mqtt_stack,
+                    K_THREAD_STACK_SIZEOF(mqtt_stack), mqtt_thread,
+                    NULL, NULL, NULL, CONFIG_MQTT_THREAD_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(tid, "mqtt");
+
+    tid = k_thread_create(&mqtt_tx_thread_data, mqtt_tx_stack,
+                    K_THREAD_STACK_SIZEOF(mqtt_tx_stack), mqtt_tx_thread,
+                    NULL, NULL, NULL, CONFIG_MQTT_THREAD_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(tid, "mqtt_tx");
+}
+
+
+void mqtt_service_stats_get(struct mqtt_service_stats *out) {
+    *out = stats;
+    out->stack_size = K_THREAD_STACK_SIZEOF(mqtt_stack);
+    out->stack_unused = 0;
+    k_thread_stack_space_get(&mqtt_thread_data, &out->stack_unused);
+    out->tx_stack_size = K_THREAD_STACK_SIZEOF(mqtt_tx_stack);
+    out->tx_stack_unused = 0;
+    k_thread_stack_space_get(&mqtt_tx_thread_data, &out->tx_stack_unused);
+}
+
+
+void mqtt_service_print_stats() {
+    struct mqtt_service_stats s;
+    mqtt_service_stats_get(&s);
+
+    printk("MQTT thread: loops %u, rx %u, tx %u (%u msgs), idle %u, reconnects %u, "
+           "max service %u us, stack %u/%u used, uplink stack %u/%u used\n",
+        s.loops, s.rx_wakeups, s.tx_wakeups, s.tx_messages, s.idle_wakeups,
+        s.reconnects, s.max_service_us,
+        (unsigned int)(s.stack_size - s.stack_unused), (unsigned int)s.stack_size,
+        (unsigned int)(s.tx_stack_size - s.tx_stack_unused), (unsigned int)s.tx_stack_size);
+    printk("Downlink: weather %u bytes, %u redraws, %u pushes, %u stale; "
+           "config %u msgs, %u bytes not redrawn\n",
+        s.weather_bytes, s.redraws, s.pushes, s.stale_responses, s.config_msgs, s.config_bytes);
+    printk("Weather updates: %u full, %u delta, %u baseline misses\n",
+        s.full_updates, s.delta_updates, s.baseline_misses);
+    printk("MQTT bytes: tx %u (%u payload), rx %u (%u payload), %u sessions resumed\n",
+        s.tx_bytes, s.tx_payload_bytes, s.rx_bytes, s.rx_payload_bytes, s.sessions_resumed);
+    if (s.round_trips > 0) {
+        printk("Request round trip: %u up, %u down bytes on average over %u\n",
+            s.round_trip_up_bytes / s.round_trips, s.round_trip_down_bytes / s.round_trips,
+            s.round_trips);
+    }
+    if (s.jwt_signed > 0) {
+        printk("JWT: %u signed, first after %u ms with %s time\n",
+            s.jwt_signed, s.first_jwt_ms, time_source_name(s.first_jwt_source));
+    }
+}
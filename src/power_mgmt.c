@@ -0,0 +1,258 @@
+#include <zephyr.h>
+#include <device.h>
+#include <init.h>
+#include <pm/device.h>
+
+#include "power_mgmt.h"
+
+
+#if DT_NODE_HAS_STATUS(DT_INST(0, solomon_ssd16xxfb), okay)
+#define DISPLAY_BUS DEVICE_DT_GET(DT_BUS(DT_INST(0, solomon_ssd16xxfb)))
+#else
+#define DISPLAY_BUS NULL
+#endif
+
+#if defined(CONFIG_POWER_MGMT_CONSOLE) && DT_HAS_CHOSEN(zephyr_console)
+#define CONSOLE_UART DEVICE_DT_GET(DT_CHOSEN(zephyr_console))
+#else
+#define CONSOLE_UART NULL
+#endif
+
+
+struct domain {
+    const char *name;
+    const struct device *dev;
+    uint32_t idle_ms;
+    struct k_work_delayable idle_work;
+
+    int refs;
+    bool active;
+    /* Cleared when the device turns out not to support PM */
+    bool managed;
+
+    int64_t since;
+    int64_t active_ms;
+    int64_t suspended_ms;
+    uint32_t resumes;
+    uint32_t resume_total_us;
+    uint32_t resume_max_us;
+};
+
+/* Devices come out of boot active */
+static struct domain domains[POWER_DOMAIN_COUNT] = {
+    [POWER_DISPLAY] = {
+        .name = "display",
+        .dev = DISPLAY_BUS,
+        .idle_ms = CONFIG_POWER_MGMT_DISPLAY_IDLE_MS,
+        .active = true,
+        .managed = true,
+    },
+    [POWER_CONSOLE] = {
+        .name = "console",
+        .dev = CONSOLE_UART,
+        .idle_ms = CONFIG_POWER_MGMT_CONSOLE_IDLE_S * 1000,
+        .active = true,
+        .managed = true,
+    },
+};
+
+static K_MUTEX_DEFINE(lock);
+
+static uint32_t wake_start;
+static uint32_t wakes;
+static uint32_t wake_total_us;
+static uint32_t wake_max_us;
+
+
+/* Adds the time since the last state change to the current state */
+static void account(struct domain *d, int64_t now) {
+    if (d->active) {
+        d->active_ms += now - d->since;
+    } else {
+        d->suspended_ms += now - d->since;
+    }
+    d->since = now;
+}
+
+
+static int set_state(struct domain *d, enum pm_device_state state) {
+    if (d->dev == NULL || !d->managed) {
+        return -ENOTSUP;
+    }
+
+    int err = pm_device_state_set(d->dev, state);
+    if (err == -EALREADY) {
+        return 0;
+    }
+    if (err == -ENOTSUP || err == -ENOSYS) {
+        printk("No device PM on %s, leaving it on\n", d->name);
+        d->managed = false;
+    }
+
+    return err;
+}
+
+
+/* Called with the lock held */
+static int resume(struct domain *d) {
+    if (d->active) {
+        return 0;
+    }
+
+    uint32_t start = k_cycle_get_32();
+    int err = set_state(d, PM_DEVICE_STATE_ACTIVE);
+    if (err) {
+        printk("Could not resume %s: %d\n", d->name, err);
+        return err;
+    }
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+    account(d, k_uptime_get());
+    d->active = true;
+    d->resumes++;
+    d->resume_total_us += us;
+    d->resume_max_us = MAX(d->resume_max_us, us);
+
+    return 0;
+}
+
+
+static void idle_work_handler(struct k_work *work) {
+    struct domain *d = CONTAINER_OF(k_work_delayable_from_work(work), struct domain, idle_work);
+
+    k_mutex_lock(&lock, K_FOREVER);
+    /* Someone may have taken it while this was waiting for the lock */
+    if (d->refs == 0 && d->active && d->managed && d->dev != NULL) {
+        int err = set_state(d, PM_DEVICE_STATE_SUSPENDED);
+        if (err == 0) {
+            account(d, k_uptime_get());
+            d->active = false;
+        } else if (d->managed) {
+            printk("Could not suspend %s: %d\n", d->name, err);
+        }
+    }
+    k_mutex_unlock(&lock);
+}
+
+
+int power_mgmt_get(enum power_domain domain) {
+    struct domain *d = &domains[domain];
+
+    k_mutex_lock(&lock, K_FOREVER);
+    d->refs++;
+    k_work_cancel_delayable(&d->idle_work);
+    int err = resume(d);
+    k_mutex_unlock(&lock);
+
+    return err;
+}
+
+
+void power_mgmt_put(enum power_domain domain) {
+    struct domain *d = &domains[domain];
+
+    k_mutex_lock(&lock, K_FOREVER);
+    if (d->refs > 0 && --d->refs == 0) {
+        k_work_reschedule(&d->idle_work, K_MSEC(d->idle_ms));
+    }
+    k_mutex_unlock(&lock);
+}
+
+
+/* Runs on the system work queue, like the button's press handling, so
+   everything is resumed before the press is acted on */
+static void wake_work_handler(struct k_work *work) {
+    for (int i = 0; i < POWER_DOMAIN_COUNT; i++) {
+        power_mgmt_get(i);
+    }
+
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - wake_start);
+    wakes++;
+    wake_total_us += us;
+    wake_max_us = MAX(wake_max_us, us);
+
+    /* Starts the idle time over */
+    for (int i = 0; i < POWER_DOMAIN_COUNT; i++) {
+        power_mgmt_put(i);
+    }
+}
+
+K_WORK_DEFINE(wake_work, wake_work_handler);
+
+
+void power_mgmt_wake() {
+    /* A second wake before the first ran is measured from the first */
+    if (!k_work_is_pending(&wake_work)) {
+        wake_start = k_cycle_get_32();
+    }
+    k_work_submit(&wake_work);
+}
+
+
+void power_mgmt_print_stats() {
+    struct domain snap[POWER_DOMAIN_COUNT];
+    int64_t now = k_uptime_get();
+
+    k_mutex_lock(&lock, K_FOREVER);
+    for (int i = 0; i < POWER_DOMAIN_COUNT; i++) {
+        account(&domains[i], now);
+        snap[i] = domains[i];
+    }
+    k_mutex_unlock(&lock);
+
+    printk("Power: domain  active s  suspended s  resumes  resume us mean/max\n");
+    for (int i = 0; i < POWER_DOMAIN_COUNT; i++) {
+        const struct domain *d = &snap[i];
+        int64_t total = MAX(d->active_ms + d->suspended_ms, 1);
+
+        if (d->dev == NULL || !d->managed) {
+            printk("  %-12s always on, no device PM\n", d->name);
+            continue;
+        }
+        printk("  %-12s %8u %8u (%2u%%) %8u %8u/%u\n", d->name,
+            (unsigned int)(d->active_ms / 1000), (unsigned int)(d->suspended_ms / 1000),
+            (unsigned int)(d->suspended_ms * 100 / total), d->resumes,
+            d->resumes ? d->resume_total_us / d->resumes : 0, d->resume_max_us);
+    }
+    printk("Power: %u wakes, button to resumed %u/%u us mean/max\n",
+        wakes, wakes ? wake_total_us / wakes : 0, wake_max_us);
+}
+
+
+#if CONFIG_POWER_MGMT_STATS_INTERVAL_S > 0
+
+static void stats_work_handler(struct k_work *work);
+
+K_WORK_DELAYABLE_DEFINE(stats_work, stats_work_handler);
+
+static void stats_work_handler(struct k_work *work) {
+    /* Nothing would come out of a suspended console */
+    power_mgmt_get(POWER_CONSOLE);
+    power_mgmt_print_stats();
+    power_mgmt_put(POWER_CONSOLE);
+    k_work_schedule(&stats_work, K_SECONDS(CONFIG_POWER_MGMT_STATS_INTERVAL_S));
+}
+
+#endif
+
+
+static int power_mgmt_init(const struct device *dev) {
+    int64_t now = k_uptime_get();
+
+    for (int i = 0; i < POWER_DOMAIN_COUNT; i++) {
+        struct domain *d = &domains[i];
+
+        d->since = now;
+        k_work_init_delayable(&d->idle_work, idle_work_handler);
+        /* Suspended unless someone takes it before the idle time is up */
+        k_work_schedule(&d->idle_work, K_MSEC(d->idle_ms));
+    }
+
+#if CONFIG_POWER_MGMT_STATS_INTERVAL_S > 0
+    k_work_schedule(&stats_work, K_SECONDS(CONFIG_POWER_MGMT_STATS_INTERVAL_S));
+#endif
+
+    return 0;
+}
+
+SYS_INIT(power_mgmt_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
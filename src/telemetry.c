@@ -0,0 +1,172 @@
+#include <zephyr.h>
+#include <string.h>
+#include <sys/byteorder.h>
+
+#include "telemetry.h"
+
+
+/* Upper bounds of the TTFF bins in seconds, the last bin is open */
+static const uint8_t ttff_bounds_s[TELEMETRY_TTFF_BINS - 1] = { 5, 10, 20, 40, 80 };
+
+/* C/N0 bins are 5 dB-Hz wide from 15 dB-Hz */
+#define CN0_FIRST_BOUND_DB 15
+#define CN0_BIN_DB         5
+
+
+static struct k_spinlock lock;
+
+struct summary {
+    int64_t start;
+    uint16_t sessions;
+    uint16_t fixes;
+    uint32_t ttff_min_ms;
+    uint32_t ttff_max_ms;
+    uint32_t ttff_total_ms;
+    uint16_t ttff_hist[TELEMETRY_TTFF_BINS];
+    uint16_t cn0_hist[TELEMETRY_CN0_BINS];
+    uint8_t in_fix_min;
+    uint8_t in_fix_max;
+    uint32_t in_fix_total;
+    uint16_t rsrp_samples;
+    int16_t rsrp_min;
+    int16_t rsrp_max;
+    int32_t rsrp_total;
+    uint16_t reconnects;
+};
+
+static struct summary t;
+
+
+static void inc_sat(uint16_t *counter) {
+    if (*counter < UINT16_MAX) {
+        (*counter)++;
+    }
+}
+
+
+void telemetry_gnss_start() {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    inc_sat(&t.sessions);
+    k_spin_unlock(&lock, key);
+}
+
+
+void telemetry_gnss_pvt(const struct nrf_modem_gnss_pvt_data_frame *pvt) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    for (int i = 0; i < NRF_MODEM_GNSS_MAX_SATELLITES; i++) {
+        if (pvt->sv[i].sv == 0) {
+            continue;
+        }
+
+        /* cn0 is in 0.1 dB-Hz */
+        int db = pvt->sv[i].cn0 / 10;
+        int bin = db < CN0_FIRST_BOUND_DB ? 0 : (db - CN0_FIRST_BOUND_DB) / CN0_BIN_DB + 1;
+        inc_sat(&t.cn0_hist[MIN(bin, TELEMETRY_CN0_BINS - 1)]);
+    }
+    k_spin_unlock(&lock, key);
+}
+
+
+void telemetry_gnss_fix(uint32_t ttff_ms, uint8_t in_fix) {
+    int bin = 0;
+    while (bin < ARRAY_SIZE(ttff_bounds_s) && ttff_ms >= ttff_bounds_s[bin] * 1000U) {
+        bin++;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (t.fixes == 0 || ttff_ms < t.ttff_min_ms) {
+        t.ttff_min_ms = ttff_ms;
+    }
+    if (t.fixes == 0 || in_fix < t.in_fix_min) {
+        t.in_fix_min = in_fix;
+    }
+    t.ttff_max_ms = MAX(t.ttff_max_ms, ttff_ms);
+    t.ttff_total_ms += ttff_ms;
+    t.in_fix_max = MAX(t.in_fix_max, in_fix);
+    t.in_fix_total += in_fix;
+    inc_sat(&t.ttff_hist[bin]);
+    inc_sat(&t.fixes);
+    k_spin_unlock(&lock, key);
+}
+
+
+void telemetry_link(int16_t rsrp_dbm) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (t.rsrp_samples == 0 || rsrp_dbm < t.rsrp_min) {
+        t.rsrp_min = rsrp_dbm;
+    }
+    if (t.rsrp_samples == 0 || rsrp_dbm > t.rsrp_max) {
+        t.rsrp_max = rsrp_dbm;
+    }
+    t.rsrp_total += rsrp_dbm;
+    inc_sat(&t.rsrp_samples);
+    k_spin_unlock(&lock, key);
+}
+
+
+void telemetry_reconnect() {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    inc_sat(&t.reconnects);
+    k_spin_unlock(&lock, key);
+}
+
+
+static uint8_t *put_le16(uint8_t *p, uint16_t v) {
+    sys_put_le16(v, p);
+    return p + 2;
+}
+
+
+static uint8_t clamp_i8(int32_t v) {
+    return (uint8_t)(int8_t)MIN(MAX(v, INT8_MIN), INT8_MAX);
+}
+
+
+int telemetry_take(uint8_t *buf, size_t size) {
+    if (size < TELEMETRY_MSG_SIZE) {
+        return -ENOMEM;
+    }
+
+    int64_t now = k_uptime_get();
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct summary s = t;
+    memset(&t, 0, sizeof(t));
+    t.start = now;
+    k_spin_unlock(&lock, key);
+
+    if (s.sessions == 0 && s.rsrp_samples == 0 && s.reconnects == 0) {
+        return 0;
+    }
+
+    /* Means are 0 without samples, like min and max */
+    uint32_t fixes = MAX(s.fixes, 1);
+    uint32_t samples = MAX(s.rsrp_samples, 1);
+    uint8_t *p = buf;
+
+    *p++ = TELEMETRY_VERSION;
+    sys_put_le32((uint32_t)((now - s.start) / 1000), p);
+    p += 4;
+    p = put_le16(p, s.sessions);
+    p = put_le16(p, s.fixes);
+    p = put_le16(p, MIN(s.ttff_min_ms / 100, UINT16_MAX));
+    p = put_le16(p, MIN(s.ttff_max_ms / 100, UINT16_MAX));
+    p = put_le16(p, MIN(s.ttff_total_ms / fixes / 100, UINT16_MAX));
+    for (int i = 0; i < TELEMETRY_TTFF_BINS; i++) {
+        p = put_le16(p, s.ttff_hist[i]);
+    }
+    for (int i = 0; i < TELEMETRY_CN0_BINS; i++) {
+        p = put_le16(p, s.cn0_hist[i]);
+    }
+    *p++ = s.in_fix_min;
+    *p++ = s.in_fix_max;
+    *p++ = (uint8_t)(s.in_fix_total / fixes);
+    p = put_le16(p, s.rsrp_samples);
+    *p++ = clamp_i8(s.rsrp_min);
+    *p++ = clamp_i8(s.rsrp_max);
+    *p++ = clamp_i8(s.rsrp_total / (int32_t)samples);
+    p = put_le16(p, s.reconnects);
+
+    __ASSERT_NO_MSG(p - buf == TELEMETRY_MSG_SIZE);
+    return p - buf;
+}
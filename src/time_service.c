@@ -0,0 +1,219 @@
+#include <zephyr.h>
+#include <date_time.h>
+#include <settings/settings.h>
+
+#include "time_service.h"
+
+/* Uncertainty of a network source when it was read. The modem clock
+   has whole seconds, and NITZ may be a second or so late on top. */
+#define MODEM_UNCERTAINTY_MS 2000
+#define NTP_UNCERTAINTY_MS   250
+
+
+static struct k_spinlock lock;
+
+/* Source date_time_now() last synced from, and the uptime it did */
+static enum time_source network_source;
+static int64_t network_sync_time;
+
+/* Time saved before the last reboot */
+static int64_t persisted_ms;
+static bool persisted_valid;
+
+/* Uptime each source first gave the time at, -1 if it never did */
+static int64_t first_valid[TIME_SOURCE_COUNT] = { [0 ... TIME_SOURCE_COUNT - 1] = -1 };
+static uint32_t syncs[TIME_SOURCE_COUNT];
+static uint32_t sync_failures;
+
+K_SEM_DEFINE(time_updated, 0, 1);
+
+
+static const char *const source_names[TIME_SOURCE_COUNT] = {
+    [TIME_SOURCE_NONE] = "no",
+    [TIME_SOURCE_PERSISTED] = "persisted",
+    [TIME_SOURCE_MODEM] = "modem",
+    [TIME_SOURCE_NTP] = "NTP",
+};
+
+const char *time_source_name(enum time_source source) {
+    return source < TIME_SOURCE_COUNT ? source_names[source] : "unknown";
+}
+
+
+#if defined(CONFIG_TIME_PERSIST)
+
+static void persist_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(persist_work, persist_handler);
+
+static int time_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg) {
+    const char *next;
+    if (settings_name_steq(name, "last", &next) && !next) {
+        if (len != sizeof(persisted_ms)) {
+            return -EINVAL;
+        }
+        int rc = read_cb(cb_arg, &persisted_ms, sizeof(persisted_ms));
+        persisted_valid = (rc == sizeof(persisted_ms));
+        return rc < 0 ? rc : 0;
+    }
+
+    return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(time, "time", NULL, time_settings_set, NULL, NULL);
+
+
+static void persist_handler(struct k_work *work) {
+    struct time_estimate t;
+
+    if (time_service_now(&t) == 0) {
+        /* Save the earliest the time can be, so it stays a lower bound */
+        int64_t earliest = t.unix_ms;
+        if (t.uncertainty_ms != TIME_UNCERTAINTY_UNBOUNDED) {
+            earliest -= t.uncertainty_ms;
+        }
+
+        int err = settings_save_one("time/last", &earliest, sizeof(earliest));
+        if (err) {
+            printk("Could not save the time, err %d\n", err);
+        }
+    }
+
+    k_work_schedule(&persist_work, K_SECONDS(CONFIG_TIME_PERSIST_INTERVAL_S));
+}
+
+#endif /* CONFIG_TIME_PERSIST */
+
+
+static void date_time_evt_handler(const struct date_time_evt *evt) {
+    enum time_source source;
+
+    switch (evt->type) {
+    case DATE_TIME_OBTAINED_MODEM:
+        source = TIME_SOURCE_MODEM;
+        break;
+
+    case DATE_TIME_OBTAINED_NTP:
+        source = TIME_SOURCE_NTP;
+        break;
+
+    case DATE_TIME_NOT_OBTAINED:
+        /* date_time tries again after its update interval */
+        sync_failures++;
+        return;
+
+    default:
+        return;
+    }
+
+    int64_t now = k_uptime_get();
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    bool first = (network_source == TIME_SOURCE_NONE);
+    network_source = source;
+    network_sync_time = now;
+    if (first_valid[source] < 0) {
+        first_valid[source] = now;
+    }
+    syncs[source]++;
+    k_spin_unlock(&lock, key);
+
+    if (first) {
+        printk("Time from %s after %u ms\n", time_source_name(source), (uint32_t)now);
+#if defined(CONFIG_TIME_PERSIST)
+        k_work_reschedule(&persist_work, K_NO_WAIT);
+#endif
+    }
+
+    k_sem_give(&time_updated);
+}
+
+
+int time_service_init() {
+#if defined(CONFIG_TIME_PERSIST)
+    int err = settings_subsys_init();
+    if (err) {
+        printk("Could not init settings, err %d\n", err);
+        return err;
+    }
+
+    err = settings_load_subtree("time");
+    if (err) {
+        printk("Could not load the time, err %d\n", err);
+    }
+
+    if (persisted_valid) {
+        first_valid[TIME_SOURCE_PERSISTED] = k_uptime_get();
+        syncs[TIME_SOURCE_PERSISTED]++;
+        printk("Persisted time %u s\n", (uint32_t)(persisted_ms / 1000));
+        k_sem_give(&time_updated);
+    }
+
+    k_work_schedule(&persist_work, K_SECONDS(CONFIG_TIME_PERSIST_INTERVAL_S));
+#endif
+
+    return 0;
+}
+
+
+void time_service_start() {
+    int err = date_time_update_async(date_time_evt_handler);
+    if (err) {
+        printk("Could not start time sync, err %d\n", err);
+    }
+}
+
+
+int time_service_now(struct time_estimate *t) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    enum time_source source = network_source;
+    int64_t since_sync = k_uptime_get() - network_sync_time;
+    k_spin_unlock(&lock, key);
+
+    if (source != TIME_SOURCE_NONE && date_time_now(&t->unix_ms) == 0) {
+        uint32_t base = (source == TIME_SOURCE_NTP) ? NTP_UNCERTAINTY_MS : MODEM_UNCERTAINTY_MS;
+        t->uncertainty_ms = base + (uint32_t)(since_sync * CONFIG_TIME_DRIFT_PPM / 1000000);
+        t->source = source;
+        return 0;
+    }
+
+    if (persisted_valid) {
+        /* At least the uptime has passed since it was saved */
+        t->unix_ms = persisted_ms + k_uptime_get();
+        t->uncertainty_ms = TIME_UNCERTAINTY_UNBOUNDED;
+        t->source = TIME_SOURCE_PERSISTED;
+        return 0;
+    }
+
+    return -ENODATA;
+}
+
+
+int time_service_wait(k_timeout_t timeout) {
+    return k_sem_take(&time_updated, timeout);
+}
+
+
+void time_service_print_stats() {
+    struct time_estimate t;
+
+    if (time_service_now(&t) != 0) {
+        printk("Time: none yet, %u sync failures\n", sync_failures);
+        return;
+    }
+
+    if (t.uncertainty_ms == TIME_UNCERTAINTY_UNBOUNDED) {
+        printk("Time: %u s from %s, lower bound\n",
+            (uint32_t)(t.unix_ms / 1000), time_source_name(t.source));
+    } else {
+        printk("Time: %u s from %s, +-%u ms\n",
+            (uint32_t)(t.unix_ms / 1000), time_source_name(t.source), t.uncertainty_ms);
+    }
+
+    for (int i = TIME_SOURCE_PERSISTED; i < TIME_SOURCE_COUNT; i++) {
+        if (first_valid[i] >= 0) {
+            printk("  %s: first after %u ms, %u syncs\n",
+                time_source_name(i), (uint32_t)first_valid[i], syncs[i]);
+        }
+    }
+    printk("  %u sync failures\n", sync_failures);
+}
@@ -0,0 +1,102 @@
+#include <zephyr.h>
+#include <modem/lte_lc.h>
+
+#include "uplink_sched.h"
+#include "telemetry.h"
+
+#define ENERGY_LEVELS (LTE_LC_ENERGY_CONSUMPTION_EFFICIENT - LTE_LC_ENERGY_CONSUMPTION_EXCESSIVE + 1)
+
+/* The modem reports RSRP as an index, 0 is below -140 dBm */
+#ifndef RSRP_IDX_TO_DBM
+#define RSRP_IDX_TO_DBM(idx) ((idx) - 140)
+#endif
+
+
+static struct lte_lc_conn_eval_params last_eval;
+static bool last_eval_valid;
+static int64_t last_eval_time;
+
+/* Uplinks sent per energy estimate, excessive (5) to efficient (9) */
+static uint32_t tx_per_energy[ENERGY_LEVELS];
+static uint32_t tx_unknown_energy;
+static uint32_t tx_deferred;
+static uint32_t tx_deadline;
+
+
+static bool evaluate() {
+    int64_t now = k_uptime_get();
+
+    /* Each evaluation is an AT command round trip to the modem,
+       so reuse a recent result. */
+    if (last_eval_time != 0 &&
+        now - last_eval_time < CONFIG_UPLINK_EVAL_INTERVAL_S * 1000LL) {
+        return last_eval_valid;
+    }
+
+    int err = lte_lc_conn_eval_params_get(&last_eval);
+    last_eval_time = now;
+    last_eval_valid = (err == 0);
+
+    if (err != 0) {
+        /* Positive values mean no cell or not connected */
+        printk("Connection evaluation failed: %d\n", err);
+    }
+
+    return last_eval_valid;
+}
+
+
+bool uplink_sched_ready(enum uplink_priority prio, int64_t queued_at) {
+    if (prio == UPLINK_URGENT) {
+        return true;
+    }
+
+    if (k_uptime_get() - queued_at >= CONFIG_UPLINK_DEFER_DEADLINE_S * 1000LL) {
+        printk("Uplink deadline reached\n");
+        tx_deadline++;
+        return true;
+    }
+
+    if (!evaluate()) {
+        return false;
+    }
+
+    if (last_eval.energy_estimate < CONFIG_UPLINK_MIN_ENERGY_ESTIMATE) {
+        return false;
+    }
+
+    if (k_uptime_get() - queued_at > CONFIG_UPLINK_EVAL_INTERVAL_S * 1000LL) {
+        tx_deferred++;
+    }
+    return true;
+}
+
+
+void uplink_sched_transmitted(enum uplink_priority prio) {
+    if (!evaluate()) {
+        tx_unknown_energy++;
+        return;
+    }
+
+    telemetry_link(RSRP_IDX_TO_DBM(last_eval.rsrp));
+
+    int level = last_eval.energy_estimate - LTE_LC_ENERGY_CONSUMPTION_EXCESSIVE;
+    if (level >= 0 && level < ENERGY_LEVELS) {
+        tx_per_energy[level]++;
+    } else {
+        tx_unknown_energy++;
+    }
+
+    printk("%s uplink at energy estimate %d, RSRP %d dBm, CE level %d\n",
+        prio == UPLINK_URGENT ? "Urgent" : "Deferrable",
+        last_eval.energy_estimate, RSRP_IDX_TO_DBM(last_eval.rsrp), last_eval.ce_level);
+}
+
+
+void uplink_sched_print_stats() {
+    printk("Uplinks per energy estimate 5..9: %u %u %u %u %u, unknown %u, "
+           "deferred %u, sent at deadline %u\n",
+        tx_per_energy[0], tx_per_energy[1], tx_per_energy[2],
+        tx_per_energy[3], tx_per_energy[4], tx_unknown_energy,
+        tx_deferred, tx_deadline);
+}